@@ -33,6 +33,7 @@
 #include "recovery_ui.h"
 #include "adb_install.h"
 #include "minadbd/adb.h"
+#include "verifier.h"
 
 static void
 set_usb_driver(int enabled) {
@@ -97,6 +98,23 @@ void *adb_sideload_thread(void* v) {
     return NULL;
 }
 
+// Read the hashes minadbd computed while the package arrived.  They are
+// only trusted from a directory nobody but root can write to.
+static int
+read_sideload_digest(StreamDigest* digest) {
+    struct stat st;
+    if (lstat(ADB_SIDELOAD_DIGEST_DIR, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != 0 || (st.st_mode & 077) != 0) {
+        return 0;
+    }
+    int fd = open(ADB_SIDELOAD_DIGEST_FILENAME, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return 0;
+    int ok = read(fd, digest, sizeof(*digest)) == sizeof(*digest);
+    close(fd);
+    return ok;
+}
+
 int
 apply_from_adb() {
     stop_adbd();
@@ -142,7 +160,10 @@ apply_from_adb() {
         return INSTALL_ERROR;
     }
 
-    int install_status = install_package(ADB_SIDELOAD_FILENAME);
+    StreamDigest digest;
+    int have_digest = read_sideload_digest(&digest);
+    int install_status = install_sideloaded_package(ADB_SIDELOAD_FILENAME,
+                                                    have_digest ? &digest : NULL);
     ui_reset_progress();
 
     if (install_status != INSTALL_SUCCESS) {
@@ -163,5 +184,6 @@ apply_from_adb() {
         ui_set_background(BACKGROUND_ICON_NONE);
 
     remove(ADB_SIDELOAD_FILENAME);
+    remove(ADB_SIDELOAD_DIGEST_FILENAME);
     return install_status;
 }
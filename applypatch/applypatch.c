@@ -25,7 +25,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#include "mincrypt/sha.h"
+#include "minhash/Sha.h"
 #include "applypatch.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
@@ -38,7 +38,7 @@ static int GenerateTarget(FileContents* source_file,
                           const Value* copy_patch_value,
                           const char* source_filename,
                           const char* target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_SIZE],
+                          const uint8_t target_sha1[MH_SHA1_DIGEST_SIZE],
                           size_t target_size,
                           const Value* bonus_data);
 
@@ -101,7 +101,7 @@ int LoadFileContents(const char* filename, FileContents* file,
         }
     }
 
-    SHA_hash(file->data, file->size, file->sha1);
+    mhSha1(file->data, file->size, file->sha1);
     return 0;
 }
 
@@ -221,9 +221,9 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             }
     }
 
-    SHA_CTX sha_ctx;
-    SHA_init(&sha_ctx);
-    uint8_t parsed_sha[SHA_DIGEST_SIZE];
+    MhSha1Ctx sha_ctx;
+    mhSha1Init(&sha_ctx);
+    uint8_t parsed_sha[MH_SHA1_DIGEST_SIZE];
 
     // allocate enough memory to hold the largest size.
     file->data = malloc(size[index[pairs-1]]);
@@ -253,15 +253,15 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                 file->data = NULL;
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            mhSha1Update(&sha_ctx, p, read);
             file->size += read;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
         // check it against this pair's expected hash.
-        SHA_CTX temp_ctx;
-        memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        MhSha1Ctx temp_ctx;
+        memcpy(&temp_ctx, &sha_ctx, sizeof(MhSha1Ctx));
+        const uint8_t* sha_so_far = mhSha1Final(&temp_ctx);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
@@ -271,7 +271,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             return -1;
         }
 
-        if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
+        if (memcmp(sha_so_far, parsed_sha, MH_SHA1_DIGEST_SIZE) == 0) {
             // we have a match.  stop reading the partition; we'll return
             // the data we've read so far.
             printf("partition read matched size %d sha %s\n",
@@ -303,8 +303,8 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         return -1;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
-    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+    const uint8_t* sha_final = mhSha1Final(&sha_ctx);
+    for (i = 0; i < MH_SHA1_DIGEST_SIZE; ++i) {
         file->sha1[i] = sha_final[i];
     }
 
@@ -541,7 +541,7 @@ int ParseSha1(const char* str, uint8_t* digest) {
     int i;
     const char* ps = str;
     uint8_t* pd = digest;
-    for (i = 0; i < SHA_DIGEST_SIZE * 2; ++i, ++ps) {
+    for (i = 0; i < MH_SHA1_DIGEST_SIZE * 2; ++i, ++ps) {
         int digit;
         if (*ps >= '0' && *ps <= '9') {
             digit = *ps - '0';
@@ -569,10 +569,10 @@ int ParseSha1(const char* str, uint8_t* digest) {
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches) {
     int i;
-    uint8_t patch_sha1[SHA_DIGEST_SIZE];
+    uint8_t patch_sha1[MH_SHA1_DIGEST_SIZE];
     for (i = 0; i < num_patches; ++i) {
         if (ParseSha1(patch_sha1_str[i], patch_sha1) == 0 &&
-            memcmp(patch_sha1, sha1, SHA_DIGEST_SIZE) == 0) {
+            memcmp(patch_sha1, sha1, MH_SHA1_DIGEST_SIZE) == 0) {
             return i;
         }
     }
@@ -725,7 +725,7 @@ int applypatch(const char* source_filename,
         target_filename = source_filename;
     }
 
-    uint8_t target_sha1[SHA_DIGEST_SIZE];
+    uint8_t target_sha1[MH_SHA1_DIGEST_SIZE];
     if (ParseSha1(target_sha1_str, target_sha1) != 0) {
         printf("failed to parse tgt-sha1 \"%s\"\n", target_sha1_str);
         return 1;
@@ -741,7 +741,7 @@ int applypatch(const char* source_filename,
     // We try to load the target file into the source_file object.
     if (LoadFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
-        if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
+        if (memcmp(source_file.sha1, target_sha1, MH_SHA1_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
@@ -812,11 +812,11 @@ static int GenerateTarget(FileContents* source_file,
                           const Value* copy_patch_value,
                           const char* source_filename,
                           const char* target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_SIZE],
+                          const uint8_t target_sha1[MH_SHA1_DIGEST_SIZE],
                           size_t target_size,
                           const Value* bonus_data) {
     int retry = 1;
-    SHA_CTX ctx;
+    MhSha1Ctx ctx;
     int output;
     MemorySinkInfo msi;
     FileContents* source_to_use;
@@ -957,7 +957,7 @@ static int GenerateTarget(FileContents* source_file,
         char* header = patch->data;
         ssize_t header_bytes_read = patch->size;
 
-        SHA_init(&ctx);
+        mhSha1Init(&ctx);
 
         int result;
 
@@ -995,8 +995,8 @@ static int GenerateTarget(FileContents* source_file,
         }
     } while (retry-- > 0);
 
-    const uint8_t* current_target_sha1 = SHA_final(&ctx);
-    if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
+    const uint8_t* current_target_sha1 = mhSha1Final(&ctx);
+    if (memcmp(current_target_sha1, target_sha1, MH_SHA1_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
     }
@@ -18,17 +18,17 @@
 #define _APPLYPATCH_H
 
 #include <sys/stat.h>
-#include "mincrypt/sha.h"
+#include "minhash/Sha.h"
 #include "minelf/Retouch.h"
 #include "edify/expr.h"
 
 typedef struct _Patch {
-  uint8_t sha1[SHA_DIGEST_SIZE];
+  uint8_t sha1[MH_SHA1_DIGEST_SIZE];
   const char* patch_filename;
 } Patch;
 
 typedef struct _FileContents {
-  uint8_t sha1[SHA_DIGEST_SIZE];
+  uint8_t sha1[MH_SHA1_DIGEST_SIZE];
   unsigned char* data;
   ssize_t size;
   struct stat st;
@@ -72,7 +72,7 @@ int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx);
+                     SinkFn sink, void* token, MhSha1Ctx* ctx);
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
@@ -80,7 +80,7 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    SinkFn sink, void* token, MhSha1Ctx* ctx,
                     const Value* bonus_data);
 
 // freecache.c
@@ -1,8 +1,6 @@
 #include <stdio.h>
 #include <sys/stat.h>
-#include <openssl/md5.h>
-#include <openssl/sha.h>
-#include <openssl/ripemd.h>
+#include "minhash/Sha.h"
 #include <assert.h>
 #include <errno.h>
 #include <dirent.h>
@@ -13,20 +11,47 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <paths.h>
+#include <libgen.h>
 #include <sys/wait.h>
 
-#define DEDUPE_VERSION 2
+#include "manifest.h"
+#include "refcount.h"
+#include "verify.h"
+
+#define DEDUPE_VERSION MANIFEST_VERSION
 #define ARRAY_CAPACITY 1000
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define MAX_RESTORE_THREADS 8
+
+// copy_file_range only works within one filesystem on most kernels, so
+// any failure before the first byte falls back to a plain copy.
+static int copy_fd_range(int srcfd, int dstfd) {
+#ifdef __NR_copy_file_range
+    ssize_t copied;
+    int total = 0;
+    while ((copied = syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, COPY_BUFFER_SIZE, 0)) > 0)
+        total = 1;
+    if (copied == 0)
+        return 0;
+    return total ? -2 : -1;
+#else
+    return -1;
+#endif
+}
+
+// buf must hold COPY_BUFFER_SIZE bytes
+static int copy_file(const char *src, const char *dst, char *buf) {
+    int dstfd, srcfd, ret = 0;
+    ssize_t bytes_read;
     if (src == NULL)
         return 1;
     if (dst == NULL)
@@ -42,45 +67,63 @@ static int copy_file(const char *src, const char *dst) {
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+    int range = copy_fd_range(srcfd, dstfd);
+    if (range == -2)
+        ret = 5;
+    else if (range == -1) {
+        while ((bytes_read = read(srcfd, buf, COPY_BUFFER_SIZE)) != 0) {
+            if (bytes_read < 0) {
+                if (errno == EINTR)
+                    continue;
+                ret = 5;
+                break;
+            }
+            if (write(dstfd, buf, bytes_read) != bytes_read) {
+                ret = 5;
+                break;
+            }
+        }
     }
 
-    close(dstfd);
+    if (close(dstfd) && ret == 0)
+        ret = 5;
     close(srcfd);
 
-    return 0;
+    return ret;
 }
 
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    struct manifest_writer manifest;
     const char** excludes;
     int exclude_count;
+    struct refs_list keys;
 };
 
 static void usage(char** argv) {
     fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory [path...]\n", argv[0]);
     fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s convert input_manifest output_manifest\n", argv[0]);
+    fprintf(stderr, "usage: %s verify blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s stats blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "gc keeps a reference count index in blob_dir/.refs; remove it to force a full scan.\n");
 }
 
 static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
     char rdata[BUFSIZ];
     int rsize;
-    SHA256_CTX c;
+    MhSha256Ctx c;
 
-    SHA256_Init(&c);
+    mhSha256Init(&c);
     while(!feof(mfile)) {
         rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
         if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+            mhSha256Update(&c, rdata, rsize);
         }
     }
 
-    SHA256_Final(rptr, &c);
+    memcpy(rptr, mhSha256Final(&c), MH_SHA256_DIGEST_SIZE);
 }
 
 static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
@@ -96,13 +139,9 @@ static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, st.st_atime, st.st_mtime, st.st_ctime, f);
-}
-
 static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
     printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    unsigned char sumdata[MH_SHA256_DIGEST_SIZE];
     int ret;
     if (ret = do_sha256sum_file(f, sumdata)) {
         fprintf(stderr, "Error calculating sha256sum of %s\n", f);
@@ -110,16 +149,16 @@ static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, cons
     }
     char psum[128];
     int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+    for (j = 0; j < MH_SHA256_DIGEST_SIZE; j++)
         sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    psum[(MH_SHA256_DIGEST_SIZE * 2)] = '\0';
 
     // if a hash is abcdefg,
     // the output blob name is abc/defg
     // this is to get around vfat having a 64k directory size limit (usually around 20k files)
     char out_blob[PATH_MAX];
     char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    char key[MH_SHA256_DIGEST_SIZE * 2 + 2];
     // int i = 0;
     // int keyIndex = 0;
     // while (psum[i]) {
@@ -137,7 +176,10 @@ static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, cons
     strcat(key, psum + 3);
     sprintf(out_blob, "%s/%s", context->blob_dir, key);
     sprintf(tmp_out_blob, "%s.tmp", out_blob);
-    mkdir(dirname(out_blob), S_IRWXU | S_IRWXG | S_IRWXO);
+    // glibc's dirname modifies its argument
+    char blob_parent[PATH_MAX];
+    strcpy(blob_parent, out_blob);
+    mkdir(dirname(blob_parent), S_IRWXU | S_IRWXG | S_IRWXO);
 
     // don't copy the file if it exists? not quite sure how I feel about this.
     int size = (int)st.st_size;
@@ -151,13 +193,15 @@ static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, cons
     }
     if (!file_ok) {
         // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
+        static char copy_buffer[COPY_BUFFER_SIZE];
+        if ((ret = copy_file(f, tmp_out_blob, copy_buffer)) || (ret = rename(tmp_out_blob, out_blob))) {
             fprintf(stderr, "Error copying blob %s\n", f);
             return ret;
         }
     }
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
+    manifest_writer_add(&context->manifest, MANIFEST_TYPE_FILE, &st, f, NULL, sumdata);
+    refs_list_add(&context->keys, sumdata, 1);
     return 0;
 }
 
@@ -210,22 +254,19 @@ static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, cons
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
+    manifest_writer_add(&context->manifest, MANIFEST_TYPE_LINK, &st, l, link, NULL);
     return 0;
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
         return store_file(context, st, s);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
+        manifest_writer_add(&context->manifest, MANIFEST_TYPE_DIR, &st, s, NULL, NULL);
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
         return store_link(context, st, s);
     }
     else {
@@ -234,35 +275,6 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
-        }
-
-        *out = *line;
-        out++;
-        line++;
-    }
-
-    *out = '\0';
-    // resume at the next char
-    return ++line;
-}
-
-static int dec_to_oct(int dec) {
-    int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
-    }
-
-    return ret;
-}
-
 struct array {
     void** data;
     int size;
@@ -318,6 +330,9 @@ static void recursive_list_dir(char* d, struct array *arr) {
             continue;
         if (strcmp(ep->d_name, "..") == 0)
             continue;
+        // blobs are hex; dot files are the reference index
+        if (ep->d_name[0] == '.')
+            continue;
         struct stat cst;
         int ret;
         char blob[PATH_MAX];
@@ -342,6 +357,288 @@ static int check_file(const char* f) {
     return lstat(f, &cst);
 }
 
+typedef void (*manifest_blob_callback)(const unsigned char* digest, void* cookie);
+
+// calls "callback" with the digest of every file blob in a manifest
+static int read_manifest_blobs(const char* path, manifest_blob_callback callback, void* cookie) {
+    struct dedupe_manifest manifest;
+    if (manifest_open(path, &manifest))
+        return 1;
+
+    uint32_t i;
+    for (i = 0; i < manifest.header->record_count; i++) {
+        if (manifest.records[i].type == MANIFEST_TYPE_FILE)
+            callback(manifest.records[i].digest, cookie);
+    }
+    manifest_close(&manifest);
+    return 0;
+}
+
+struct blob_path_cookie {
+    const char* blob_dir;
+    struct array* arr;
+};
+
+static void add_blob_path(const unsigned char* digest, void* cookie) {
+    struct blob_path_cookie* c = (struct blob_path_cookie*) cookie;
+    char blob[PATH_MAX];
+    refs_blob_path(c->blob_dir, digest, blob);
+    array_add(c->arr, strdup(blob));
+}
+
+// Full mark and sweep: list every blob and delete the ones no manifest
+// references.  Only used to seed a store that has no reference index.
+static int full_gc(const char* blob_dir, char** manifests, int manifest_count) {
+    struct array used_files;
+    struct array all_files;
+    array_init(&used_files, ARRAY_CAPACITY);
+    array_init(&all_files, ARRAY_CAPACITY);
+
+    int i;
+    int failure = 0;
+    struct blob_path_cookie cookie = { blob_dir, &used_files };
+    for (i = 0; i < manifest_count; i++) {
+        if (read_manifest_blobs(manifests[i], add_blob_path, &cookie)) {
+            failure = 1;
+            goto out;
+        }
+    }
+
+    recursive_list_dir((char*) blob_dir, &all_files);
+
+    qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
+    qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
+
+    // Search for unused files
+    int j = 0;
+    for (i = 0; i < all_files.size; i++) {
+        int cmp = 1;
+        while (j < used_files.size &&
+            (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
+            j++;
+        }
+
+        if (cmp > 0 || j >= used_files.size) {
+            if (remove(all_files.data[i])) {
+                fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
+            }
+            printf("Delete: %s\n", all_files.data[i]);
+        }
+    }
+
+out:
+    array_free(&used_files, 1);
+    array_free(&all_files, 1);
+
+    return failure;
+}
+
+struct restore_context {
+    const struct dedupe_manifest *manifest;
+    const char *blob_dir;
+    const struct manifest_record **files;
+    int file_count;
+    int next_file;
+    int error;
+    pthread_mutex_t lock;
+};
+
+// only called for a version 2+ manifest; version 1 has no timestamps
+static void restore_times(const struct manifest_record *record, const char *filename) {
+    struct timeval times[2];
+    times[0].tv_sec = record->atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = record->mtime;
+    times[1].tv_usec = 0;
+    utimes(filename, times);
+}
+
+static int restore_file(struct restore_context *context, const struct manifest_record *record, char *buf) {
+    const char *filename = manifest_path(context->manifest, record);
+    char blob_file[PATH_MAX];
+    int ret;
+    refs_blob_path(context->blob_dir, record->digest, blob_file);
+    if (ret = copy_file(blob_file, filename, buf)) {
+        fprintf(stderr, "Unable to copy file %s\n", filename);
+        return ret;
+    }
+
+    // nothing is written into a file after this, so its metadata can be
+    // applied straight away
+    chown(filename, record->uid, record->gid);
+    chmod(filename, record->mode);
+    if (context->manifest->source_version >= 2)
+        restore_times(record, filename);
+    return 0;
+}
+
+static void *restore_worker(void *cookie) {
+    struct restore_context *context = (struct restore_context *) cookie;
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (buf == NULL) {
+        pthread_mutex_lock(&context->lock);
+        context->error = 1;
+        pthread_mutex_unlock(&context->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&context->lock);
+        if (context->error || context->next_file >= context->file_count) {
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        const struct manifest_record *record = context->files[context->next_file++];
+        // progress lines are read by nandroid, keep them whole
+        printf("%s\n", manifest_path(context->manifest, record));
+        pthread_mutex_unlock(&context->lock);
+
+        int ret = restore_file(context, record, buf);
+        if (ret) {
+            pthread_mutex_lock(&context->lock);
+            if (!context->error)
+                context->error = ret;
+            pthread_mutex_unlock(&context->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int restore_thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > MAX_RESTORE_THREADS ? MAX_RESTORE_THREADS : cpus;
+}
+
+// Restores "records" (in manifest order) in three passes:
+//  1. create the directory skeleton and symlinks,
+//  2. copy file blobs with a pool of workers,
+//  3. apply directory ownership, modes and times, deepest first, so
+//     restrictive modes and mtimes are not disturbed by later writes.
+static int restore_records(const struct dedupe_manifest *manifest, const struct manifest_record **records, int count, const char *blob_dir) {
+    struct restore_context context;
+    memset(&context, 0, sizeof(context));
+    context.manifest = manifest;
+    context.blob_dir = blob_dir;
+    context.files = malloc(sizeof(*context.files) * (count > 0 ? count : 1));
+    assert(context.files != NULL);
+    pthread_mutex_init(&context.lock, NULL);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        const struct manifest_record *record = records[i];
+        const char *filename = manifest_path(manifest, record);
+        if (record->type == MANIFEST_TYPE_FILE) {
+            context.files[context.file_count++] = record;
+            continue;
+        }
+        printf("%s\n", filename);
+        if (record->type == MANIFEST_TYPE_LINK) {
+            symlink(manifest_link(manifest, record), filename);
+
+            // Android has no lchmod, and chmod follows symlinks.
+            // utimes would follow it too, so links keep the restore time.
+            lchown(filename, record->uid, record->gid);
+        }
+        else if (record->type == MANIFEST_TYPE_DIR) {
+            mkdir(filename, S_IRWXU);
+        }
+        else {
+            fprintf(stderr, "Unknown type %c\n", record->type);
+            context.error = 1;
+            break;
+        }
+    }
+
+    if (!context.error && context.file_count > 0) {
+        int thread_count = restore_thread_count();
+        if (thread_count > context.file_count)
+            thread_count = context.file_count;
+        pthread_t threads[MAX_RESTORE_THREADS];
+        int started = 0;
+        for (i = 1; i < thread_count; i++) {
+            if (pthread_create(&threads[started], NULL, restore_worker, &context))
+                break;
+            started++;
+        }
+        // the calling thread works too, so this also covers no threads
+        restore_worker(&context);
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    for (i = count - 1; !context.error && i >= 0; i--) {
+        const struct manifest_record *record = records[i];
+        if (record->type != MANIFEST_TYPE_DIR)
+            continue;
+        const char *filename = manifest_path(manifest, record);
+        chown(filename, record->uid, record->gid);
+        chmod(filename, record->mode);
+        if (manifest->source_version >= 2)
+            restore_times(record, filename);
+    }
+
+    pthread_mutex_destroy(&context.lock);
+    free(context.files);
+    return context.error;
+}
+
+static int restore_all(const struct dedupe_manifest *manifest, const char *blob_dir) {
+    uint32_t count = manifest->header->record_count;
+    const struct manifest_record **records = malloc(sizeof(*records) * (count > 0 ? count : 1));
+    assert(records != NULL);
+    uint32_t i;
+    for (i = 0; i < count; i++)
+        records[i] = &manifest->records[i];
+    int ret = restore_records(manifest, records, count, blob_dir);
+    free(records);
+    return ret;
+}
+
+// Restores a single path, the missing directories leading to it and,
+// for a directory, everything below it.  Records are stored depth first,
+// so a directory's contents directly follow it in the manifest.
+static int restore_path(const struct dedupe_manifest *manifest, const char *path, const char *blob_dir) {
+    const struct manifest_record *record = manifest_find(manifest, path);
+    if (record == NULL) {
+        fprintf(stderr, "%s not found in manifest\n", path);
+        return 1;
+    }
+
+    struct array selected;
+    array_init(&selected, ARRAY_CAPACITY);
+
+    char parent[PATH_MAX];
+    const char *filename = manifest_path(manifest, record);
+    const char *slash = filename;
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+        strncpy(parent, filename, slash - filename);
+        parent[slash - filename] = '\0';
+        const struct manifest_record *dir = manifest_find(manifest, parent);
+        if (dir != NULL && check_file(parent))
+            array_add(&selected, (void *) dir);
+    }
+
+    array_add(&selected, (void *) record);
+    if (record->type == MANIFEST_TYPE_DIR) {
+        size_t len = strlen(filename);
+        const struct manifest_record *end = manifest->records + manifest->header->record_count;
+        const struct manifest_record *child;
+        for (child = record + 1; child < end; child++) {
+            const char *child_path = manifest_path(manifest, child);
+            if (strncmp(child_path, filename, len) || child_path[len] != '/')
+                break;
+            array_add(&selected, (void *) child);
+        }
+    }
+
+    int ret = restore_records(manifest, (const struct manifest_record **) selected.data, selected.size, blob_dir);
+    array_free(&selected, 0);
+    return ret;
+}
+
 int dedupe_main(int argc, char** argv) {
     if (argc < 3) {
         usage(argv);
@@ -367,31 +664,40 @@ int dedupe_main(int argc, char** argv) {
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
-        if (context.output_manifest == NULL) {
+        char manifest_path[PATH_MAX];
+        FILE *output_manifest = fopen(argv[4], "wb");
+        if (output_manifest == NULL) {
             fprintf(stderr, "Unable to open output file %s\n", argv[4]);
             return 1;
         }
+        fclose(output_manifest);
+        realpath(argv[4], manifest_path);
         mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
         realpath(argv[3], context.blob_dir);
         chdir(argv[2]);
         context.excludes = argv + 5;
         context.exclude_count = argc - 5;
-
-        return store_dir(&context, st, ".");
+        refs_list_init(&context.keys, ARRAY_CAPACITY);
+        manifest_writer_init(&context.manifest);
+
+        ret = store_dir(&context, st, ".");
+        if (ret == 0)
+            ret = manifest_writer_save(&context.manifest, manifest_path);
+        manifest_writer_free(&context.manifest);
+        if (ret == 0)
+            ret = refs_register_manifest(context.blob_dir, manifest_path, &context.keys);
+        refs_list_free(&context.keys);
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
+        if (argc < 5) {
             usage(argv);
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct dedupe_manifest manifest;
+        if (manifest_open(argv[2], &manifest))
             return 1;
-        }
 
         char blob_dir[PATH_MAX];
         char *output_dir = argv[4];
@@ -401,109 +707,29 @@ int dedupe_main(int argc, char** argv) {
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            manifest_close(&manifest);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
+        int ret = 0;
+        if (argc == 5) {
+            ret = restore_all(&manifest, blob_dir);
         }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
-        }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
+        else {
+            int i;
+            for (i = 5; ret == 0 && i < argc; i++)
+                ret = restore_path(&manifest, argv[i], blob_dir);
         }
 
-        fclose(input_manifest);
-        return 0;
+        manifest_close(&manifest);
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
         if (argc < 3) {
             usage(argv);
             return 1;
         }
-        
+
         char blob_dir[PATH_MAX];
         realpath(argv[2], blob_dir);
         if (check_file(blob_dir)) {
@@ -511,102 +737,60 @@ int dedupe_main(int argc, char** argv) {
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
-
-        char blob[PATH_MAX];
-        int i;
-        int failure = 0;
-        for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
-                failure = 1;
-                goto out;
-            }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
+        int ret = 0;
+        if (!refs_exists(blob_dir)) {
+            // no index yet, so do one full scan before building it
+            ret = full_gc(blob_dir, argv + 3, argc - 3);
+        }
+        if (ret == 0)
+            ret = refs_gc(blob_dir, argv + 3, argc - 3);
+        return ret;
+    }
+    else if (strcmp(argv[1], "verify") == 0 || strcmp(argv[1], "stats") == 0) {
+        char blob_dir[PATH_MAX];
+        realpath(argv[2], blob_dir);
+        if (check_file(blob_dir)) {
+            fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+            return 1;
         }
 
-        recursive_list_dir(blob_dir, &all_files);
-
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
+        if (strcmp(argv[1], "verify") == 0)
+            return dedupe_verify(blob_dir, argv + 3, argc - 3);
+        return dedupe_stats(blob_dir, argv + 3, argc - 3);
+    }
+    else if (strcmp(argv[1], "convert") == 0) {
+        if (argc != 4) {
+            usage(argv);
+            return 1;
+        }
 
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
+        struct dedupe_manifest manifest;
+        if (manifest_open(argv[2], &manifest))
+            return 1;
 
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
-            }
+        // rebuild through the writer so the output is always current
+        struct manifest_writer writer;
+        manifest_writer_init(&writer);
+        uint32_t i;
+        for (i = 0; i < manifest.header->record_count; i++) {
+            const struct manifest_record* record = &manifest.records[i];
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = record->mode;
+            st.st_uid = record->uid;
+            st.st_gid = record->gid;
+            st.st_atime = record->atime;
+            st.st_mtime = record->mtime;
+            st.st_ctime = record->ctime;
+            st.st_size = record->size;
+            manifest_writer_add(&writer, record->type, &st, manifest_path(&manifest, record),
+                                manifest_link(&manifest, record), record->digest);
         }
+        manifest_close(&manifest);
 
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
-
-        return failure;
+        int ret = manifest_writer_save(&writer, argv[3]);
+        manifest_writer_free(&writer);
+        return ret;
     }
     else {
         usage(argv);
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "manifest.h"
+#include "refcount.h"
+
+static const char MANIFEST_MAGIC[8] = { 'D', 'D', 'M', 'A', 'N', 'I', 'F', '\0' };
+
+#define ALIGN8(x) (((x) + 7) & ~((uint64_t) 7))
+
+static uint32_t hash_path(const char* path) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void manifest_writer_init(struct manifest_writer* writer) {
+    writer->record_capacity = 1024;
+    writer->record_count = 0;
+    writer->records = malloc(sizeof(struct manifest_record) * writer->record_capacity);
+    assert(writer->records != NULL);
+    writer->strings_capacity = 64 * 1024;
+    writer->strings = malloc(writer->strings_capacity);
+    assert(writer->strings != NULL);
+    // offset 0 is the empty string
+    writer->strings[0] = '\0';
+    writer->strings_size = 1;
+}
+
+void manifest_writer_free(struct manifest_writer* writer) {
+    free(writer->records);
+    free(writer->strings);
+    writer->records = NULL;
+    writer->strings = NULL;
+    writer->record_count = 0;
+    writer->strings_size = 0;
+}
+
+static uint32_t add_string(struct manifest_writer* writer, const char* s) {
+    size_t len = strlen(s) + 1;
+    if (len == 1)
+        return 0;
+    while (writer->strings_size + len > writer->strings_capacity) {
+        writer->strings_capacity *= 2;
+        writer->strings = realloc(writer->strings, writer->strings_capacity);
+        assert(writer->strings != NULL);
+    }
+    uint32_t offset = writer->strings_size;
+    memcpy(writer->strings + offset, s, len);
+    writer->strings_size += len;
+    return offset;
+}
+
+void manifest_writer_add(struct manifest_writer* writer, char type, const struct stat* st,
+                         const char* path, const char* link, const unsigned char* digest) {
+    if (writer->record_count == writer->record_capacity) {
+        writer->record_capacity *= 2;
+        writer->records = realloc(writer->records, sizeof(struct manifest_record) * writer->record_capacity);
+        assert(writer->records != NULL);
+    }
+    struct manifest_record* record = &writer->records[writer->record_count++];
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    record->uid = st->st_uid;
+    record->gid = st->st_gid;
+    record->atime = st->st_atime;
+    record->mtime = st->st_mtime;
+    record->ctime = st->st_ctime;
+    record->path = add_string(writer, path);
+    if (type == MANIFEST_TYPE_FILE) {
+        record->size = st->st_size;
+        memcpy(record->digest, digest, MH_SHA256_DIGEST_SIZE);
+    }
+    else if (type == MANIFEST_TYPE_LINK) {
+        record->link = add_string(writer, link);
+    }
+}
+
+// lays the manifest out in a single malloc'd buffer
+static int manifest_writer_build(struct manifest_writer* writer, void** data, size_t* length) {
+    uint64_t records_offset = ALIGN8(sizeof(struct manifest_header));
+    uint64_t strings_offset = records_offset + (uint64_t) writer->record_count * sizeof(struct manifest_record);
+    uint64_t index_offset = ALIGN8(strings_offset + writer->strings_size);
+    uint32_t bucket_count = 16;
+    while (bucket_count < writer->record_count * 2)
+        bucket_count *= 2;
+    uint64_t trailer_offset = ALIGN8(index_offset + (uint64_t) bucket_count * sizeof(uint32_t));
+    uint64_t total = trailer_offset + sizeof(struct manifest_trailer);
+    if (total != (size_t) total)
+        return 1;
+
+    unsigned char* out = calloc(1, total);
+    if (out == NULL)
+        return 1;
+
+    struct manifest_header* header = (struct manifest_header*) out;
+    memcpy(header->magic, MANIFEST_MAGIC, sizeof(header->magic));
+    header->version = MANIFEST_VERSION;
+    header->record_count = writer->record_count;
+    header->records_offset = records_offset;
+    header->strings_offset = strings_offset;
+    header->strings_size = writer->strings_size;
+    header->index_offset = index_offset;
+    header->bucket_count = bucket_count;
+
+    memcpy(out + records_offset, writer->records, (size_t) writer->record_count * sizeof(struct manifest_record));
+    memcpy(out + strings_offset, writer->strings, writer->strings_size);
+
+    uint32_t* buckets = (uint32_t*) (out + index_offset);
+    uint32_t i;
+    for (i = 0; i < writer->record_count; i++) {
+        uint32_t b = hash_path(writer->strings + writer->records[i].path) & (bucket_count - 1);
+        while (buckets[b] != 0)
+            b = (b + 1) & (bucket_count - 1);
+        buckets[b] = i + 1;
+    }
+
+    struct manifest_trailer* trailer = (struct manifest_trailer*) (out + trailer_offset);
+    mhSha256(out, trailer_offset, trailer->checksum);
+
+    *data = out;
+    *length = total;
+    return 0;
+}
+
+int manifest_writer_save(struct manifest_writer* writer, const char* path) {
+    void* data;
+    size_t length;
+    if (manifest_writer_build(writer, &data, &length)) {
+        fprintf(stderr, "Unable to build manifest %s\n", path);
+        return 1;
+    }
+
+    int ret = 0;
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open output file %s\n", path);
+        ret = 1;
+    }
+    else if (fwrite(data, 1, length, f) != length || fclose(f)) {
+        fprintf(stderr, "Error writing output file %s\n", path);
+        ret = 1;
+    }
+    free(data);
+    return ret;
+}
+
+// Points the manifest at an in-memory or mapped binary image and checks
+// that every offset stays inside it.
+static int manifest_attach(struct dedupe_manifest* manifest, const char* path) {
+    const unsigned char* data = manifest->data;
+    size_t length = manifest->length;
+    if (length < sizeof(struct manifest_header) + sizeof(struct manifest_trailer))
+        goto corrupt;
+
+    const struct manifest_header* header = (const struct manifest_header*) data;
+    if (header->version > MANIFEST_VERSION) {
+        fprintf(stderr, "Attempting to read newer dedupe file: %s\n", path);
+        return 1;
+    }
+    uint64_t trailer_offset = length - sizeof(struct manifest_trailer);
+    if (header->version != MANIFEST_VERSION ||
+        header->records_offset < sizeof(struct manifest_header) ||
+        header->records_offset % 8 != 0 ||
+        header->records_offset + (uint64_t) header->record_count * sizeof(struct manifest_record) > header->strings_offset ||
+        header->strings_size == 0 ||
+        header->strings_offset + header->strings_size > header->index_offset ||
+        header->index_offset % 8 != 0 ||
+        header->bucket_count == 0 ||
+        (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+        header->index_offset + (uint64_t) header->bucket_count * sizeof(uint32_t) > trailer_offset)
+        goto corrupt;
+
+    const struct manifest_trailer* trailer = (const struct manifest_trailer*) (data + trailer_offset);
+    unsigned char checksum[MH_SHA256_DIGEST_SIZE];
+    mhSha256(data, trailer_offset, checksum);
+    if (memcmp(checksum, trailer->checksum, MH_SHA256_DIGEST_SIZE))
+        goto corrupt;
+
+    manifest->header = header;
+    manifest->records = (const struct manifest_record*) (data + header->records_offset);
+    manifest->strings = (const char*) (data + header->strings_offset);
+    manifest->buckets = (const uint32_t*) (data + header->index_offset);
+    if (manifest->strings[header->strings_size - 1] != '\0')
+        goto corrupt;
+
+    uint32_t i;
+    for (i = 0; i < header->record_count; i++) {
+        if (manifest->records[i].path >= header->strings_size ||
+            manifest->records[i].link >= header->strings_size)
+            goto corrupt;
+    }
+    return 0;
+
+corrupt:
+    fprintf(stderr, "Corrupt dedupe manifest: %s\n", path);
+    return 1;
+}
+
+static char* next_field(char** cursor) {
+    char* start = *cursor;
+    if (start == NULL)
+        return NULL;
+    char* tab = strchr(start, '\t');
+    if (tab == NULL) {
+        *cursor = NULL;
+        return NULL;
+    }
+    *tab = '\0';
+    *cursor = tab + 1;
+    return start;
+}
+
+// Converts a version 1 or 2 text manifest into a writer.
+static int parse_text_manifest(FILE* f, const char* path, struct manifest_writer* writer, int* source_version) {
+    static char line[PATH_MAX * 3];
+    int version = 1;
+    if (fgets(line, sizeof(line), f) == NULL)
+        line[0] = '\0';
+    if (sscanf(line, "dedupe\t%d", &version) != 1)
+        fseek(f, 0, SEEK_SET);
+    if (version >= MANIFEST_VERSION) {
+        fprintf(stderr, "Attempting to read newer dedupe file: %s\n", path);
+        return 1;
+    }
+    *source_version = version;
+
+    while (fgets(line, sizeof(line), f)) {
+        char* cursor = line;
+        char* type = next_field(&cursor);
+        char* mode = next_field(&cursor);
+        char* uid = next_field(&cursor);
+        char* gid = next_field(&cursor);
+        char* at = "0";
+        char* mt = "0";
+        char* ct = "0";
+        if (version >= 2) {
+            at = next_field(&cursor);
+            mt = next_field(&cursor);
+            ct = next_field(&cursor);
+        }
+        char* filename = next_field(&cursor);
+        if (filename == NULL || at == NULL || mt == NULL || ct == NULL || strlen(type) != 1) {
+            fprintf(stderr, "Invalid manifest line in %s\n", path);
+            return 1;
+        }
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        // modes are written with %o
+        st.st_mode = strtoul(mode, NULL, 8);
+        st.st_uid = atoi(uid);
+        st.st_gid = atoi(gid);
+        st.st_atime = atol(at);
+        st.st_mtime = atol(mt);
+        st.st_ctime = atol(ct);
+
+        unsigned char digest[MH_SHA256_DIGEST_SIZE];
+        const char* link = NULL;
+        if (type[0] == MANIFEST_TYPE_FILE) {
+            char* key = next_field(&cursor);
+            char* size = next_field(&cursor);
+            if (size == NULL || refs_parse_key(key, digest)) {
+                fprintf(stderr, "Invalid blob key for %s in %s\n", filename, path);
+                return 1;
+            }
+            st.st_size = strtoull(size, NULL, 10);
+        }
+        else if (type[0] == MANIFEST_TYPE_LINK) {
+            link = next_field(&cursor);
+            if (link == NULL) {
+                fprintf(stderr, "Invalid symlink %s in %s\n", filename, path);
+                return 1;
+            }
+        }
+        else if (type[0] != MANIFEST_TYPE_DIR) {
+            fprintf(stderr, "Unknown type %s\n", type);
+            return 1;
+        }
+        manifest_writer_add(writer, type[0], &st, filename, link, digest);
+    }
+    return 0;
+}
+
+int manifest_open(const char* path, struct dedupe_manifest* manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
+        return 1;
+    }
+
+    char magic[sizeof(MANIFEST_MAGIC)];
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) == 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Unable to map input manifest %s\n", path);
+            return 1;
+        }
+        manifest->data = data;
+        manifest->length = st.st_size;
+        manifest->mapped = 1;
+        manifest->source_version = MANIFEST_VERSION;
+        if (manifest_attach(manifest, path)) {
+            manifest_close(manifest);
+            return 1;
+        }
+        return 0;
+    }
+
+    FILE* f = fdopen(fd, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_SET)) {
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
+        if (f != NULL)
+            fclose(f);
+        else
+            close(fd);
+        return 1;
+    }
+    struct manifest_writer writer;
+    manifest_writer_init(&writer);
+    int ret = parse_text_manifest(f, path, &writer, &manifest->source_version);
+    fclose(f);
+    if (ret == 0) {
+        ret = manifest_writer_build(&writer, &manifest->data, &manifest->length);
+        if (ret == 0)
+            ret = manifest_attach(manifest, path);
+    }
+    manifest_writer_free(&writer);
+    if (ret)
+        manifest_close(manifest);
+    return ret;
+}
+
+void manifest_close(struct dedupe_manifest* manifest) {
+    if (manifest->data != NULL) {
+        if (manifest->mapped)
+            munmap(manifest->data, manifest->length);
+        else
+            free(manifest->data);
+    }
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+const struct manifest_record* manifest_find(const struct dedupe_manifest* manifest, const char* path) {
+    char normalized[PATH_MAX];
+    if (strcmp(path, ".") == 0 || strncmp(path, "./", 2) == 0)
+        snprintf(normalized, sizeof(normalized), "%s", path);
+    else if (path[0] == '/')
+        snprintf(normalized, sizeof(normalized), ".%s", path);
+    else
+        snprintf(normalized, sizeof(normalized), "./%s", path);
+
+    uint32_t mask = manifest->header->bucket_count - 1;
+    uint32_t b = hash_path(normalized) & mask;
+    uint32_t probes;
+    for (probes = 0; probes <= mask; probes++) {
+        uint32_t index = manifest->buckets[b];
+        if (index == 0 || index > manifest->header->record_count)
+            return NULL;
+        const struct manifest_record* record = &manifest->records[index - 1];
+        if (strcmp(manifest_path(manifest, record), normalized) == 0)
+            return record;
+        b = (b + 1) & mask;
+    }
+    return NULL;
+}
+
+int dedupe_read_manifest_keys(const char* path, struct refs_list* keys) {
+    struct dedupe_manifest manifest;
+    if (manifest_open(path, &manifest))
+        return 1;
+    uint32_t i;
+    for (i = 0; i < manifest.header->record_count; i++) {
+        if (manifest.records[i].type == MANIFEST_TYPE_FILE)
+            refs_list_add(keys, manifest.records[i].digest, 1);
+    }
+    manifest_close(&manifest);
+    return 0;
+}
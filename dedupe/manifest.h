@@ -0,0 +1,107 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "minhash/Sha.h"
+
+// Binary .dup manifest (version 3).
+//
+//   header
+//   records       fixed width, in the order the tree was walked, so a
+//                 directory always precedes its contents
+//   strings       paths and symlink targets, NUL terminated
+//   index         open addressed hash of paths -> record index + 1
+//   trailer       sha256 of everything before it
+//
+// All offsets are from the start of the file, and every section is 8
+// byte aligned so a manifest can be used straight out of an mmap.
+// Version 1 and 2 (tab separated text) manifests are converted in
+// memory when opened.
+
+#define MANIFEST_VERSION 3
+
+#define MANIFEST_TYPE_FILE 'f'
+#define MANIFEST_TYPE_DIR 'd'
+#define MANIFEST_TYPE_LINK 'l'
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t index_offset;
+    uint32_t bucket_count;
+    uint32_t reserved;
+};
+
+struct manifest_record {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    // offsets into the string table
+    uint32_t path;
+    uint32_t link;
+    uint32_t reserved2[2];
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+};
+
+struct manifest_trailer {
+    unsigned char checksum[MH_SHA256_DIGEST_SIZE];
+};
+
+struct dedupe_manifest {
+    const struct manifest_header* header;
+    const struct manifest_record* records;
+    const char* strings;
+    const uint32_t* buckets;
+    int source_version;
+
+    // either a mapping of the file or a converted text manifest
+    void* data;
+    size_t length;
+    int mapped;
+};
+
+// Opens a binary or text manifest.  Returns 0 on success.
+int manifest_open(const char* path, struct dedupe_manifest* manifest);
+void manifest_close(struct dedupe_manifest* manifest);
+
+static inline const char* manifest_path(const struct dedupe_manifest* manifest, const struct manifest_record* record) {
+    return manifest->strings + record->path;
+}
+
+static inline const char* manifest_link(const struct dedupe_manifest* manifest, const struct manifest_record* record) {
+    return manifest->strings + record->link;
+}
+
+// Looks up a path as stored by dedupe c (e.g. "./system/app"); a
+// leading "./" is added if missing.  Returns NULL if not present.
+const struct manifest_record* manifest_find(const struct dedupe_manifest* manifest, const char* path);
+
+struct manifest_writer {
+    struct manifest_record* records;
+    uint32_t record_count;
+    uint32_t record_capacity;
+    char* strings;
+    uint64_t strings_size;
+    uint64_t strings_capacity;
+};
+
+void manifest_writer_init(struct manifest_writer* writer);
+void manifest_writer_free(struct manifest_writer* writer);
+// digest is only used for files, link only for symlinks
+void manifest_writer_add(struct manifest_writer* writer, char type, const struct stat* st,
+                         const char* path, const char* link, const unsigned char* digest);
+int manifest_writer_save(struct manifest_writer* writer, const char* path);
+
+#endif
@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "refcount.h"
+
+#define REFS_DIR ".refs"
+#define REFS_TABLE "counts"
+#define REFS_MANIFESTS "manifests"
+#define REFS_VERSION 1
+
+static const char REFS_TABLE_MAGIC[4] = { 'D', 'D', 'R', 'C' };
+static const char REFS_MANIFEST_MAGIC[4] = { 'D', 'D', 'R', 'M' };
+
+struct refs_table_header {
+    char magic[4];
+    uint32_t version;
+};
+
+// on disk, counts are always positive
+struct refs_record {
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    uint32_t count;
+};
+
+struct refs_manifest_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path_length;
+    uint32_t key_count;
+};
+
+// a manifest passed to gc
+struct live_manifest {
+    char path[PATH_MAX];
+    char id[MH_SHA256_DIGEST_SIZE * 2 + 1];
+    uint64_t size;
+    int64_t mtime;
+    int registered;
+};
+
+void refs_list_init(struct refs_list* list, int capacity) {
+    list->entries = malloc(sizeof(struct refs_entry) * capacity);
+    assert(list->entries != NULL);
+    list->size = 0;
+    list->capacity = capacity;
+}
+
+void refs_list_free(struct refs_list* list) {
+    if (list->entries != NULL) {
+        free(list->entries);
+        list->entries = NULL;
+    }
+    list->size = 0;
+    list->capacity = 0;
+}
+
+void refs_list_add(struct refs_list* list, const unsigned char* digest, int count) {
+    if (list->size == list->capacity) {
+        list->capacity *= 2;
+        list->entries = realloc(list->entries, sizeof(struct refs_entry) * list->capacity);
+        assert(list->entries != NULL);
+    }
+    memcpy(list->entries[list->size].digest, digest, MH_SHA256_DIGEST_SIZE);
+    list->entries[list->size].count = count;
+    list->size++;
+}
+
+static int entry_compare(const void* a, const void* b) {
+    return memcmp(((const struct refs_entry*) a)->digest, ((const struct refs_entry*) b)->digest, MH_SHA256_DIGEST_SIZE);
+}
+
+void refs_list_sort(struct refs_list* list, int sum_counts) {
+    if (list->size == 0)
+        return;
+    qsort(list->entries, list->size, sizeof(struct refs_entry), entry_compare);
+    int i, j = 0;
+    for (i = 1; i < list->size; i++) {
+        if (memcmp(list->entries[j].digest, list->entries[i].digest, MH_SHA256_DIGEST_SIZE) == 0) {
+            if (sum_counts)
+                list->entries[j].count += list->entries[i].count;
+            continue;
+        }
+        list->entries[++j] = list->entries[i];
+    }
+    list->size = j + 1;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void hex_string(const unsigned char* digest, char* out) {
+    int i;
+    for (i = 0; i < MH_SHA256_DIGEST_SIZE; i++)
+        sprintf(&out[i * 2], "%02x", (int)digest[i]);
+    out[MH_SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+int refs_parse_key(const char* key, unsigned char* digest) {
+    int nibbles = 0;
+    for (; *key != '\0'; key++) {
+        if (*key == '/')
+            continue;
+        int v = hex_value(*key);
+        if (v < 0 || nibbles >= MH_SHA256_DIGEST_SIZE * 2)
+            return 1;
+        if (nibbles % 2 == 0)
+            digest[nibbles / 2] = v << 4;
+        else
+            digest[nibbles / 2] |= v;
+        nibbles++;
+    }
+    return nibbles != MH_SHA256_DIGEST_SIZE * 2;
+}
+
+// same abc/defg layout as store_file()
+void refs_blob_path(const char* blob_dir, const unsigned char* digest, char* path) {
+    char hex[MH_SHA256_DIGEST_SIZE * 2 + 1];
+    hex_string(digest, hex);
+    sprintf(path, "%s/%.3s/%s", blob_dir, hex, hex + 3);
+}
+
+static void refs_path(const char* blob_dir, const char* name, char* path) {
+    if (name == NULL)
+        sprintf(path, "%s/%s", blob_dir, REFS_DIR);
+    else
+        sprintf(path, "%s/%s/%s", blob_dir, REFS_DIR, name);
+}
+
+static void manifest_record_path(const char* blob_dir, const char* id, char* path) {
+    sprintf(path, "%s/%s/%s/%s", blob_dir, REFS_DIR, REFS_MANIFESTS, id);
+}
+
+int refs_exists(const char* blob_dir) {
+    char path[PATH_MAX];
+    struct stat st;
+    refs_path(blob_dir, REFS_TABLE, path);
+    return stat(path, &st) == 0;
+}
+
+int refs_foreach(const char* blob_dir, refs_callback callback, void* cookie) {
+    char path[PATH_MAX];
+    refs_path(blob_dir, REFS_TABLE, path);
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return 1;
+
+    struct refs_table_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, REFS_TABLE_MAGIC, sizeof(header.magic)) ||
+        header.version != REFS_VERSION) {
+        fprintf(stderr, "Invalid reference index: %s\n", path);
+        fclose(f);
+        return 1;
+    }
+    struct refs_record record;
+    while (fread(&record, sizeof(record), 1, f) == 1)
+        callback(record.digest, record.count, cookie);
+    fclose(f);
+    return 0;
+}
+
+static int ensure_refs_dirs(const char* blob_dir) {
+    char path[PATH_MAX];
+    refs_path(blob_dir, NULL, path);
+    mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+    refs_path(blob_dir, REFS_MANIFESTS, path);
+    mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Unable to create reference index: %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// the id of a manifest is the sha256 of its real path
+static int manifest_identity(const char* manifest, struct live_manifest* m) {
+    struct stat st;
+    if (realpath(manifest, m->path) == NULL || stat(m->path, &st)) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
+        return 1;
+    }
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    mhSha256((const unsigned char*) m->path, strlen(m->path), digest);
+    hex_string(digest, m->id);
+    m->size = st.st_size;
+    m->mtime = st.st_mtime;
+    m->registered = 0;
+    return 0;
+}
+
+static int read_manifest_record(const char* path, struct refs_manifest_header* header, struct refs_list* keys) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return 1;
+    int ret = 1;
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        memcmp(header->magic, REFS_MANIFEST_MAGIC, sizeof(header->magic)) ||
+        header->version != REFS_VERSION ||
+        header->path_length >= PATH_MAX)
+        goto out;
+    if (keys == NULL) {
+        ret = 0;
+        goto out;
+    }
+    if (fseek(f, header->path_length, SEEK_CUR))
+        goto out;
+    uint32_t i;
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    for (i = 0; i < header->key_count; i++) {
+        if (fread(digest, MH_SHA256_DIGEST_SIZE, 1, f) != 1)
+            goto out;
+        refs_list_add(keys, digest, -1);
+    }
+    ret = 0;
+out:
+    fclose(f);
+    return ret;
+}
+
+// written to a temp file; the caller renames it into place once the
+// counts it describes have been committed.
+static int write_manifest_record(const char* path, const struct live_manifest* m, const struct refs_list* keys) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to write reference record %s\n", path);
+        return 1;
+    }
+    struct refs_manifest_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REFS_MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = REFS_VERSION;
+    header.size = m->size;
+    header.mtime = m->mtime;
+    header.path_length = strlen(m->path);
+    header.key_count = keys->size;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(m->path, 1, header.path_length, f) == header.path_length;
+    int i;
+    for (i = 0; ok && i < keys->size; i++)
+        ok = fwrite(keys->entries[i].digest, MH_SHA256_DIGEST_SIZE, 1, f) == 1;
+    if (fclose(f) || !ok) {
+        fprintf(stderr, "Error writing reference record %s\n", path);
+        unlink(path);
+        return 1;
+    }
+    return 0;
+}
+
+// Merge a sorted, coalesced list of count deltas into the table.
+// Blobs whose count drops to zero are added to "dead" and removed from
+// the table; the caller deletes them after the new table is in place.
+static int apply_deltas(const char* blob_dir, const struct refs_list* deltas, struct refs_list* dead) {
+    char table_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    refs_path(blob_dir, REFS_TABLE, table_path);
+    sprintf(tmp_path, "%s.tmp", table_path);
+
+    struct refs_table_header header;
+    FILE* in = fopen(table_path, "rb");
+    if (in != NULL) {
+        if (fread(&header, sizeof(header), 1, in) != 1 ||
+            memcmp(header.magic, REFS_TABLE_MAGIC, sizeof(header.magic)) ||
+            header.version != REFS_VERSION) {
+            fprintf(stderr, "Invalid reference index: %s\n", table_path);
+            fclose(in);
+            return 1;
+        }
+    }
+
+    FILE* out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to write reference index: %s\n", tmp_path);
+        if (in != NULL)
+            fclose(in);
+        return 1;
+    }
+    memcpy(header.magic, REFS_TABLE_MAGIC, sizeof(header.magic));
+    header.version = REFS_VERSION;
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    struct refs_record record;
+    int have_record = in != NULL && fread(&record, sizeof(record), 1, in) == 1;
+    int i = 0;
+    while (ok && (have_record || i < deltas->size)) {
+        int cmp;
+        if (!have_record)
+            cmp = 1;
+        else if (i >= deltas->size)
+            cmp = -1;
+        else
+            cmp = memcmp(record.digest, deltas->entries[i].digest, MH_SHA256_DIGEST_SIZE);
+
+        if (cmp < 0) {
+            // untouched
+            ok = fwrite(&record, sizeof(record), 1, out) == 1;
+            have_record = fread(&record, sizeof(record), 1, in) == 1;
+            continue;
+        }
+
+        const struct refs_entry* delta = &deltas->entries[i++];
+        int64_t count = delta->count;
+        if (cmp == 0) {
+            count += record.count;
+            have_record = fread(&record, sizeof(record), 1, in) == 1;
+        }
+        else if (count < 0) {
+            // not tracked; it was either never indexed or already gone
+            continue;
+        }
+
+        if (count <= 0) {
+            refs_list_add(dead, delta->digest, 0);
+            continue;
+        }
+        struct refs_record updated;
+        memcpy(updated.digest, delta->digest, MH_SHA256_DIGEST_SIZE);
+        updated.count = (uint32_t) count;
+        ok = fwrite(&updated, sizeof(updated), 1, out) == 1;
+    }
+
+    if (in != NULL)
+        fclose(in);
+    if (fclose(out) || !ok) {
+        fprintf(stderr, "Error writing reference index: %s\n", tmp_path);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (rename(tmp_path, table_path)) {
+        fprintf(stderr, "Error committing reference index: %s\n", table_path);
+        return 1;
+    }
+    return 0;
+}
+
+static void remove_dead_blobs(const char* blob_dir, const struct refs_list* dead) {
+    char blob[PATH_MAX];
+    int i;
+    for (i = 0; i < dead->size; i++) {
+        refs_blob_path(blob_dir, dead->entries[i].digest, blob);
+        if (remove(blob) && errno != ENOENT) {
+            fprintf(stderr, "Error removing: %s\n", blob);
+            continue;
+        }
+        printf("Delete: %s\n", blob);
+    }
+}
+
+int refs_register_manifest(const char* blob_dir, const char* manifest, struct refs_list* keys) {
+    if (!refs_exists(blob_dir))
+        return 0;
+
+    struct live_manifest m;
+    if (manifest_identity(manifest, &m))
+        return 1;
+
+    refs_list_sort(keys, 0);
+
+    char record[PATH_MAX];
+    char tmp_record[PATH_MAX];
+    manifest_record_path(blob_dir, m.id, record);
+    sprintf(tmp_record, "%s.tmp", record);
+
+    struct refs_list deltas;
+    struct refs_list dead;
+    refs_list_init(&deltas, keys->size + 1);
+    refs_list_init(&dead, 16);
+    int ret = 0;
+
+    // a manifest rewritten in place drops its old references first
+    struct refs_manifest_header header;
+    if (read_manifest_record(record, &header, &deltas) == 0)
+        unlink(record);
+    int i;
+    for (i = 0; i < keys->size; i++)
+        refs_list_add(&deltas, keys->entries[i].digest, 1);
+    refs_list_sort(&deltas, 1);
+
+    if ((ret = write_manifest_record(tmp_record, &m, keys)) ||
+        (ret = apply_deltas(blob_dir, &deltas, &dead))) {
+        unlink(tmp_record);
+        goto out;
+    }
+    if ((ret = rename(tmp_record, record)))
+        fprintf(stderr, "Error committing reference record %s\n", record);
+    remove_dead_blobs(blob_dir, &dead);
+
+out:
+    refs_list_free(&deltas);
+    refs_list_free(&dead);
+    return ret;
+}
+
+int refs_gc(const char* blob_dir, char** manifests, int manifest_count) {
+    int rebuild = !refs_exists(blob_dir);
+    if (ensure_refs_dirs(blob_dir))
+        return 1;
+
+    int ret = 0;
+    int i;
+    struct live_manifest* live = calloc(manifest_count > 0 ? manifest_count : 1, sizeof(struct live_manifest));
+    assert(live != NULL);
+    for (i = 0; i < manifest_count; i++) {
+        if ((ret = manifest_identity(manifests[i], &live[i]))) {
+            free(live);
+            return ret;
+        }
+    }
+
+    struct refs_list deltas;
+    struct refs_list dead;
+    refs_list_init(&deltas, 1024);
+    refs_list_init(&dead, 1024);
+
+    // Unregister manifests that are gone or have changed.  Their records
+    // are removed before the counts are lowered, so a crash leaks blobs
+    // rather than losing them.
+    char path[PATH_MAX];
+    char record[PATH_MAX];
+    refs_path(blob_dir, REFS_MANIFESTS, path);
+    DIR* dp = opendir(path);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", path);
+        ret = 1;
+        goto out;
+    }
+    struct dirent* ep;
+    while ((ep = readdir(dp))) {
+        if (ep->d_name[0] == '.')
+            continue;
+        manifest_record_path(blob_dir, ep->d_name, record);
+        size_t len = strlen(ep->d_name);
+        if (rebuild || (len > 4 && strcmp(ep->d_name + len - 4, ".tmp") == 0)) {
+            // Records without a table are left over from an old index.  A
+            // temp record may or may not have had its counts committed, so
+            // dropping it (and leaking) is the only safe choice.
+            unlink(record);
+            continue;
+        }
+
+        struct refs_manifest_header header;
+        if (read_manifest_record(record, &header, NULL)) {
+            // half written or foreign; its counts were never committed
+            unlink(record);
+            continue;
+        }
+        for (i = 0; i < manifest_count; i++) {
+            if (strcmp(live[i].id, ep->d_name) == 0)
+                break;
+        }
+        if (i < manifest_count && live[i].size == header.size && live[i].mtime == header.mtime) {
+            live[i].registered = 1;
+            continue;
+        }
+
+        if (read_manifest_record(record, &header, &deltas)) {
+            fprintf(stderr, "Error reading reference record %s\n", record);
+            continue;
+        }
+        unlink(record);
+    }
+    closedir(dp);
+
+    // Register new manifests.  The records are written to temp files
+    // and only renamed into place once the counts are committed.
+    struct refs_list keys;
+    refs_list_init(&keys, 1024);
+    for (i = 0; i < manifest_count; i++) {
+        if (live[i].registered)
+            continue;
+        int j;
+        for (j = 0; j < i; j++) {
+            if (strcmp(live[j].id, live[i].id) == 0)
+                break;
+        }
+        if (j < i) {
+            // listed twice
+            live[i].registered = 1;
+            continue;
+        }
+
+        keys.size = 0;
+        if (dedupe_read_manifest_keys(live[i].path, &keys)) {
+            ret = 1;
+            break;
+        }
+        refs_list_sort(&keys, 0);
+        manifest_record_path(blob_dir, live[i].id, record);
+        strcat(record, ".tmp");
+        if ((ret = write_manifest_record(record, &live[i], &keys)))
+            break;
+        for (j = 0; j < keys.size; j++)
+            refs_list_add(&deltas, keys.entries[j].digest, 1);
+    }
+    refs_list_free(&keys);
+
+    if (ret == 0) {
+        refs_list_sort(&deltas, 1);
+        ret = apply_deltas(blob_dir, &deltas, &dead);
+    }
+
+    for (i = 0; i < manifest_count; i++) {
+        if (live[i].registered)
+            continue;
+        char tmp_record[PATH_MAX];
+        manifest_record_path(blob_dir, live[i].id, record);
+        sprintf(tmp_record, "%s.tmp", record);
+        if (ret != 0)
+            unlink(tmp_record);
+        else if (rename(tmp_record, record))
+            fprintf(stderr, "Error committing reference record %s\n", record);
+    }
+
+    if (ret == 0)
+        remove_dead_blobs(blob_dir, &dead);
+
+out:
+    refs_list_free(&deltas);
+    refs_list_free(&dead);
+    free(live);
+    return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef DEDUPE_REFCOUNT_H
+#define DEDUPE_REFCOUNT_H
+
+#include <stdint.h>
+#include "minhash/Sha.h"
+
+// Persistent blob reference counts, kept in <blob_dir>/.refs.
+//
+// .refs/counts holds one record per blob (sorted by digest) with the
+// number of registered manifests that reference it.  .refs/manifests/
+// holds one file per registered manifest with the set of blobs it
+// references, so a manifest that has been deleted can still be
+// unregistered.  All updates are ordered so that a crash can only ever
+// leak blobs, never drop a blob that is still referenced.
+
+struct refs_entry {
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    int32_t count;
+};
+
+struct refs_list {
+    struct refs_entry* entries;
+    int size;
+    int capacity;
+};
+
+void refs_list_init(struct refs_list* list, int capacity);
+void refs_list_free(struct refs_list* list);
+void refs_list_add(struct refs_list* list, const unsigned char* digest, int count);
+// sort by digest and merge duplicate digests, summing or keeping one
+void refs_list_sort(struct refs_list* list, int sum_counts);
+
+// parse a manifest blob key ("abc/defg...") into a digest
+int refs_parse_key(const char* key, unsigned char* digest);
+void refs_blob_path(const char* blob_dir, const unsigned char* digest, char* path);
+
+// returns non zero if the blob store has a reference count index
+int refs_exists(const char* blob_dir);
+
+typedef void (*refs_callback)(const unsigned char* digest, uint32_t count, void* cookie);
+
+// calls "callback" for every blob in the index, in digest order.
+// Returns non zero if there is no index or it is unreadable.
+int refs_foreach(const char* blob_dir, refs_callback callback, void* cookie);
+
+// add a freshly written manifest's blobs to the index.
+// does nothing if the store has no index yet; the next gc builds it.
+int refs_register_manifest(const char* blob_dir, const char* manifest, struct refs_list* keys);
+
+// make the registered manifests match "manifests": unregister missing or
+// modified manifests, register new ones, and remove blobs whose count
+// drops to zero.  If the store has no index, one is built from scratch
+// (the caller is expected to have removed unreferenced blobs already).
+int refs_gc(const char* blob_dir, char** manifests, int manifest_count);
+
+// implemented by the manifest reader: collect the unique blob digests
+// referenced by a manifest.
+int dedupe_read_manifest_keys(const char* manifest, struct refs_list* keys);
+
+#endif
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "manifest.h"
+#include "refcount.h"
+#include "verify.h"
+
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+#define MAX_VERIFY_THREADS 8
+
+#define BLOB_OK 0
+#define BLOB_MISSING 1
+#define BLOB_CORRUPT 2
+
+// one per distinct blob referenced by the manifests
+struct blob_info {
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    uint64_t size;
+    // index of the only backup referencing it, or -1 if shared
+    int owner;
+    int status;
+};
+
+struct blob_table {
+    struct blob_info* blobs;
+    int size;
+    int capacity;
+};
+
+static void blob_table_add(struct blob_table* table, const unsigned char* digest, uint64_t size, int owner) {
+    if (table->size == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 1024;
+        table->blobs = realloc(table->blobs, sizeof(struct blob_info) * table->capacity);
+        assert(table->blobs != NULL);
+    }
+    struct blob_info* blob = &table->blobs[table->size++];
+    memcpy(blob->digest, digest, MH_SHA256_DIGEST_SIZE);
+    blob->size = size;
+    blob->owner = owner;
+    blob->status = BLOB_OK;
+}
+
+static int blob_compare(const void* a, const void* b) {
+    return memcmp(((const struct blob_info*) a)->digest, ((const struct blob_info*) b)->digest, MH_SHA256_DIGEST_SIZE);
+}
+
+// sort and merge duplicate blobs, marking ones owned by several backups
+static void blob_table_sort(struct blob_table* table) {
+    if (table->size == 0)
+        return;
+    qsort(table->blobs, table->size, sizeof(struct blob_info), blob_compare);
+    int i, j = 0;
+    for (i = 1; i < table->size; i++) {
+        if (memcmp(table->blobs[j].digest, table->blobs[i].digest, MH_SHA256_DIGEST_SIZE) == 0) {
+            if (table->blobs[j].owner != table->blobs[i].owner)
+                table->blobs[j].owner = -1;
+            continue;
+        }
+        table->blobs[++j] = table->blobs[i];
+    }
+    table->size = j + 1;
+}
+
+static struct blob_info* blob_table_find(const struct blob_table* table, const unsigned char* digest) {
+    struct blob_info key;
+    memcpy(key.digest, digest, MH_SHA256_DIGEST_SIZE);
+    return bsearch(&key, table->blobs, table->size, sizeof(struct blob_info), blob_compare);
+}
+
+// Copies the directory holding "manifest", ie. its backup, into the
+// PATH_MAX buffer "dir".  dirname() may modify its argument or return
+// static storage, so it gets a scratch copy.
+static void backup_dir(const char* manifest, char* dir) {
+    char scratch[PATH_MAX];
+    snprintf(scratch, sizeof(scratch), "%s", manifest);
+    snprintf(dir, PATH_MAX, "%s", dirname(scratch));
+}
+
+// Adds every file blob of the manifests to "table".  Backups are the
+// directories holding the manifests; "owners" receives each manifest's
+// backup index.
+static int load_blobs(char** manifests, int manifest_count, struct blob_table* table, int* owners, uint64_t* logical_bytes) {
+    int i;
+    for (i = 0; i < manifest_count; i++) {
+        char dir[PATH_MAX];
+        backup_dir(manifests[i], dir);
+        int j;
+        owners[i] = i;
+        for (j = 0; j < i; j++) {
+            char other[PATH_MAX];
+            backup_dir(manifests[j], other);
+            if (strcmp(other, dir) == 0) {
+                owners[i] = owners[j];
+                break;
+            }
+        }
+
+        struct dedupe_manifest manifest;
+        if (manifest_open(manifests[i], &manifest))
+            return 1;
+        uint32_t r;
+        for (r = 0; r < manifest.header->record_count; r++) {
+            const struct manifest_record* record = &manifest.records[r];
+            if (record->type != MANIFEST_TYPE_FILE)
+                continue;
+            blob_table_add(table, record->digest, record->size, owners[i]);
+            if (logical_bytes != NULL)
+                *logical_bytes += record->size;
+        }
+        manifest_close(&manifest);
+    }
+    blob_table_sort(table);
+    return 0;
+}
+
+struct verify_context {
+    const char* blob_dir;
+    struct blob_table* table;
+    int next;
+    uint64_t bytes;
+    pthread_mutex_t lock;
+};
+
+static int check_blob(const char* blob_dir, struct blob_info* blob, char* buf) {
+    char path[PATH_MAX];
+    refs_blob_path(blob_dir, blob->digest, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return BLOB_MISSING;
+
+    MhSha256Ctx c;
+    mhSha256Init(&c);
+    ssize_t bytes_read;
+    int status = BLOB_OK;
+    while ((bytes_read = read(fd, buf, VERIFY_BUFFER_SIZE)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            status = BLOB_CORRUPT;
+            break;
+        }
+        mhSha256Update(&c, buf, bytes_read);
+    }
+    close(fd);
+
+    unsigned char digest[MH_SHA256_DIGEST_SIZE];
+    memcpy(digest, mhSha256Final(&c), MH_SHA256_DIGEST_SIZE);
+    if (status == BLOB_OK && memcmp(digest, blob->digest, MH_SHA256_DIGEST_SIZE))
+        status = BLOB_CORRUPT;
+    return status;
+}
+
+static void* verify_worker(void* cookie) {
+    struct verify_context* context = (struct verify_context*) cookie;
+    char* buf = malloc(VERIFY_BUFFER_SIZE);
+    assert(buf != NULL);
+    for (;;) {
+        pthread_mutex_lock(&context->lock);
+        if (context->next >= context->table->size) {
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        struct blob_info* blob = &context->table->blobs[context->next++];
+        pthread_mutex_unlock(&context->lock);
+
+        blob->status = check_blob(context->blob_dir, blob, buf);
+        if (blob->status == BLOB_OK) {
+            pthread_mutex_lock(&context->lock);
+            context->bytes += blob->size;
+            pthread_mutex_unlock(&context->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int verify_thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > MAX_VERIFY_THREADS ? MAX_VERIFY_THREADS : cpus;
+}
+
+static void print_size(const char* label, uint64_t bytes) {
+    printf("%s%llu.%02llu MB\n", label, (unsigned long long) (bytes / (1024 * 1024)),
+           (unsigned long long) ((bytes % (1024 * 1024)) * 100 / (1024 * 1024)));
+}
+
+int dedupe_verify(const char* blob_dir, char** manifests, int manifest_count) {
+    struct blob_table table;
+    memset(&table, 0, sizeof(table));
+    int* owners = calloc(manifest_count > 0 ? manifest_count : 1, sizeof(int));
+    assert(owners != NULL);
+    if (load_blobs(manifests, manifest_count, &table, owners, NULL)) {
+        free(owners);
+        free(table.blobs);
+        return 1;
+    }
+
+    // each distinct blob is hashed once, however many manifests use it
+    struct verify_context context;
+    memset(&context, 0, sizeof(context));
+    context.blob_dir = blob_dir;
+    context.table = &table;
+    pthread_mutex_init(&context.lock, NULL);
+    pthread_t threads[MAX_VERIFY_THREADS];
+    int thread_count = verify_thread_count();
+    int started = 0;
+    int i;
+    for (i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, verify_worker, &context))
+            break;
+        started++;
+    }
+    verify_worker(&context);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&context.lock);
+
+    int missing = 0;
+    int corrupt = 0;
+    for (i = 0; i < table.size; i++) {
+        if (table.blobs[i].status == BLOB_MISSING)
+            missing++;
+        else if (table.blobs[i].status == BLOB_CORRUPT)
+            corrupt++;
+    }
+
+    // report per manifest, naming the files that cannot be restored
+    for (i = 0; missing + corrupt > 0 && i < manifest_count; i++) {
+        struct dedupe_manifest manifest;
+        if (manifest_open(manifests[i], &manifest))
+            continue;
+        int bad = 0;
+        uint32_t r;
+        for (r = 0; r < manifest.header->record_count; r++) {
+            const struct manifest_record* record = &manifest.records[r];
+            if (record->type != MANIFEST_TYPE_FILE)
+                continue;
+            struct blob_info* blob = blob_table_find(&table, record->digest);
+            if (blob == NULL || blob->status == BLOB_OK)
+                continue;
+            if (bad++ == 0)
+                printf("%s:\n", manifests[i]);
+            printf("  %s: %s\n", blob->status == BLOB_MISSING ? "missing" : "corrupt", manifest_path(&manifest, record));
+        }
+        manifest_close(&manifest);
+    }
+
+    printf("Verified %d blobs: %d missing, %d corrupt.\n", table.size, missing, corrupt);
+    print_size("Read ", context.bytes);
+
+    free(owners);
+    free(table.blobs);
+    return missing + corrupt > 0;
+}
+
+struct reclaim_context {
+    const char* blob_dir;
+    const struct blob_table* table;
+    uint64_t bytes;
+    int count;
+};
+
+// blobs still in the index that no live manifest references
+static void count_reclaimable(const unsigned char* digest, uint32_t count, void* cookie) {
+    struct reclaim_context* context = (struct reclaim_context*) cookie;
+    if (blob_table_find(context->table, digest) != NULL)
+        return;
+    char path[PATH_MAX];
+    struct stat st;
+    refs_blob_path(context->blob_dir, digest, path);
+    if (stat(path, &st) == 0) {
+        context->bytes += st.st_size;
+        context->count++;
+    }
+}
+
+struct backup_stats {
+    int manifest;
+    uint64_t unique_bytes;
+};
+
+static int backup_stats_compare(const void* a, const void* b) {
+    uint64_t x = ((const struct backup_stats*) a)->unique_bytes;
+    uint64_t y = ((const struct backup_stats*) b)->unique_bytes;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+int dedupe_stats(const char* blob_dir, char** manifests, int manifest_count) {
+    struct blob_table table;
+    memset(&table, 0, sizeof(table));
+    uint64_t logical_bytes = 0;
+    int* owners = calloc(manifest_count > 0 ? manifest_count : 1, sizeof(int));
+    struct backup_stats* backups = calloc(manifest_count > 0 ? manifest_count : 1, sizeof(struct backup_stats));
+    assert(owners != NULL && backups != NULL);
+    if (load_blobs(manifests, manifest_count, &table, owners, &logical_bytes)) {
+        free(owners);
+        free(backups);
+        free(table.blobs);
+        return 1;
+    }
+
+    int i;
+    uint64_t stored_bytes = 0;
+    for (i = 0; i < manifest_count; i++)
+        backups[i].manifest = i;
+    for (i = 0; i < table.size; i++) {
+        stored_bytes += table.blobs[i].size;
+        if (table.blobs[i].owner >= 0)
+            backups[table.blobs[i].owner].unique_bytes += table.blobs[i].size;
+    }
+
+    print_size("Backed up: ", logical_bytes);
+    print_size("Stored: ", stored_bytes);
+    if (stored_bytes > 0)
+        printf("Dedupe ratio: %llu.%02llu\n", (unsigned long long) (logical_bytes / stored_bytes),
+               (unsigned long long) ((logical_bytes % stored_bytes) * 100 / stored_bytes));
+
+    struct reclaim_context reclaim;
+    memset(&reclaim, 0, sizeof(reclaim));
+    reclaim.blob_dir = blob_dir;
+    reclaim.table = &table;
+    if (refs_foreach(blob_dir, count_reclaimable, &reclaim) == 0) {
+        printf("Reclaimable by gc: %d blobs, ", reclaim.count);
+        print_size("", reclaim.bytes);
+    }
+    else {
+        printf("Reclaimable by gc: unknown (no reference index, run gc)\n");
+    }
+
+    // space freed by deleting each backup, most first
+    qsort(backups, manifest_count, sizeof(struct backup_stats), backup_stats_compare);
+    printf("Unique data per backup:\n");
+    for (i = 0; i < manifest_count; i++) {
+        // only the first manifest of each backup carries its total
+        if (owners[backups[i].manifest] != backups[i].manifest)
+            continue;
+        char dir[PATH_MAX];
+        backup_dir(manifests[backups[i].manifest], dir);
+        char label[PATH_MAX + 8];
+        sprintf(label, "  %s: ", dir);
+        print_size(label, backups[i].unique_bytes);
+    }
+
+    free(owners);
+    free(backups);
+    free(table.blobs);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef DEDUPE_VERIFY_H
+#define DEDUPE_VERIFY_H
+
+// dedupe verify blob_dir input_manifests...
+int dedupe_verify(const char* blob_dir, char** manifests, int manifest_count);
+
+// dedupe stats blob_dir input_manifests...
+int dedupe_stats(const char* blob_dir, char** manifests, int manifest_count);
+
+#endif
@@ -21,6 +21,7 @@ LOCAL_SRC_FILES := \
 		main.c
 
 LOCAL_CFLAGS := $(edify_cflags) -g -O0
+LOCAL_LDLIBS += -lpthread
 LOCAL_MODULE := edify
 LOCAL_YACCFLAGS := -v
 
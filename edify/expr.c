@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -32,6 +33,155 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+// -----------------------------------------------------------------
+//   evaluation arena
+// -----------------------------------------------------------------
+
+// Scratch allocations are strictly nested (each is released before the
+// evaluation that made it returns), so the arena is a single block used
+// as a stack.
+#define ARENA_SIZE (16 * 1024)
+#define ARENA_ALIGN 8
+
+struct EvalArena {
+    char* base;
+    size_t used;
+    size_t peak;
+    long allocs;
+    long fallbacks;
+};
+
+EvalArena* NewEvalArena() {
+    EvalArena* arena = calloc(1, sizeof(EvalArena));
+    if (arena == NULL) return NULL;
+    arena->base = malloc(ARENA_SIZE);
+    if (arena->base == NULL) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void FreeEvalArena(EvalArena* arena) {
+    if (arena == NULL) return;
+    free(arena->base);
+    free(arena);
+}
+
+// Add the counts of "from" (a parallel() branch's arena) to "to", and
+// free "from".
+static void MergeEvalArena(EvalArena* to, EvalArena* from) {
+    if (to != NULL && from != NULL) {
+        to->allocs += from->allocs;
+        to->fallbacks += from->fallbacks;
+        if (from->peak > to->peak) to->peak = from->peak;
+    }
+    FreeEvalArena(from);
+}
+
+// Allocate "size" bytes that will be given back with ScratchFree()
+// before the current evaluation returns.  *mark is for ScratchFree().
+static void* ScratchAlloc(State* state, size_t size, size_t* mark) {
+    EvalArena* arena = state->arena;
+    if (arena == NULL) return malloc(size);
+
+    *mark = arena->used;
+    if (size == 0) size = ARENA_ALIGN;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > ARENA_SIZE - arena->used) {
+        ++arena->fallbacks;
+        return malloc(size);
+    }
+    void* p = arena->base + arena->used;
+    arena->used += size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    ++arena->allocs;
+    return p;
+}
+
+static void ScratchFree(State* state, void* p, size_t mark) {
+    EvalArena* arena = state->arena;
+    if (arena != NULL && (char*)p >= arena->base &&
+        (char*)p < arena->base + ARENA_SIZE) {
+        arena->used = mark;
+    } else {
+        free(p);
+    }
+}
+
+// Freed Value wrappers, kept for StringValue().  Any Value can go
+// here, however it was allocated, since they are all malloc()'d.
+#define MAX_SPARE_VALUES 256
+
+// Values are made and freed on every parallel() branch, so the spare
+// list and the external blobs below are shared under value_lock.
+static pthread_mutex_t value_lock = PTHREAD_MUTEX_INITIALIZER;
+static Value* spare_values[MAX_SPARE_VALUES];
+static int num_spare_values = 0;
+static long value_reuses = 0;
+
+static Value* AllocValue() {
+    Value* v = NULL;
+    pthread_mutex_lock(&value_lock);
+    if (num_spare_values > 0) {
+        ++value_reuses;
+        v = spare_values[--num_spare_values];
+    }
+    pthread_mutex_unlock(&value_lock);
+    return v != NULL ? v : malloc(sizeof(Value));
+}
+
+static void ReleaseValue(Value* v) {
+    pthread_mutex_lock(&value_lock);
+    if (num_spare_values < MAX_SPARE_VALUES) {
+        spare_values[num_spare_values++] = v;
+        v = NULL;
+    }
+    pthread_mutex_unlock(&value_lock);
+    free(v);
+}
+
+// Blobs from ExternalBlobValue(), with what to call instead of free().
+// There are seldom more than a few alive at once.
+typedef struct ExternalBlob {
+    char* data;
+    void (*release)(char* data, void* cookie);
+    void* cookie;
+    struct ExternalBlob* next;
+} ExternalBlob;
+
+static ExternalBlob* external_blobs = NULL;
+
+static bool ReleaseExternalBlob(char* data) {
+    ExternalBlob** pp;
+    ExternalBlob* b = NULL;
+    pthread_mutex_lock(&value_lock);
+    for (pp = &external_blobs; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->data == data) {
+            b = *pp;
+            *pp = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&value_lock);
+    if (b == NULL) return false;
+    b->release(b->data, b->cookie);
+    free(b);
+    return true;
+}
+
+void GetEvalArenaStats(const EvalArena* arena, EvalArenaStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (arena != NULL) {
+        stats->arena_allocs = arena->allocs;
+        stats->arena_fallbacks = arena->fallbacks;
+        stats->arena_peak = arena->peak;
+    }
+    pthread_mutex_lock(&value_lock);
+    stats->value_reuses = value_reuses;
+    pthread_mutex_unlock(&value_lock);
+}
+
 char* Evaluate(State* state, Expr* expr) {
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
     if (v == NULL) return NULL;
@@ -41,7 +191,7 @@ char* Evaluate(State* state, Expr* expr) {
         return NULL;
     }
     char* result = v->data;
-    free(v);
+    ReleaseValue(v);
     return result;
 }
 
@@ -51,7 +201,7 @@ Value* EvaluateValue(State* state, Expr* expr) {
 
 Value* StringValue(char* str) {
     if (str == NULL) return NULL;
-    Value* v = malloc(sizeof(Value));
+    Value* v = AllocValue();
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
@@ -60,15 +210,45 @@ Value* StringValue(char* str) {
 
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
-    free(v);
+    // An external blob was registered before its Value was handed out,
+    // so an empty list (the usual case) needs no lock to be sure of.
+    if (v->type != VAL_BLOB || external_blobs == NULL ||
+        !ReleaseExternalBlob(v->data)) {
+        free(v->data);
+    }
+    ReleaseValue(v);
+}
+
+Value* ExternalBlobValue(char* data, ssize_t size,
+                         void (*release)(char* data, void* cookie),
+                         void* cookie) {
+    ExternalBlob* b = malloc(sizeof(ExternalBlob));
+    Value* v = b == NULL ? NULL : AllocValue();
+    if (v == NULL) {
+        free(b);
+        release(data, cookie);
+        return NULL;
+    }
+    b->data = data;
+    b->release = release;
+    b->cookie = cookie;
+    pthread_mutex_lock(&value_lock);
+    b->next = external_blobs;
+    external_blobs = b;
+    pthread_mutex_unlock(&value_lock);
+
+    v->type = VAL_BLOB;
+    v->size = size;
+    v->data = data;
+    return v;
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
+    size_t mark;
+    char** strings = ScratchAlloc(state, argc * sizeof(char*), &mark);
     int i;
     for (i = 0; i < argc; ++i) {
         strings[i] = NULL;
@@ -95,7 +275,7 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         free(strings[i]);
     }
-    free(strings);
+    ScratchFree(state, strings, mark);
     return StringValue(result);
 }
 
@@ -271,6 +451,110 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
     return EvaluateValue(state, argv[1]);
 }
 
+// -----------------------------------------------------------------
+//   parallel()
+// -----------------------------------------------------------------
+
+// Names of the functions that may run inside parallel().  Operators
+// and literals always may.
+static const char** parallel_names = NULL;
+static int parallel_entries = 0;
+
+void AllowInParallel(const char* name) {
+    parallel_names = realloc(parallel_names,
+                             (parallel_entries + 1) * sizeof(const char*));
+    parallel_names[parallel_entries++] = name;
+}
+
+// Returns the name of the first function in "expr" that isn't allowed
+// in parallel(), or NULL if there is none.
+static const char* FindUnsafeFunction(Expr* expr) {
+    int i;
+    if (expr->fn != Literal && strcmp(expr->name, "(operator)") != 0) {
+        for (i = 0; i < parallel_entries; ++i) {
+            if (strcmp(parallel_names[i], expr->name) == 0) break;
+        }
+        if (i == parallel_entries) return expr->name;
+    }
+    for (i = 0; i < expr->argc; ++i) {
+        const char* unsafe = FindUnsafeFunction(expr->argv[i]);
+        if (unsafe != NULL) return unsafe;
+    }
+    return NULL;
+}
+
+typedef struct {
+    State state;        // a copy of the caller's, with its own errmsg
+    Expr* expr;
+    Value* result;
+    pthread_t thread;
+    bool started;
+} ParallelBranch;
+
+static void* ParallelBranchThread(void* cookie) {
+    ParallelBranch* branch = (ParallelBranch*)cookie;
+    branch->result = EvaluateValue(&branch->state, branch->expr);
+    return NULL;
+}
+
+// parallel(expr, ...) evaluates its arguments at the same time, each on
+// its own thread, and waits for all of them.  It returns the value of
+// the last one, or fails with the error of the first (in argument
+// order) that failed.
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return ErrorAbort(state, "%s() expects at least 1 arg", name);
+    }
+    int i;
+    for (i = 0; i < argc; ++i) {
+        const char* unsafe = FindUnsafeFunction(argv[i]);
+        if (unsafe != NULL) {
+            return ErrorAbort(state, "%s() can't run %s() in parallel",
+                              name, unsafe);
+        }
+    }
+
+    ParallelBranch* branches = calloc(argc, sizeof(ParallelBranch));
+    for (i = 0; i < argc; ++i) {
+        branches[i].state = *state;
+        branches[i].state.errmsg = NULL;
+        branches[i].state.arena = NewEvalArena();
+        branches[i].expr = argv[i];
+    }
+    // The last branch runs on this thread; so does any that can't get
+    // one of its own.
+    for (i = 0; i < argc - 1; ++i) {
+        branches[i].started = pthread_create(&branches[i].thread, NULL,
+                                             ParallelBranchThread,
+                                             &branches[i]) == 0;
+    }
+    for (i = 0; i < argc; ++i) {
+        if (!branches[i].started) ParallelBranchThread(&branches[i]);
+    }
+
+    Value* result = NULL;
+    bool failed = false;
+    for (i = 0; i < argc; ++i) {
+        ParallelBranch* branch = &branches[i];
+        if (branch->started) pthread_join(branch->thread, NULL);
+        if (branch->result == NULL && !failed) {
+            failed = true;
+            free(state->errmsg);
+            state->errmsg = branch->state.errmsg;
+            branch->state.errmsg = NULL;
+        }
+        if (i == argc - 1 && !failed) {
+            result = branch->result;
+        } else {
+            FreeValue(branch->result);
+        }
+        free(branch->state.errmsg);
+        MergeEvalArena(state->arena, branch->state.arena);
+    }
+    free(branches);
+    return result;
+}
+
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 2) {
         free(state->errmsg);
@@ -392,6 +676,19 @@ void RegisterBuiltins() {
 
     RegisterFunction("less_than_int", LessThanIntFn);
     RegisterFunction("greater_than_int", GreaterThanIntFn);
+
+    RegisterFunction("parallel", ParallelFn);
+
+    AllowInParallel("ifelse");
+    AllowInParallel("abort");
+    AllowInParallel("assert");
+    AllowInParallel("concat");
+    AllowInParallel("is_substring");
+    AllowInParallel("stdout");
+    AllowInParallel("sleep");
+    AllowInParallel("less_than_int");
+    AllowInParallel("greater_than_int");
+    AllowInParallel("parallel");
 }
 
 
@@ -403,7 +700,8 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
+    size_t mark;
+    char** args = ScratchAlloc(state, count * sizeof(char*), &mark);
     va_list v;
     va_start(v, count);
     int i;
@@ -415,13 +713,13 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 free(args[j]);
             }
-            free(args);
+            ScratchFree(state, args, mark);
             return -1;
         }
         *(va_arg(v, char**)) = args[i];
     }
     va_end(v);
-    free(args);
+    ScratchFree(state, args, mark);
     return 0;
 }
 
@@ -429,7 +727,8 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
+    size_t mark;
+    Value** args = ScratchAlloc(state, count * sizeof(Value*), &mark);
     va_list v;
     va_start(v, count);
     int i;
@@ -441,13 +740,13 @@ int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 FreeValue(args[j]);
             }
-            free(args);
+            ScratchFree(state, args, mark);
             return -1;
         }
         *(va_arg(v, Value**)) = args[i];
     }
     va_end(v);
-    free(args);
+    ScratchFree(state, args, mark);
     return 0;
 }
 
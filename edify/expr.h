@@ -28,6 +28,7 @@ extern "C" {
 #define MAX_STRING_LEN 1024
 
 typedef struct Expr Expr;
+typedef struct EvalArena EvalArena;
 
 typedef struct {
     // Optional pointer to app-specific data; the core of edify never
@@ -43,6 +44,10 @@ typedef struct {
     // Should be NULL initially, will be either NULL or a malloc'd
     // pointer after Evaluate() returns.
     char* errmsg;
+
+    // Optional scratch space for evaluation (see NewEvalArena()); may
+    // be NULL.
+    EvalArena* arena;
 } State;
 
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
@@ -91,6 +96,7 @@ Value* SubstringFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]);
 
 // Convenience function for building expressions with a fixed number
 // of arguments.
@@ -121,6 +127,12 @@ void RegisterFunction(const char* name, Function fn);
 // Register all the builtins.
 void RegisterBuiltins();
 
+// Let the function registered as "name" be called inside parallel(),
+// which runs its arguments on separate threads.  Only functions that
+// keep no unlocked global state (including the working directory) may
+// be allowed; parallel() refuses any other.
+void AllowInParallel(const char* name);
+
 // Call this after all calls to RegisterFunction() but before parsing
 // any scripts to finish building the function table.
 void FinishRegistration();
@@ -164,6 +176,36 @@ Value* StringValue(char* str);
 // Free a Value object.
 void FreeValue(Value* v);
 
+// Wrap "size" bytes at "data" that were not malloc()'d (a mapped part
+// of a file, say) as a VAL_BLOB.  FreeValue() then calls
+// release(data, cookie) instead of free(); the data must not be freed
+// any other way.  On failure release() is called and NULL returned.
+Value* ExternalBlobValue(char* data, ssize_t size,
+                         void (*release)(char* data, void* cookie),
+                         void* cookie);
+
+
+// --- evaluation arena ---
+
+// An EvalArena holds the short-lived allocations the edify core makes
+// while evaluating a script (argument arrays, mostly), so that a long
+// script doesn't call malloc() and free() for each of them.  Freed
+// Value wrappers are kept for reuse as well.  Everything handed to a
+// function is still malloc()'d, since functions free() what they are
+// given, so nothing ever has to be copied out of the arena.
+EvalArena* NewEvalArena();
+void FreeEvalArena(EvalArena* arena);
+
+typedef struct {
+    long arena_allocs;      // allocations served by the arena
+    long arena_fallbacks;   // requests too big for it, passed to malloc()
+    size_t arena_peak;      // most bytes in use at once
+    long value_reuses;      // Value wrappers reused instead of malloc()'d
+} EvalArenaStats;
+
+// arena may be NULL, for the Value counts alone.
+void GetEvalArenaStats(const EvalArena* arena, EvalArenaStats* stats);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
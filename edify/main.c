@@ -44,10 +44,12 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     state.cookie = NULL;
     state.script = strdup(expr_str);
     state.errmsg = NULL;
+    state.arena = NewEvalArena();
 
     result = Evaluate(&state, e);
     free(state.errmsg);
     free(state.script);
+    FreeEvalArena(state.arena);
     if (result == NULL && expected != NULL) {
         fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
         ++*errors;
@@ -154,6 +156,13 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // parallel function
+    expect("parallel(a, b, c)", "c", &errors);
+    expect("parallel(concat(a, b), ifelse(t, yes, no))", "yes", &errors);
+    expect("parallel(a, parallel(b, c))", "c", &errors);
+    expect("parallel(a, abort())", NULL, &errors);
+    expect("parallel(abort(), b)", NULL, &errors);
+
     printf("\n");
 
     return errors;
@@ -204,6 +213,7 @@ int main(int argc, char** argv) {
         state.cookie = NULL;
         state.script = buffer;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
         if (result == NULL) {
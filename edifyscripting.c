@@ -296,6 +296,7 @@ int run_script_from_buffer(char* script_data, int script_len, char* filename)
         state.cookie = NULL;
         state.script = script_data;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
         if (result == NULL) {
@@ -345,6 +346,7 @@ int edify_main(int argc, char** argv) {
         state.cookie = NULL;
         state.script = buffer;
         state.errmsg = NULL;
+        state.arena = NULL;
 
         char* result = Evaluate(&state, root);
         if (result == NULL) {
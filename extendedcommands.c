@@ -51,6 +51,7 @@
 #include "voldclient/voldclient.h"
 
 #include "adb_install.h"
+#include "verifier.h"
 
 int get_filtered_menu_selection(const char** headers, char** items, int menu_only, int initial_selection, int items_count) {
   int index;
@@ -154,12 +155,19 @@ void toggle_loki_support() {
 #endif
 
 int install_zip(const char* packagefilepath) {
+  return install_zip_and_prefetch(packagefilepath, NULL, NULL);
+}
+
+// Like install_zip(), but once the zip is verified, start prefetching
+// "next" (if not NULL) into *prefetch; see install_package_and_prefetch().
+int install_zip_and_prefetch(const char* packagefilepath, const char* next, PackagePrefetch** prefetch) {
   ui_print("\n-- Installing: %s\n", packagefilepath);
   if (device_flash_type() == MTD) {
     set_sdcard_update_bootloader_message();
   }
   
-  int status = install_package(packagefilepath);
+  int status = next != NULL ? install_package_and_prefetch(packagefilepath, next, prefetch)
+                            : install_package(packagefilepath);
   ui_reset_progress();
   if (status != INSTALL_SUCCESS) {
     ui_set_background(BACKGROUND_ICON_CLOCKWORK);
@@ -182,10 +190,110 @@ int install_zip(const char* packagefilepath) {
   return 0;
 }
 
+// Install the zips in order, stopping at the first one that fails. Each
+// zip is verified, indexed and read ahead while the update binary of the
+// one before it runs.
+int install_zip_queue(char** packagefilepaths, int count) {
+  int i, status = 0;
+  for (i = 0; i < count && status == 0; i++) {
+    PackagePrefetch* next = NULL;
+    ui_print("\n-- Zip %d of %d\n", i + 1, count);
+    status = install_zip_and_prefetch(packagefilepaths[i],
+                                      i + 1 < count ? packagefilepaths[i + 1] : NULL, &next);
+    finish_package_prefetch(next);
+    if (status != 0) {
+      ui_print("Failed to install %s\n", packagefilepaths[i]);
+    }
+  }
+  for (; i < count; i++) {
+    ui_print("Skipped %s\n", packagefilepaths[i]);
+  }
+  return status;
+}
+
+#define MAX_INSTALL_QUEUE 16
+static char* install_queue[MAX_INSTALL_QUEUE];
+static int install_queue_count = 0;
+
+static void clear_install_queue() {
+  int i;
+  for (i = 0; i < install_queue_count; i++)
+    free(install_queue[i]);
+  install_queue_count = 0;
+}
+
+// the queue is kept until it is installed or cleared
+static void show_install_queue_menu(const char* default_path) {
+  static const char* headers[] = { "Install Queue", "Select a queued zip to remove it", "", NULL };
+  static const char* choose_headers[] = { "Choose a zip to queue", "", NULL };
+  char* items[MAX_INSTALL_QUEUE + 4];
+  char names[MAX_INSTALL_QUEUE][PATH_MAX];
+  char buf[100];
+  int i;
+  
+#define ITEM_QUEUE_ADD 0
+#define ITEM_QUEUE_INSTALL 1
+#define ITEM_QUEUE_CLEAR 2
+#define FIXED_INSTALL_QUEUE_MENUS 3
+  
+  for (;;) {
+    items[ITEM_QUEUE_ADD] = "add zip to queue";
+    items[ITEM_QUEUE_INSTALL] = "install queued zips";
+    items[ITEM_QUEUE_CLEAR] = "clear queue";
+    for (i = 0; i < install_queue_count; i++) {
+      const char* name = strrchr(install_queue[i], '/');
+      snprintf(names[i], PATH_MAX, "%d. %s", i + 1, name != NULL ? name + 1 : install_queue[i]);
+      items[FIXED_INSTALL_QUEUE_MENUS + i] = names[i];
+    }
+    items[FIXED_INSTALL_QUEUE_MENUS + install_queue_count] = NULL;
+    
+    int chosen_item = get_menu_selection(headers, items, 0, 0);
+    if (chosen_item == ITEM_QUEUE_ADD) {
+      if (install_queue_count == MAX_INSTALL_QUEUE) {
+        ui_print("Install queue is full.\n");
+        continue;
+      }
+      const char* folder = read_last_install_path();
+      if (folder == NULL || ensure_path_mounted(folder) != 0)
+        folder = default_path;
+      if (ensure_path_mounted(folder) != 0) {
+        LOGE("Can't mount %s\n", folder);
+        continue;
+      }
+      char* file = choose_file_menu(folder, ".zip", choose_headers);
+      if (file != NULL)
+        install_queue[install_queue_count++] = file;
+    } else if (chosen_item == ITEM_QUEUE_INSTALL) {
+      if (install_queue_count == 0) {
+        ui_print("Install queue is empty.\n");
+        continue;
+      }
+      sprintf(buf, "Yes - Install %d zip(s)", install_queue_count);
+      if (confirm_selection("Confirm install?", buf)) {
+        install_zip_queue(install_queue, install_queue_count);
+        write_last_install_path(dirname(install_queue[install_queue_count - 1]));
+        clear_install_queue();
+        return;
+      }
+    } else if (chosen_item == ITEM_QUEUE_CLEAR) {
+      clear_install_queue();
+    } else if (chosen_item >= FIXED_INSTALL_QUEUE_MENUS) {
+      i = chosen_item - FIXED_INSTALL_QUEUE_MENUS;
+      free(install_queue[i]);
+      for (; i < install_queue_count - 1; i++)
+        install_queue[i] = install_queue[i + 1];
+      install_queue_count--;
+    } else {
+      // GO_BACK or REFRESH
+      return;
+    }
+  }
+}
+
 // top fixed menu items, those before extra storage volumes
 #define FIXED_TOP_INSTALL_ZIP_MENUS 1
 // bottom fixed menu items, those after extra storage volumes
-#define FIXED_BOTTOM_INSTALL_ZIP_MENUS 2
+#define FIXED_BOTTOM_INSTALL_ZIP_MENUS 4
 #define FIXED_INSTALL_ZIP_MENUS (FIXED_TOP_INSTALL_ZIP_MENUS + FIXED_BOTTOM_INSTALL_ZIP_MENUS)
 
 int show_install_update_menu() {
@@ -214,11 +322,14 @@ int show_install_update_menu() {
   // FIXED_BOTTOM_INSTALL_ZIP_MENUS
   install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes] = "choose zip from last install folder";
   install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 1] = "install zip from sideload";
+  install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2] = "install several zips in a row";
   
   // extra NULL for GO_BACK
-  install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2] = NULL;
+  install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 4] = NULL;
   
   for (;;) {
+    install_menu_items[FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 3] = integrity_check_enabled ?
+        "disable zip integrity pre-check" : "enable zip integrity pre-check";
     chosen_item = get_menu_selection(headers, install_menu_items, 0, 0);
     if (chosen_item == 0) {
       show_choose_zip_menu(primary_path);
@@ -232,6 +343,12 @@ int show_install_update_menu() {
 	show_choose_zip_menu(last_path_used);
     } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 1) {
       apply_from_adb();
+    } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 2) {
+      show_install_queue_menu(primary_path);
+    } else if (chosen_item == FIXED_TOP_INSTALL_ZIP_MENUS + num_extra_volumes + 3) {
+      integrity_check_enabled = !integrity_check_enabled;
+      ui_print("Zip integrity pre-check: %s\n", integrity_check_enabled ? "Enabled" : "Disabled");
+      update_cot_settings();
     } else {
       // GO_BACK or REFRESH (chosen_item < 0)
       goto out;
@@ -454,17 +571,25 @@ void show_choose_zip_menu(const char *mount_point) {
   if (file == NULL)
     return;
   
+  // storage is idle while the user decides: read the zip ahead so that
+  // verification runs from the page cache, and stop as soon as they answer
+  PackagePrefetch* readahead = start_package_readahead(file);
+  
   if (backupprompt == 0) {
     char confirm[PATH_MAX];
     sprintf(confirm, "Yes - Install %s", basename(file));
   
-    if (confirm_selection("Confirm install?", confirm)) {
+    int confirmed = confirm_selection("Confirm install?", confirm);
+    cancel_package_prefetch(readahead);
+    if (confirmed) {
       install_zip(file);
       write_last_install_path(dirname(file));
     }
   } else {
     for (;;) {
       int chosen_item = get_menu_selection(headers, INSTALL_OR_BACKUP_ITEMS, 0, 0);
+      // a backup would only push the zip out of the cache again
+      cancel_package_prefetch(readahead);
       switch(chosen_item) {
 	case ITEM_BACKUP_AND_INSTALL:
 	{
@@ -525,6 +650,11 @@ void show_nandroid_delete_menu(const char* path) {
   if (confirm_selection("Confirm delete?", "Yes - Delete")) {
     sprintf(tmp, "rm -rf %s", file);
     __system(tmp);
+    // dropping the manifests from the blob index is cheap, so free
+    // the blobs only this backup used right away
+    sprintf(tmp, "%s/cotrecovery/blobs", path);
+    if (access(tmp, F_OK) != -1)
+      nandroid_dedupe_gc(tmp);
   }
   
   free(file);
@@ -586,6 +716,9 @@ static int control_usb_storage(bool on) {
       num++;
     }
   }
+  // the host may have rewritten any package on a shared volume
+  if (num > 0)
+    forget_verified_packages();
   return num;
 }
 
@@ -775,7 +908,7 @@ void show_nandroid_advanced_restore_menu(const char* path) {
       free(file);
 }
 
-static void run_dedupe_gc() {
+static void for_each_dedupe_store(void (*action)(const char* blob_dir), int existing_only) {
   char path[PATH_MAX];
   char* fmt = "%s/cotrecovery/blobs";
   char* primary_path = get_primary_storage_path();
@@ -784,17 +917,31 @@ static void run_dedupe_gc() {
   
   sprintf(path, fmt, primary_path);
   ensure_path_mounted(primary_path);
-  nandroid_dedupe_gc(path);
+  if (!existing_only || access(path, F_OK) != -1)
+    action(path);
   
   if (extra_paths != NULL) {
     for (i = 0; i < get_num_extra_volumes(); i++) {
       ensure_path_mounted(extra_paths[i]);
       sprintf(path, fmt, extra_paths[i]);
-      nandroid_dedupe_gc(path);
+      if (!existing_only || access(path, F_OK) != -1)
+	action(path);
     }
   }
 }
 
+static void run_dedupe_gc() {
+  for_each_dedupe_store(nandroid_dedupe_gc, 0);
+}
+
+static void run_dedupe_verify() {
+  for_each_dedupe_store(nandroid_dedupe_verify, 1);
+}
+
+static void run_dedupe_stats() {
+  for_each_dedupe_store(nandroid_dedupe_stats, 1);
+}
+
 static void choose_default_backup_format() {
   static const char* headers[] = { "Default Backup Format", "", NULL };
   
@@ -864,7 +1011,7 @@ static void add_nandroid_options_for_volume(char** menu, char* path, int offset)
 // these go on top of menu list
 #define NANDROID_ACTIONS_NUM 4
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 2
+#define NANDROID_FIXED_ENTRIES 4
 
 int show_nandroid_menu() {
   char* primary_path = get_primary_storage_path();
@@ -894,6 +1041,8 @@ int show_nandroid_menu() {
   // fixed bottom entries
   list[offset] = "free unused backup data";
   list[offset + 1] = "choose default backup format";
+  list[offset + 2] = "verify backup data";
+  list[offset + 3] = "backup data statistics";
   offset += NANDROID_FIXED_ENTRIES;
   
   #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -915,6 +1064,10 @@ int show_nandroid_menu() {
       run_dedupe_gc();
     } else if (chosen_item == (action_entries_num + 1)) {
       choose_default_backup_format();
+    } else if (chosen_item == (action_entries_num + 2)) {
+      run_dedupe_verify();
+    } else if (chosen_item == (action_entries_num + 3)) {
+      run_dedupe_stats();
     } else if (chosen_item < action_entries_num) {
       // get nandroid volume actions path
       if (chosen_item < NANDROID_ACTIONS_NUM) {
@@ -19,6 +19,13 @@ show_nandroid_menu();
 int
 install_zip(const char* packagefilepath);
 
+struct PackagePrefetch;
+int
+install_zip_and_prefetch(const char* packagefilepath, const char* next, struct PackagePrefetch** prefetch);
+
+int
+install_zip_queue(char** packagefilepaths, int count);
+
 int
 __system(const char *command);
 
@@ -47,6 +54,8 @@ void write_recovery_version();
 
 void free_string_array(char** array);
 
+char* choose_file_menu(const char* basedir, const char* fileExtensionOrDirectory, const char* headers[]);
+
 int can_partition(const char* volume);
 
 int is_path_mounted(const char* path);
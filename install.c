@@ -19,7 +19,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -368,16 +372,48 @@ try_update_binary(const char *path, ZipArchive *zip) {
     return INSTALL_SUCCESS;
 }
 
+static void
+integrity_progress(int64_t done, int64_t total, void* cookie) {
+    ui_set_progress(total > 0 ? (float)done / total : 1.0);
+}
+
+// Check the CRC of every entry on all cores before the updater runs, so
+// a corrupt package is rejected before anything has been formatted.
 static int
-really_install_package(const char *path)
-{
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_print("Finding update package...\n");
-    ui_show_indeterminate_progress();
+check_package_integrity(ZipArchive* zip) {
+    ui_print("Checking package integrity...\n");
+    ui_show_progress(VERIFICATION_PROGRESS_FRACTION, 0);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    const ZipEntry* bad = NULL;
+    int64_t bytes = 0;
+    bool ok = mzVerifyZipArchive(zip, 0, integrity_progress, NULL, &bad, &bytes);
+    gettimeofday(&end, NULL);
+    ui_reset_progress();
 
-    // Resolve symlink in case legacy /sdcard path is used
-    // Requires: symlink uses absolute path
-    char new_path[PATH_MAX];
+    if (!ok) {
+        if (bad != NULL)
+            ui_print("Package is corrupt: %.*s\n", bad->fileNameLen, bad->fileName);
+        else
+            ui_print("Package integrity check failed.\n");
+        return -1;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    double mb = bytes / (1024.0 * 1024.0);
+    ui_print("Checked %.1f MB in %.1fs (%.1f MB/s)\n", mb, seconds,
+             seconds > 0 ? mb / seconds : mb);
+    return 0;
+}
+
+// Resolve symlink in case legacy /sdcard path is used
+// Requires: symlink uses absolute path
+// Returns "path" itself, or "new_path" (PATH_MAX bytes) holding the
+// resolved one.
+static const char*
+resolve_package_path(const char *path, char *new_path)
+{
     if (strlen(path) > 1) {
         char *rest = strchr(path + 1, '/');
         if (rest != NULL) {
@@ -394,6 +430,19 @@ really_install_package(const char *path)
             free(root);
         }
     }
+    return path;
+}
+
+static int
+really_install_package(const char *path, const StreamDigest *digest,
+                       const char *next, PackagePrefetch **prefetch)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding update package...\n");
+    ui_show_indeterminate_progress();
+
+    char new_path[PATH_MAX];
+    path = resolve_package_path(path, new_path);
 
     LOGI("Update location: %s\n", path);
 
@@ -406,7 +455,10 @@ really_install_package(const char *path)
 
     int err;
 
-    if (signature_check_enabled) {
+    // The result is only worth anything to the install if the verifier
+    // can cache it; elsewhere (vfat, exfat, FUSE) the install verifies
+    // again anyway, so don't read the whole package a second time.
+    if (signature_check_enabled && verify_cache_usable(prefetch->path)) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
@@ -421,7 +473,10 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        if (digest != NULL)
+            err = verify_file_with_digest(path, digest, loadedKeys, numKeys);
+        else
+            err = verify_file_cached(path, loadedKeys, numKeys);
         free(loadedKeys);
         LOGI("verify_file returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
@@ -432,23 +487,36 @@ really_install_package(const char *path)
         }
     }
 
-    /* Try to open the package.
+    /* Try to open the package.  The parsed index is saved for the
+     * update binary, which opens the same package again.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    err = mzOpenZipArchiveCached(path, MZ_DEFAULT_INDEX_CACHE, &zip);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
         return INSTALL_CORRUPT;
     }
 
+    if (integrity_check_enabled && check_package_integrity(&zip) != 0) {
+        mzCloseZipArchive(&zip);
+        return INSTALL_CORRUPT;
+    }
+
+    /* This package is verified and indexed; the next one can use the
+     * storage while the update binary runs.
+     */
+    if (next != NULL)
+        *prefetch = start_package_prefetch(next);
+
     /* Verify and install the contents of the package.
      */
     ui_print("Installing update...\n");
     return try_update_binary(path, &zip);
 }
 
-int
-install_package(const char* path)
+static int
+install_package_internal(const char* path, const StreamDigest *digest,
+                         const char *next, PackagePrefetch **prefetch)
 {
     FILE* install_log = fopen_path(LAST_INSTALL_FILE, "w");
     if (install_log) {
@@ -457,7 +525,7 @@ install_package(const char* path)
     } else {
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
-    int result = really_install_package(path);
+    int result = really_install_package(path, digest, next, prefetch);
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
@@ -467,3 +535,164 @@ install_package(const char* path)
     ui_set_background(BACKGROUND_ICON_CLOCKWORK);
     return result;
 }
+
+int
+install_package(const char* path)
+{
+    return install_package_internal(path, NULL, NULL, NULL);
+}
+
+int
+install_package_and_prefetch(const char* path, const char *next, PackagePrefetch **prefetch)
+{
+    *prefetch = NULL;
+    return install_package_internal(path, NULL, next, prefetch);
+}
+
+int
+install_sideloaded_package(const char* path, const StreamDigest *digest)
+{
+    return install_package_internal(path, digest, NULL, NULL);
+}
+
+// The index of the package being prefetched is kept apart from the one
+// the running install (and its update binary) is using, and only moved
+// into place once that install is over.
+#define PREFETCH_INDEX_CACHE MZ_DEFAULT_INDEX_CACHE ".next"
+#define PREFETCH_CHUNK_SIZE (1024 * 1024)
+
+// ioprio_set(2) values; there is no libc wrapper
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+struct PackagePrefetch {
+    char path[PATH_MAX];
+    pthread_t thread;
+    int started;
+    int readahead_only;
+    volatile int cancelled;
+    int verify_result;
+    int index_result;
+};
+
+// Read the whole package once, so it is in the page cache when it is
+// verified and installed.  Stops early if the prefetch is cancelled.
+static void
+read_package_ahead(PackagePrefetch *prefetch)
+{
+    int fd = open(prefetch->path, O_RDONLY);
+    if (fd < 0)
+        return;
+    char *buffer = malloc(PREFETCH_CHUNK_SIZE);
+    if (buffer != NULL) {
+        while (!prefetch->cancelled && read(fd, buffer, PREFETCH_CHUNK_SIZE) > 0)
+            ;
+        free(buffer);
+    }
+    close(fd);
+}
+
+static void*
+prefetch_thread(void *cookie)
+{
+    PackagePrefetch *prefetch = (PackagePrefetch*) cookie;
+
+    // stay out of the way of the install or the UI: lowest CPU and
+    // best-effort I/O priority
+    setpriority(PRIO_PROCESS, gettid(), 10);
+#ifdef __NR_ioprio_set
+    syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, gettid(),
+            (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7);
+#endif
+
+    read_package_ahead(prefetch);
+    if (prefetch->readahead_only || prefetch->cancelled)
+        return NULL;
+
+    // The result is only worth anything to the install if the verifier
+    // can cache it; elsewhere (vfat, exfat, FUSE) the install verifies
+    // again anyway, so don't read the whole package a second time.
+    if (signature_check_enabled && verify_cache_usable(prefetch->path)) {
+        int numKeys;
+        Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        if (loadedKeys == NULL) {
+            prefetch->verify_result = VERIFY_FAILURE;
+        } else {
+            prefetch->verify_result = verify_file_background(prefetch->path, loadedKeys, numKeys);
+            free(loadedKeys);
+        }
+    }
+
+    ZipArchive zip;
+    prefetch->index_result = mzOpenZipArchiveCached(prefetch->path, PREFETCH_INDEX_CACHE, &zip);
+    if (prefetch->index_result == 0)
+        mzCloseZipArchive(&zip);
+    return NULL;
+}
+
+static PackagePrefetch*
+start_prefetch(const char *path, int readahead_only)
+{
+    PackagePrefetch *prefetch = calloc(1, sizeof(PackagePrefetch));
+    if (prefetch == NULL)
+        return NULL;
+    prefetch->readahead_only = readahead_only;
+
+    char new_path[PATH_MAX];
+    strlcpy(prefetch->path, resolve_package_path(path, new_path), sizeof(prefetch->path));
+    prefetch->verify_result = VERIFY_SUCCESS;
+    prefetch->index_result = -1;
+
+    // mount here, on the UI thread; the prefetch thread only reads
+    if (ensure_path_mounted(prefetch->path) == 0 &&
+        pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch) == 0) {
+        prefetch->started = 1;
+        LOGI("Prefetching %s\n", prefetch->path);
+    }
+    return prefetch;
+}
+
+PackagePrefetch*
+start_package_prefetch(const char *path)
+{
+    return start_prefetch(path, 0);
+}
+
+PackagePrefetch*
+start_package_readahead(const char *path)
+{
+    return start_prefetch(path, 1);
+}
+
+void
+cancel_package_prefetch(PackagePrefetch *prefetch)
+{
+    if (prefetch == NULL)
+        return;
+    prefetch->cancelled = 1;
+    if (prefetch->started)
+        pthread_join(prefetch->thread, NULL);
+    free(prefetch);
+}
+
+void
+finish_package_prefetch(PackagePrefetch *prefetch)
+{
+    if (prefetch == NULL)
+        return;
+
+    if (prefetch->started) {
+        pthread_join(prefetch->thread, NULL);
+        if (prefetch->index_result == 0 &&
+            rename(PREFETCH_INDEX_CACHE, MZ_DEFAULT_INDEX_CACHE) != 0) {
+            LOGI("Can't move %s into place (%s)\n", PREFETCH_INDEX_CACHE, strerror(errno));
+        }
+        if (prefetch->verify_result != VERIFY_SUCCESS) {
+            ui_print("Signature verification failed for %s\n", prefetch->path);
+        } else if (prefetch->index_result != 0) {
+            ui_print("Can't open %s\n", prefetch->path);
+        }
+    }
+    free(prefetch);
+}
@@ -22,4 +22,37 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+/* install_package() for a package received by adb sideload.  "digest"
+ * holds the hashes computed as it arrived (or is NULL); it must come
+ * from the receiving code itself, never from a file next to the package.
+ */
+struct StreamDigest;
+int install_sideloaded_package(const char *path, const struct StreamDigest *digest);
+
+/* Verify, index and read ahead a package on a background thread while
+ * another one installs, so that its own install_package() finds the work
+ * done.  The next install must not start before finish_package_prefetch(),
+ * which waits for the thread and reports a package that failed.  A
+ * package that failed here is still verified again, and asked about, by
+ * install_package().
+ */
+typedef struct PackagePrefetch PackagePrefetch;
+PackagePrefetch* start_package_prefetch(const char *path);
+void finish_package_prefetch(PackagePrefetch *prefetch);
+
+/* install_package(), starting a prefetch of "next" into *prefetch once
+ * "path" is verified, so that the two don't compete for the storage
+ * while the user waits on the verification.  *prefetch stays NULL if
+ * the install stops before that; either way it must be finished.
+ */
+int install_package_and_prefetch(const char *path, const char *next, PackagePrefetch **prefetch);
+
+/* Only read a package into the page cache, on a low priority thread, so
+ * that verifying it later runs from memory.  Stop it (whether or not it
+ * is done) with cancel_package_prefetch(), which also works on a prefetch
+ * from start_package_prefetch() that is no longer wanted.
+ */
+PackagePrefetch* start_package_readahead(const char *path);
+void cancel_package_prefetch(PackagePrefetch *prefetch);
+
 #endif  // RECOVERY_INSTALL_H_
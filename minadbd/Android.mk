@@ -26,6 +26,7 @@ LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
 LOCAL_MODULE := libminadbd
 
 LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 LOCAL_STATIC_LIBRARIES := libcutils libc
 include $(BUILD_STATIC_LIBRARY)
@@ -415,4 +415,9 @@ int handle_host_request(char *service, transport_type ttype, char* serial, int r
 
 #define ADB_SIDELOAD_FILENAME "/tmp/update.zip"
 
+// The hashes of the sideloaded package, computed as it arrived, are
+// kept in a directory only root can use.
+#define ADB_SIDELOAD_DIGEST_DIR "/tmp/.sideload"
+#define ADB_SIDELOAD_DIGEST_FILENAME ADB_SIDELOAD_DIGEST_DIR "/digest"
+
 #endif
@@ -19,12 +19,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "sysdeps.h"
 #include "fdevent.h"
 
 #define  TRACE_TAG  TRACE_SERVICES
 #include "adb.h"
+#include "minhash/Sha.h"
+#include "verifier.h"
 
 typedef struct stinfo stinfo;
 
@@ -43,33 +46,113 @@ void *service_bootstrap_func(void *x)
     return 0;
 }
 
+// The signature covers everything but the zip comment and the two bytes
+// of its length, and a comment is at most 65535 bytes.  So all but the
+// last SIDELOAD_UNSIGNED_MAX bytes are hashed as they arrive; the rest is
+// read back (from the page cache) once the comment length is known.
+#define SIDELOAD_BUFFER_SIZE (64 * 1024)
+#define SIDELOAD_UNSIGNED_MAX (65535 + 2)
+
+static void save_stream_digest(int fd, unsigned count, unsigned hashed,
+                               MhSha1Ctx *sha1, MhSha256Ctx *sha256,
+                               unsigned char *buf)
+{
+    unsigned char footer[2];
+    StreamDigest digest;
+    struct stat st;
+    unsigned signed_len;
+
+    if (count < 22 || pread(fd, footer, 2, count - 2) != 2) return;
+    signed_len = count - 2 - (footer[0] | (footer[1] << 8));
+    if (signed_len < hashed) return;    // not a signed zip; don't bother
+
+    while (hashed < signed_len) {
+        unsigned xfer = signed_len - hashed;
+        ssize_t r;
+        if (xfer > SIDELOAD_BUFFER_SIZE) xfer = SIDELOAD_BUFFER_SIZE;
+        r = pread(fd, buf, xfer, hashed);
+        if (r <= 0) return;
+        mhSha1Update(sha1, buf, r);
+        mhSha256Update(sha256, buf, r);
+        hashed += r;
+    }
+    if (fstat(fd, &st) != 0) return;
+
+    memset(&digest, 0, sizeof(digest));
+    digest.magic = STREAM_DIGEST_MAGIC;
+    digest.file_size = count;
+    digest.signed_len = signed_len;
+    digest.mtime = st.st_mtime;
+    digest.ino = st.st_ino;
+    memcpy(digest.sha1, mhSha1Final(sha1), sizeof(digest.sha1));
+    memcpy(digest.sha256, mhSha256Final(sha256), sizeof(digest.sha256));
+
+    if (mkdir(ADB_SIDELOAD_DIGEST_DIR, 0700) != 0 && errno != EEXIST) return;
+    if (lstat(ADB_SIDELOAD_DIGEST_DIR, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != 0 || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "not saving digest: %s is not private\n",
+                ADB_SIDELOAD_DIGEST_DIR);
+        return;
+    }
+    fd = adb_open_mode(ADB_SIDELOAD_DIGEST_FILENAME,
+                       O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW, 0600);
+    if (fd < 0) return;
+    if (writex(fd, &digest, sizeof(digest))) {
+        adb_close(fd);
+        unlink(ADB_SIDELOAD_DIGEST_FILENAME);
+        return;
+    }
+    adb_close(fd);
+}
+
 static void sideload_service(int s, void *cookie)
 {
-    unsigned char buf[4096];
+    unsigned char *buf;
     unsigned count = (unsigned) cookie;
+    unsigned total = count;
+    unsigned hash_limit = count > SIDELOAD_UNSIGNED_MAX ? count - SIDELOAD_UNSIGNED_MAX : 0;
+    unsigned hashed = 0;
+    MhSha1Ctx sha1;
+    MhSha256Ctx sha256;
     int fd;
 
     fprintf(stderr, "sideload_service invoked\n");
 
-    fd = adb_creat(ADB_SIDELOAD_FILENAME, 0644);
-    if(fd < 0) {
+    unlink(ADB_SIDELOAD_DIGEST_FILENAME);
+    buf = malloc(SIDELOAD_BUFFER_SIZE);
+    // read-write, so the unhashed tail can be read back
+    fd = adb_open_mode(ADB_SIDELOAD_FILENAME,
+                       O_CREAT | O_RDWR | O_TRUNC | O_NOFOLLOW, 0644);
+    if(fd < 0 || buf == NULL) {
         fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_FILENAME);
+        if (fd >= 0) adb_close(fd);
+        free(buf);
         adb_close(s);
         return;
     }
 
+    mhSha1Init(&sha1);
+    mhSha256Init(&sha256);
     while(count > 0) {
-        unsigned xfer = (count > 4096) ? 4096 : count;
+        unsigned xfer = (count > SIDELOAD_BUFFER_SIZE) ? SIDELOAD_BUFFER_SIZE : count;
         if(readx(s, buf, xfer)) break;
         if(writex(fd, buf, xfer)) break;
+        if (hashed < hash_limit) {
+            unsigned n = hash_limit - hashed < xfer ? hash_limit - hashed : xfer;
+            mhSha1Update(&sha1, buf, n);
+            mhSha256Update(&sha256, buf, n);
+            hashed += n;
+        }
         count -= xfer;
     }
 
     if(count == 0) {
+        save_stream_digest(fd, total, hashed, &sha1, &sha256, buf);
         writex(s, "OKAY", 4);
     } else {
         writex(s, "FAIL", 4);
     }
+    free(buf);
     adb_close(fd);
     adb_close(s);
 
@@ -0,0 +1,67 @@
+LOCAL_PATH := $(call my-dir)
+
+minhash_src_files := \
+	Sha.c \
+	ShaX86.c
+
+# The SHA-NI functions carry their own target attribute; the ARMv8
+# intrinsics need the crypto extensions enabled for the whole file, so
+# ShaArmv8.c is a library of its own and nothing else is built for
+# them.  32-bit systems on ARMv8 cores have the extensions too, but GCC
+# only has the AArch32 intrinsics from 4.9 on; with an older compiler
+# ShaArmv8.c builds to an empty stub.
+minhash_armv8_cflags :=
+ifeq ($(TARGET_ARCH),arm64)
+minhash_armv8_cflags := -march=armv8-a+crypto
+endif
+ifeq ($(TARGET_ARCH),arm)
+ifneq ($(filter 4.9% 5.% 6.%,$(TARGET_GCC_VERSION)),)
+minhash_armv8_cflags := -mfpu=crypto-neon-fp-armv8
+endif
+endif
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := ShaArmv8.c
+
+LOCAL_MODULE := libminhash_armv8
+
+LOCAL_CFLAGS += -Wall $(minhash_armv8_cflags)
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minhash_src_files)
+
+LOCAL_MODULE := libminhash
+
+LOCAL_CFLAGS += -Wall
+
+LOCAL_WHOLE_STATIC_LIBRARIES := libminhash_armv8
+
+include $(BUILD_STATIC_LIBRARY)
+
+# for dedupe's host build
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(minhash_src_files) ShaArmv8.c
+
+LOCAL_MODULE := libminhash
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sha_bench.c
+
+LOCAL_MODULE := sha_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_STATIC_LIBRARIES := libminhash libc
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+include $(BUILD_EXECUTABLE)
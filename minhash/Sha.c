@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 padding and buffering, the portable block functions
+ * and the run-time dispatch between implementations.
+ */
+#include <pthread.h>
+#include <string.h>
+
+#include "Sha.h"
+#include "ShaPriv.h"
+
+const uint32_t mhSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t getBE32(const uint8_t* p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+        ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void putBE32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void sha1BlocksC(uint32_t state[5], const uint8_t* data, size_t blocks)
+{
+    uint32_t w[80];
+
+    while (blocks--) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4];
+        int i;
+
+        for (i = 0; i < 16; i++)
+            w[i] = getBE32(data + i * 4);
+        for (; i < 80; i++)
+            w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        for (i = 0; i < 80; i++) {
+            uint32_t f, k, t;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            t = ROL(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = ROL(b, 30);
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        data += 64;
+    }
+}
+
+static void sha256BlocksC(uint32_t state[8], const uint8_t* data,
+    size_t blocks)
+{
+    uint32_t w[64];
+
+    while (blocks--) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4], f = state[5], g = state[6], h = state[7];
+        int i;
+
+        for (i = 0; i < 16; i++)
+            w[i] = getBE32(data + i * 4);
+        for (; i < 64; i++) {
+            uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        for (i = 0; i < 64; i++) {
+            uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + mhSha256K[i] + w[i];
+            uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+static bool alwaysAvailable(void)
+{
+    return true;
+}
+
+static const MhShaOps gPortableOps = {
+    alwaysAvailable, sha1BlocksC, sha256BlocksC
+};
+
+/*
+ * The implementation table, in order of preference from least to most.
+ */
+enum { IMPL_COUNT = 3 };
+static const char* const kImplNames[IMPL_COUNT] = { "c", "sha-ni", "armv8-ce" };
+static const MhShaOps* gImpls[IMPL_COUNT];
+static int gCurrent;
+static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
+
+static void initImpls(void)
+{
+    int i;
+
+    gImpls[0] = &gPortableOps;
+    gImpls[1] = mhShaNiOps();
+    gImpls[2] = mhShaArmv8Ops();
+    gCurrent = 0;
+    for (i = 1; i < IMPL_COUNT; i++) {
+        if (gImpls[i] != NULL && gImpls[i]->available())
+            gCurrent = i;
+    }
+}
+
+static const MhShaOps* currentOps(void)
+{
+    pthread_once(&gInitOnce, initImpls);
+    return gImpls[gCurrent];
+}
+
+int mhShaImplCount(void)
+{
+    return IMPL_COUNT;
+}
+
+const char* mhShaImplName(int impl)
+{
+    if (impl < 0 || impl >= IMPL_COUNT)
+        return NULL;
+    return kImplNames[impl];
+}
+
+bool mhShaImplAvailable(int impl)
+{
+    pthread_once(&gInitOnce, initImpls);
+    return impl >= 0 && impl < IMPL_COUNT && gImpls[impl] != NULL &&
+        gImpls[impl]->available();
+}
+
+int mhShaCurrentImpl(void)
+{
+    pthread_once(&gInitOnce, initImpls);
+    return gCurrent;
+}
+
+bool mhShaUseImpl(int impl)
+{
+    if (!mhShaImplAvailable(impl))
+        return false;
+    gCurrent = impl;
+    return true;
+}
+
+/*
+ * SHA-1 and SHA-256 share the buffering; only the state size differs.
+ */
+typedef void (*BlocksFunc)(uint32_t* state, const uint8_t* data,
+    size_t blocks);
+
+/*
+ * Feed "len" bytes through the 64-byte block buffer.  Whole blocks are
+ * handed to the block function straight from the caller's data.
+ */
+static void updateBlocks(uint32_t* state, uint8_t* buf, uint64_t* count,
+    const uint8_t* data, size_t len, BlocksFunc blocksFn)
+{
+    size_t fill = *count & 63;
+
+    *count += len;
+    if (fill != 0) {
+        size_t n = 64 - fill;
+        if (n > len)
+            n = len;
+        memcpy(buf + fill, data, n);
+        data += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        blocksFn(state, buf, 1);
+    }
+    if (len >= 64) {
+        blocksFn(state, data, len / 64);
+        data += len & ~(size_t) 63;
+        len &= 63;
+    }
+    if (len != 0)
+        memcpy(buf, data, len);
+}
+
+/*
+ * Append the 0x80 terminator, zero padding and the big-endian bit count.
+ */
+static void finishBlocks(uint32_t* state, uint8_t* buf, uint64_t count,
+    BlocksFunc blocksFn)
+{
+    size_t fill = count & 63;
+    uint64_t bits = count << 3;
+    int i;
+
+    buf[fill++] = 0x80;
+    if (fill > 56) {
+        memset(buf + fill, 0, 64 - fill);
+        blocksFn(state, buf, 1);
+        fill = 0;
+    }
+    memset(buf + fill, 0, 56 - fill);
+    for (i = 0; i < 8; i++)
+        buf[56 + i] = bits >> (56 - i * 8);
+    blocksFn(state, buf, 1);
+}
+
+void mhSha1Init(MhSha1Ctx* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void mhSha1Update(MhSha1Ctx* ctx, const void* data, size_t len)
+{
+    updateBlocks(ctx->state, ctx->buf, &ctx->count, (const uint8_t*) data,
+        len, currentOps()->sha1Blocks);
+}
+
+const uint8_t* mhSha1Final(MhSha1Ctx* ctx)
+{
+    int i;
+
+    finishBlocks(ctx->state, ctx->buf, ctx->count, currentOps()->sha1Blocks);
+    for (i = 0; i < 5; i++)
+        putBE32(ctx->digest + i * 4, ctx->state[i]);
+    return ctx->digest;
+}
+
+void mhSha256Init(MhSha256Ctx* ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+void mhSha256Update(MhSha256Ctx* ctx, const void* data, size_t len)
+{
+    updateBlocks(ctx->state, ctx->buf, &ctx->count, (const uint8_t*) data,
+        len, currentOps()->sha256Blocks);
+}
+
+const uint8_t* mhSha256Final(MhSha256Ctx* ctx)
+{
+    int i;
+
+    finishBlocks(ctx->state, ctx->buf, ctx->count,
+        currentOps()->sha256Blocks);
+    for (i = 0; i < 8; i++)
+        putBE32(ctx->digest + i * 4, ctx->state[i]);
+    return ctx->digest;
+}
+
+const uint8_t* mhSha1(const void* data, size_t len, uint8_t* digest)
+{
+    MhSha1Ctx ctx;
+
+    mhSha1Init(&ctx);
+    mhSha1Update(&ctx, data, len);
+    memcpy(digest, mhSha1Final(&ctx), MH_SHA1_DIGEST_SIZE);
+    return digest;
+}
+
+const uint8_t* mhSha256(const void* data, size_t len, uint8_t* digest)
+{
+    MhSha256Ctx ctx;
+
+    mhSha256Init(&ctx);
+    mhSha256Update(&ctx, data, len);
+    memcpy(digest, mhSha256Final(&ctx), MH_SHA256_DIGEST_SIZE);
+    return digest;
+}
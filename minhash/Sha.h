@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 for recovery, the updater, applypatch and dedupe.
+ *
+ * The block functions are picked at run time from the fastest the CPU
+ * supports (SHA-NI on x86, the ARMv8 crypto extensions on arm64), with
+ * portable C as the fallback, so every caller gets the fast path
+ * without knowing about it.
+ */
+#ifndef _MINHASH_SHA
+#define _MINHASH_SHA
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MH_SHA1_DIGEST_SIZE 20
+#define MH_SHA256_DIGEST_SIZE 32
+
+typedef struct MhSha1Ctx {
+    uint32_t    state[5];
+    uint64_t    count;          // bytes hashed so far
+    uint8_t     buf[64];
+    uint8_t     digest[MH_SHA1_DIGEST_SIZE];
+} MhSha1Ctx;
+
+typedef struct MhSha256Ctx {
+    uint32_t    state[8];
+    uint64_t    count;
+    uint8_t     buf[64];
+    uint8_t     digest[MH_SHA256_DIGEST_SIZE];
+} MhSha256Ctx;
+
+/*
+ * Incremental hashing.  The final functions return a pointer to the
+ * digest inside the context.  A context may be copied to get the
+ * digest of the data so far and carry on.
+ */
+void mhSha1Init(MhSha1Ctx* ctx);
+void mhSha1Update(MhSha1Ctx* ctx, const void* data, size_t len);
+const uint8_t* mhSha1Final(MhSha1Ctx* ctx);
+
+void mhSha256Init(MhSha256Ctx* ctx);
+void mhSha256Update(MhSha256Ctx* ctx, const void* data, size_t len);
+const uint8_t* mhSha256Final(MhSha256Ctx* ctx);
+
+/*
+ * Hash "len" bytes in one go into "digest", which is returned.
+ */
+const uint8_t* mhSha1(const void* data, size_t len, uint8_t* digest);
+const uint8_t* mhSha256(const void* data, size_t len, uint8_t* digest);
+
+/*
+ * The implementations built in, numbered from 0 (portable C, always
+ * available).  These are for benchmarks and tests; normal callers never
+ * need them.
+ */
+int mhShaImplCount(void);
+const char* mhShaImplName(int impl);
+bool mhShaImplAvailable(int impl);
+int mhShaCurrentImpl(void);
+
+/*
+ * Make every later hash use "impl".  Returns false, changing nothing,
+ * if it is not available on this CPU.
+ */
+bool mhShaUseImpl(int impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MINHASH_SHA*/
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 block functions using the ARMv8 crypto extensions,
+ * for both AArch64 and AArch32 (a 32-bit system on an ARMv8 core).
+ *
+ * Built only when the compiler targets them (Android.mk adds
+ * -march=armv8-a+crypto on arm64, -mfpu=crypto-neon-fp-armv8 on arm);
+ * the dispatcher still checks the kernel's hwcaps, since not every
+ * ARMv8 core implements them and ARMv7 cores never do.
+ */
+#include "ShaPriv.h"
+
+#if (defined(__aarch64__) || defined(__arm__)) && defined(__ARM_FEATURE_CRYPTO)
+
+#include <arm_neon.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Look for the "sha1" and "sha2" feature flags.  /proc/cpuinfo works on
+ * every kernel and libc, unlike getauxval().
+ */
+static bool armv8Available(void)
+{
+    char line[1024];
+    bool sha1 = false, sha2 = false;
+    FILE* f = fopen("/proc/cpuinfo", "r");
+
+    if (f == NULL)
+        return false;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* tok;
+        if (strncmp(line, "Features", 8) != 0)
+            continue;
+        for (tok = strtok(line + 8, " \t:\n"); tok != NULL;
+                tok = strtok(NULL, " \t:\n")) {
+            if (strcmp(tok, "sha1") == 0)
+                sha1 = true;
+            else if (strcmp(tok, "sha2") == 0)
+                sha2 = true;
+        }
+        break;
+    }
+    fclose(f);
+    return sha1 && sha2;
+}
+
+static void sha1BlocksArmv8(uint32_t state[5], const uint8_t* data,
+    size_t blocks)
+{
+    static const uint32_t k[4] = {
+        0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+    };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    while (blocks--) {
+        uint32x4_t abcdSave = abcd, msg[4];
+        uint32_t eSave = e0;
+        int g;
+
+        for (g = 0; g < 4; g++)
+            msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+
+        /* Twenty groups of four rounds; msg[g & 3] becomes the message
+         * for group g + 4 once this group has used it.
+         */
+        for (g = 0; g < 20; g++) {
+            uint32x4_t wk = vaddq_u32(msg[g & 3], vdupq_n_u32(k[g / 5]));
+            uint32_t e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5)
+                abcd = vsha1cq_u32(abcd, e0, wk);
+            else if (g < 10 || g >= 15)
+                abcd = vsha1pq_u32(abcd, e0, wk);
+            else
+                abcd = vsha1mq_u32(abcd, e0, wk);
+            e0 = e1;
+            if (g < 16) {
+                msg[g & 3] = vsha1su1q_u32(
+                    vsha1su0q_u32(msg[g & 3], msg[(g + 1) & 3], msg[(g + 2) & 3]),
+                    msg[(g + 3) & 3]);
+            }
+        }
+
+        abcd = vaddq_u32(abcd, abcdSave);
+        e0 += eSave;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+static void sha256BlocksArmv8(uint32_t state[8], const uint8_t* data,
+    size_t blocks)
+{
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        uint32x4_t abcdSave = state0, efghSave = state1, msg[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+
+        for (i = 0; i < 16; i++) {
+            uint32x4_t wk, tmp;
+            if (i >= 4) {
+                msg[i & 3] = vsha256su1q_u32(
+                    vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+                    msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            }
+            wk = vaddq_u32(msg[i & 3], vld1q_u32(&mhSha256K[i * 4]));
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, tmp, wk);
+        }
+
+        state0 = vaddq_u32(state0, abcdSave);
+        state1 = vaddq_u32(state1, efghSave);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+static const MhShaOps gArmv8Ops = {
+    armv8Available, sha1BlocksArmv8, sha256BlocksArmv8
+};
+
+const MhShaOps* mhShaArmv8Ops(void)
+{
+    return &gArmv8Ops;
+}
+
+#else
+
+const MhShaOps* mhShaArmv8Ops(void)
+{
+    return NULL;
+}
+
+#endif
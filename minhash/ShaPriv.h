@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Interface between the dispatcher and the per-CPU block functions.
+ */
+#ifndef _MINHASH_SHAPRIV
+#define _MINHASH_SHAPRIV
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process "blocks" consecutive 64-byte blocks of "data" into "state".
+ */
+typedef void (*MhSha1BlocksFunc)(uint32_t state[5], const uint8_t* data,
+    size_t blocks);
+typedef void (*MhSha256BlocksFunc)(uint32_t state[8], const uint8_t* data,
+    size_t blocks);
+
+typedef struct MhShaOps {
+    bool                (*available)(void);
+    MhSha1BlocksFunc    sha1Blocks;
+    MhSha256BlocksFunc  sha256Blocks;
+} MhShaOps;
+
+extern const uint32_t mhSha256K[64];
+
+/*
+ * Each returns NULL if this build has no such implementation (wrong
+ * architecture, or a compiler that can't generate it).
+ */
+const MhShaOps* mhShaNiOps(void);
+const MhShaOps* mhShaArmv8Ops(void);
+
+#endif /*_MINHASH_SHAPRIV*/
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 block functions using the x86 SHA extensions.
+ *
+ * Only these functions are compiled for SHA-NI (through the target
+ * attribute), so the rest of the binary still runs on CPUs without it;
+ * the dispatcher checks CPUID before using them.
+ */
+#include "ShaPriv.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+        __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+static bool shaNiAvailable(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & (1 << 19)) || !(ecx & (1 << 9)))    // SSE4.1, SSSE3
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;                  // SHA
+}
+
+/*
+ * Four rounds; the function selector has to be an immediate.
+ */
+#define SHA1_RNDS4(abcd, e, g) \
+    ((g) < 5 ? _mm_sha1rnds4_epu32(abcd, e, 0) : \
+     (g) < 10 ? _mm_sha1rnds4_epu32(abcd, e, 1) : \
+     (g) < 15 ? _mm_sha1rnds4_epu32(abcd, e, 2) : \
+     _mm_sha1rnds4_epu32(abcd, e, 3))
+
+SHA_NI_TARGET
+static void sha1BlocksShaNi(uint32_t state[5], const uint8_t* data,
+    size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcdSave, eSave, msg[4], e[2];
+    int g;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1b);
+    e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcdSave = abcd;
+        eSave = e[0];
+
+        /* Twenty groups of four rounds.  msg[] holds the last four
+         * message vectors; e[] alternates between the E for this group
+         * and the saved A that becomes the next group's E.
+         */
+        for (g = 0; g < 20; g++) {
+            if (g < 4) {
+                msg[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*) (data + g * 16)), mask);
+            }
+            if (g == 0)
+                e[0] = _mm_add_epi32(e[0], msg[0]);
+            else
+                e[g & 1] = _mm_sha1nexte_epu32(e[g & 1], msg[g & 3]);
+            e[(g + 1) & 1] = abcd;
+            if (g >= 3 && g <= 18)
+                msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], msg[g & 3]);
+            abcd = SHA1_RNDS4(abcd, e[g & 1], g);
+            if (g >= 1 && g <= 16)
+                msg[(g - 1) & 3] = _mm_sha1msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+            if (g >= 2 && g <= 17)
+                msg[(g - 2) & 3] = _mm_xor_si128(msg[(g - 2) & 3], msg[g & 3]);
+        }
+
+        e[0] = _mm_sha1nexte_epu32(e[0], eSave);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+SHA_NI_TARGET
+static void sha256BlocksShaNi(uint32_t state[8], const uint8_t* data,
+    size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+        0x0405060700010203ULL);
+    __m128i state0, state1, tmp, abefSave, cdghSave, msg, w[4];
+    int i;
+
+    /* The instructions want the state as ABEF and CDGH.
+     */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+        abefSave = state0;
+        cdghSave = state1;
+
+        /* Sixteen groups of four rounds; w[i & 3] is the message vector
+         * for group i, built from the previous four.
+         */
+        for (i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*) (data + i * 16)), mask);
+            } else {
+                tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]);
+                tmp = _mm_add_epi32(tmp,
+                    _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i - 1) & 3]);
+            }
+            msg = _mm_add_epi32(w[i & 3],
+                _mm_loadu_si128((const __m128i*) &mhSha256K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1,
+                _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static const MhShaOps gShaNiOps = {
+    shaNiAvailable, sha1BlocksShaNi, sha256BlocksShaNi
+};
+
+const MhShaOps* mhShaNiOps(void)
+{
+    return &gShaNiOps;
+}
+
+#else
+
+const MhShaOps* mhShaNiOps(void)
+{
+    return NULL;
+}
+
+#endif
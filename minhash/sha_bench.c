@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Reports SHA-1 and SHA-256 throughput for every implementation that
+ * runs on this CPU, after checking each against the portable one.
+ *
+ * usage: sha_bench [megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "Sha.h"
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double run(int sha256, const unsigned char* buf, int megabytes,
+    uint8_t* digest)
+{
+    MhSha1Ctx sha1;
+    MhSha256Ctx sha256Ctx;
+    long long left = (long long) megabytes * 1024 * 1024;
+    double start = now();
+
+    mhSha1Init(&sha1);
+    mhSha256Init(&sha256Ctx);
+    while (left > 0) {
+        size_t len = left > BUFFER_SIZE ? BUFFER_SIZE : left;
+        if (sha256)
+            mhSha256Update(&sha256Ctx, buf, len);
+        else
+            mhSha1Update(&sha1, buf, len);
+        left -= len;
+    }
+    if (sha256)
+        memcpy(digest, mhSha256Final(&sha256Ctx), MH_SHA256_DIGEST_SIZE);
+    else
+        memcpy(digest, mhSha1Final(&sha1), MH_SHA1_DIGEST_SIZE);
+    return now() - start;
+}
+
+int main(int argc, char** argv)
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    int best = mhShaCurrentImpl();
+    unsigned char* buf = malloc(BUFFER_SIZE);
+    uint8_t expected[2][MH_SHA256_DIGEST_SIZE];
+    int failed = 0;
+    int impl, i;
+
+    if (buf == NULL || megabytes <= 0) {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        return 1;
+    }
+    for (i = 0; i < BUFFER_SIZE; i++)
+        buf[i] = (unsigned char) (i * 2654435761u >> 24);
+
+    for (impl = 0; impl < mhShaImplCount(); impl++) {
+        int sha256;
+        if (!mhShaUseImpl(impl)) {
+            printf("%-10s not available\n", mhShaImplName(impl));
+            continue;
+        }
+        for (sha256 = 0; sha256 <= 1; sha256++) {
+            size_t size = sha256 ? MH_SHA256_DIGEST_SIZE : MH_SHA1_DIGEST_SIZE;
+            uint8_t digest[MH_SHA256_DIGEST_SIZE], check[MH_SHA256_DIGEST_SIZE];
+            double secs = run(sha256, buf, megabytes, digest);
+
+            // an odd length, so the block buffering is checked too
+            if (sha256)
+                mhSha256(buf, 1000003, check);
+            else
+                mhSha1(buf, 1000003, check);
+            if (impl == 0) {
+                memcpy(expected[sha256], check, size);
+            } else if (memcmp(expected[sha256], check, size) != 0) {
+                printf("%-10s %s: WRONG RESULT\n", mhShaImplName(impl),
+                    sha256 ? "sha256" : "sha1");
+                failed = 1;
+                continue;
+            }
+            printf("%-10s %-6s %8.1f MB/s%s\n", mhShaImplName(impl),
+                sha256 ? "sha256" : "sha1", secs > 0 ? megabytes / secs : 0.0,
+                impl == best ? "  (default)" : "");
+        }
+    }
+    free(buf);
+    return failed;
+}
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -140,29 +141,34 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 }
 
 /*
- * Map part of a file (from fd's current offset) into a shared, read-only
- * memory segment.
+ * Map part of a file into a shared, read-only memory segment.  "start" is
+ * an absolute 64-bit file offset, so segments of files larger than the
+ * address space (or than a 32-bit off_t) can be mapped.
  *
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap)
 {
-    off_t dummy;
-    size_t fileLength, actualLength;
-    off_t actualStart;
+    off64_t fileLength;
+    size_t actualLength;
+    off64_t actualStart;
     int adjust;
     void* memPtr;
 
     assert(pMap != NULL);
 
-    if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
+    fileLength = lseek64(fd, 0, SEEK_END);
+    if (fileLength < 0) {
+        LOGE("could not determine length of file\n");
         return -1;
+    }
 
-    if (start + length > (long)fileLength) {
-        LOGW("bad segment: st=%d len=%ld flen=%d\n",
-            (int) start, length, (int) fileLength);
+    if (start < 0 || start > fileLength ||
+            (off64_t) length > fileLength - start) {
+        LOGW("bad segment: st=%lld len=%zu flen=%lld\n",
+            (long long) start, length, (long long) fileLength);
         return -1;
     }
 
@@ -171,11 +177,11 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     actualStart = start - adjust;
     actualLength = length + adjust;
 
-    memPtr = mmap(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
+    memPtr = sysMmap64(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
                 fd, actualStart);
     if (memPtr == MAP_FAILED) {
-        LOGW("mmap(%d, R, FILE|SHARED, %d, %d) failed: %s\n",
-            (int) actualLength, fd, (int) actualStart, strerror(errno));
+        LOGW("mmap(%d, R, FILE|SHARED, %d, %lld) failed: %s\n",
+            (int) actualLength, fd, (long long) actualStart, strerror(errno));
         return -1;
     }
 
@@ -184,14 +190,33 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     pMap->addr = (char*)memPtr + adjust;
     pMap->length = length;
 
-    LOGVV("mmap seg (st=%d ln=%d): bp=%p bl=%d ad=%p ln=%d\n",
-        (int) start, (int) length,
+    LOGVV("mmap seg (st=%lld ln=%d): bp=%p bl=%d ad=%p ln=%d\n",
+        (long long) start, (int) length,
         pMap->baseAddr, (int) pMap->baseLength,
         pMap->addr, (int) pMap->length);
 
     return 0;
 }
 
+void* sysMmap64(void* addr, size_t length, int prot, int flags, int fd,
+    off64_t offset)
+{
+#ifdef __NR_mmap2
+    /* mmap2 takes the offset in 4096-byte units on every architecture
+     * Android runs on.
+     */
+    if (offset & 4095) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    return (void*) syscall(__NR_mmap2, addr, length, prot, flags, fd,
+        (unsigned long) (offset >> 12));
+#else
+    /* 64-bit: off_t is already wide enough */
+    return mmap(addr, length, prot, flags, fd, (off_t) offset);
+#endif
+}
+
 /*
  * Release a memory mapping.
  */
@@ -46,11 +46,20 @@ int sysLoadFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileInShmem(int fd, MemMapping* pMap);
 
 /*
- * Like sysMapFileInShmem, but on only part of a file.
+ * Like sysMapFileInShmem, but on only part of a file.  "start" is an
+ * absolute file offset and need not be page-aligned.
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap);
 
+/*
+ * mmap() with a 64-bit file offset, which must be a multiple of 4096.
+ * Bionic before API 21 has no mmap64(), so 32-bit builds go through
+ * the mmap2 system call.
+ */
+void* sysMmap64(void* addr, size_t length, int prot, int flags, int fd,
+    off64_t offset);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
@@ -9,9 +9,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
@@ -23,8 +29,6 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -57,6 +61,22 @@ enum {
     ENDOFF = 16,
     ENDCOM = 20,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,       // ZIP64 extended information extra field
+
+    MAX_COMMENT_LEN = 65535,
+
     EXTSIG = 0x08074b50,     // PK78
     EXTHDR = 16,
 
@@ -91,8 +111,9 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
-        pEntry->compLen, pEntry->uncompLen, pEntry->compression);
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n",
+        (long long) pEntry->offset, (long long) pEntry->compLen,
+        (long long) pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
@@ -157,6 +178,42 @@ static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
     }
 }
 
+/*
+ * (This is a qsort callback.)
+ *
+ * Order ZipEntry structs by name, byte by byte, with a name sorting
+ * before any longer name it is a prefix of.
+ */
+static int compareZipEntryNames(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int len = entry1->fileNameLen < entry2->fileNameLen ?
+            entry1->fileNameLen : entry2->fileNameLen;
+    int diff = memcmp(entry1->fileName, entry2->fileName, len);
+
+    if (diff != 0)
+        return diff;
+    return (int) entry1->fileNameLen - (int) entry2->fileNameLen;
+}
+
+/*
+ * Compare an entry name with a prefix: zero if the name begins with the
+ * prefix, otherwise the sign of the name's position relative to all the
+ * names that do.  This is monotonic over the sorted entries.
+ */
+static int comparePrefix(const ZipEntry* pEntry, const char* prefix,
+        unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen < prefixLen ?
+            pEntry->fileNameLen : prefixLen;
+    int diff = memcmp(pEntry->fileName, prefix, len);
+
+    if (diff != 0)
+        return diff;
+    return pEntry->fileNameLen < prefixLen ? -1 : 0;
+}
+
 static int validFilename(const char *fileName, unsigned int fileNameLen)
 {
     // Forbid super long filenames.
@@ -177,18 +234,168 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Read exactly "count" bytes at "offset".
+ *
+ * This uses pread() so the shared file position of pArchive->fd is never
+ * touched, which lets any number of threads read entries of the same
+ * archive at once.
+ */
+static bool readAt(const ZipArchive *pArchive, void *buf, size_t count,
+    off64_t offset)
+{
+    unsigned char *p = (unsigned char *) buf;
+    while (count > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pread64(pArchive->fd, p, count, offset));
+        if (n <= 0) {
+            LOGE("Can't read %zu bytes from zip file at %lld: %s\n", count,
+                (long long) offset, n < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+        p += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
+
+/*
+ * Find the central directory.  We read the end of the file (the EOCD plus
+ * the largest possible comment) and do the traditional backward scan for
+ * the EOCD.  If any of its fields are saturated, the real values live in
+ * the ZIP64 end-of-central-directory record, which is found through the
+ * locator that must immediately precede the EOCD.
+ *
+ * Returns "true" on success.
+ */
+static bool findCentralDirectory(const ZipArchive* pArchive,
+    uint64_t* pNumEntries, off64_t* pCdOffset, uint64_t* pCdSize)
+{
+    bool result = false;
+    const unsigned char* ptr;
+    size_t tailLen;
+    off64_t tailStart;
+    unsigned char* tail;
+
+    tailLen = ZIP64_LOCHDR + ENDHDR + MAX_COMMENT_LEN;
+    if ((off64_t) tailLen > pArchive->length)
+        tailLen = pArchive->length;
+    tailStart = pArchive->length - tailLen;
+
+    tail = (unsigned char*) malloc(tailLen);
+    if (tail == NULL)
+        return false;
+    if (!readAt(pArchive, tail, tailLen, tailStart))
+        goto bail;
+
+    /*
+     * We'll find it immediately unless they have a file comment.
+     */
+    ptr = tail + tailLen - ENDHDR;
+    while (ptr >= tail) {
+        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+            break;
+        ptr--;
+    }
+    if (ptr < tail) {
+        LOGI("Could not find end-of-central-directory in Zip\n");
+        goto bail;
+    }
+
+    /*
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the offset and size of the central
+     * directory.
+     */
+    *pNumEntries = get2LE(ptr + ENDSUB);
+    *pCdSize = get4LE(ptr + ENDSIZ);
+    *pCdOffset = get4LE(ptr + ENDOFF);
+
+    if (*pNumEntries == 0xffff || *pCdSize == 0xffffffff ||
+            *pCdOffset == 0xffffffff) {
+        const unsigned char* locator = ptr - ZIP64_LOCHDR;
+        unsigned char end[ZIP64_ENDHDR];
+        off64_t endOffset;
+
+        if (locator < tail || get4LE(locator) != ZIP64_LOCSIG) {
+            LOGW("Missing ZIP64 end-of-central-directory locator\n");
+            goto bail;
+        }
+        endOffset = (off64_t) get8LE(locator + ZIP64_LOCOFF);
+        if (endOffset < 0 || endOffset > pArchive->length - ZIP64_ENDHDR ||
+                !readAt(pArchive, end, sizeof(end), endOffset) ||
+                get4LE(end) != ZIP64_ENDSIG) {
+            LOGW("Bad ZIP64 end-of-central-directory at %lld\n",
+                (long long) endOffset);
+            goto bail;
+        }
+        *pNumEntries = get8LE(end + ZIP64_ENDSUB);
+        *pCdSize = get8LE(end + ZIP64_ENDSIZ);
+        *pCdOffset = (off64_t) get8LE(end + ZIP64_ENDOFF);
+    }
+
+    result = true;
+
+bail:
+    free(tail);
+    return result;
+}
+
+/*
+ * Apply a ZIP64 extended information extra field, if there is one, to
+ * the entry.  Only the fields that are saturated in the central
+ * directory header are present, in this order.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    ZipEntry* pEntry, uint64_t* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int len = get2LE(extra + 2);
+        if (len > extraLen - 4)
+            return false;
+        if (id == ZIP64_EXTID) {
+            const unsigned char* field = extra + 4;
+            const unsigned char* fieldEnd = field + len;
+            if (pEntry->uncompLen == 0xffffffff) {
+                if (field + 8 > fieldEnd) return false;
+                pEntry->uncompLen = get8LE(field);
+                field += 8;
+            }
+            if (pEntry->compLen == 0xffffffff) {
+                if (field + 8 > fieldEnd) return false;
+                pEntry->compLen = get8LE(field);
+                field += 8;
+            }
+            if (*pLocalHdrOffset == 0xffffffff) {
+                if (field + 8 > fieldEnd) return false;
+                *pLocalHdrOffset = get8LE(field);
+            }
+            return true;
+        }
+        extra += 4 + len;
+        extraLen -= 4 + len;
+    }
+    return true;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * is in fact a Zip, we map the central directory, scan out its contents
+ * and store them in a hash table.  Entry data is never mapped; it is
+ * read on demand with positional reads.
  *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive)
 {
     bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* cdEnd;
+    unsigned char sig[4];
+    unsigned int i, numEntries;
+    uint64_t numEntries64, cdSize;
+    off64_t cdOffset;
     unsigned int val;
 
     /*
@@ -196,7 +403,9 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (!readAt(pArchive, sig, sizeof(sig), 0))
+        goto bail;
+    val = get4LE(sig);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -205,36 +414,33 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         goto bail;
     }
 
-    /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
-     */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    if (!findCentralDirectory(pArchive, &numEntries64, &cdOffset, &cdSize))
+        goto bail;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pMap->addr) {
-        LOGI("Could not find end-of-central-directory in Zip\n");
+    LOGVV("numEntries=%llu cdOffset=%lld cdSize=%llu\n",
+        (unsigned long long) numEntries64, (long long) cdOffset,
+        (unsigned long long) cdSize);
+    if (numEntries64 == 0 || cdOffset < 0 || cdOffset >= pArchive->length ||
+            cdSize > (uint64_t) (pArchive->length - cdOffset) ||
+            cdSize > SIZE_MAX || numEntries64 > cdSize / CENHDR) {
+        LOGW("Invalid entries=%llu offset=%lld size=%llu (len=%lld)\n",
+            (unsigned long long) numEntries64, (long long) cdOffset,
+            (unsigned long long) cdSize, (long long) pArchive->length);
         goto bail;
     }
+    numEntries = (unsigned int) numEntries64;
 
     /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
+     * Map just the central directory; entry names point into it for the
+     * lifetime of the archive.
      */
-    numEntries = get2LE(ptr + ENDSUB);
-    cdOffset = get4LE(ptr + ENDOFF);
-
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    if (sysMapFileSegmentInShmem(pArchive->fd, cdOffset, (size_t) cdSize,
+            &pArchive->map) != 0) {
+        LOGW("Map of central directory failed\n");
         goto bail;
     }
+    pArchive->cdOffset = cdOffset;
+    cdEnd = (const unsigned char*) pArchive->map.addr + pArchive->map.length;
 
     /*
      * Create data structures to hold entries.
@@ -245,14 +451,15 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = (const unsigned char*) pArchive->map.addr;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        uint64_t localHdrOffset;
+        unsigned char localHdr[LOCHDR];
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > cdEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +473,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if ((const unsigned char*)fileName + fileNameLen + extraLen > cdEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,60 +482,9 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+        //LOGI("%d: localHdr=%llu fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
         pEntry->fileNameLen = fileNameLen;
@@ -340,6 +496,12 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
 
+        if (!parseZip64Extra((const unsigned char*)fileName + fileNameLen,
+                extraLen, pEntry, &localHdrOffset)) {
+            LOGW("Bad ZIP64 extra field (at %d)\n", i);
+            goto bail;
+        }
+
         /* These two are necessary for finding the mode of the file.
          */
         pEntry->versionMadeBy = get2LE(ptr + CENVEM);
@@ -352,16 +514,14 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        // localHdrOffset is untrusted, so check it against the file size
+        // before reading the local header through it.
+        if (localHdrOffset > (uint64_t) (pArchive->length - LOCHDR)) {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                (unsigned long long) localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        if (!readAt(pArchive, localHdr, LOCHDR, (off64_t) localHdrOffset)) {
             goto bail;
         }
         if (get4LE(localHdr) != LOCSIG) {
@@ -370,38 +530,28 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if (pEntry->compLen < 0 || pEntry->uncompLen < 0 ||
+                pEntry->offset > pArchive->length ||
+                pEntry->compLen > pArchive->length - pEntry->offset) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort the entries by name.  This is the path index: everything
+     * under a directory is one contiguous run, found by binary search
+     * (see mzFindZipEntriesWithPrefix()).  The hash table holds pointers
+     * into the array, so it is filled in afterwards.
      */
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareZipEntryNames);
     for (i = 0; i < numEntries; i++) {
         /* Add to hash table; no need to lock here.
          */
         addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
     }
-#endif
 
     result = true;
 
@@ -416,10 +566,9 @@ bail:
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * Only the central directory is mapped, so archives larger than the
+ * address space (and ZIP64 archives over 4GB) can be opened without
+ * pinning the whole file in the small recovery RAM.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -429,12 +578,10 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
     pArchive->fd = open(fileName, O_RDONLY, 0);
@@ -444,33 +591,25 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    pArchive->length = lseek64(pArchive->fd, 0, SEEK_END);
+    if (pArchive->length < ENDHDR) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) pArchive->length);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
-    }
-
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -497,6 +636,310 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     pArchive->pEntries = NULL;
 }
 
+/*
+ * Update "crc" with "len" bytes, which may be more than a uInt holds.
+ */
+static unsigned long crc32Large(unsigned long crc, const unsigned char *data,
+        int64_t len)
+{
+    while (len > 0) {
+        uInt count = len > 0x40000000 ? 0x40000000 : (uInt) len;
+        crc = crc32(crc, data, count);
+        data += count;
+        len -= count;
+    }
+    return crc;
+}
+
+/*
+ * The parsed index cache.  It holds a header, the archive's path, then
+ * one record per entry in sorted order.  Entry names are kept as offsets
+ * into the central directory, which is mapped again when the cache is
+ * loaded, so the cache is only about 48 bytes per entry.  The key is
+ * the header; the body is covered by a checksum.  Stat data alone can't
+ * tell a package replaced in place (vfat and FUSE keep the size, times
+ * and even the inode), so the key also holds the crc32 of the central
+ * directory, which has every entry's name and offset.
+ */
+#define INDEX_MAGIC "MZINDEX2"
+
+typedef struct IndexHeader {
+    char        magic[8];
+    uint32_t    recordSize;
+    uint32_t    numEntries;
+    uint32_t    pathLen;
+    uint32_t    checksum;       // crc32 of the path and records
+    int64_t     length;
+    int64_t     mtime;
+    int64_t     ctime;
+    uint64_t    ino;
+    uint64_t    dev;
+    int64_t     cdOffset;
+    uint64_t    cdSize;
+    uint32_t    cdCrc32;        // crc32 of the central directory
+    uint32_t    reserved;
+} IndexHeader;
+
+typedef struct IndexRecord {
+    int64_t     offset;
+    int64_t     compLen;
+    int64_t     uncompLen;
+    uint32_t    nameOffset;
+    uint32_t    nameLen;
+    uint32_t    modTime;
+    uint32_t    crc32;
+    uint32_t    externalFileAttributes;
+    uint16_t    compression;
+    uint16_t    versionMadeBy;
+} IndexRecord;
+
+/*
+ * Fill in the part of the header that identifies the archive.
+ */
+static void setIndexKey(IndexHeader* pHeader, const char* fileName,
+    const struct stat* st, const ZipArchive* pArchive)
+{
+    memset(pHeader, 0, sizeof(*pHeader));
+    memcpy(pHeader->magic, INDEX_MAGIC, sizeof(pHeader->magic));
+    pHeader->recordSize = sizeof(IndexRecord);
+    pHeader->numEntries = pArchive->numEntries;
+    pHeader->pathLen = strlen(fileName);
+    pHeader->length = pArchive->length;
+    pHeader->mtime = st->st_mtime;
+    pHeader->ctime = st->st_ctime;
+    pHeader->ino = st->st_ino;
+    pHeader->dev = st->st_dev;
+    pHeader->cdOffset = pArchive->cdOffset;
+    pHeader->cdSize = pArchive->map.length;
+    if (pArchive->map.addr != NULL) {
+        pHeader->cdCrc32 = crc32Large(crc32(0L, Z_NULL, 0),
+            (const unsigned char*) pArchive->map.addr, pArchive->map.length);
+    }
+}
+
+/*
+ * Fill in "pArchive", whose file is already open, from the index cache.
+ * Everything is checked against the archive before it is used, so a
+ * stale or damaged cache just means the archive is parsed normally.
+ *
+ * Returns "true" on success.  On failure the caller closes the archive.
+ */
+static bool loadIndexCache(const char* fileName, const char* cachePath,
+    const struct stat* st, ZipArchive* pArchive)
+{
+    bool result = false;
+    MemMapping cacheMap;
+    const IndexHeader* pHeader;
+    IndexHeader key;
+    const unsigned char* records;
+    off64_t cacheLength;
+    unsigned int i, numEntries;
+    int fd;
+
+    fd = open(cachePath, O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    cacheLength = lseek64(fd, 0, SEEK_END);
+    if (cacheLength < (off64_t) sizeof(IndexHeader) ||
+            sysMapFileSegmentInShmem(fd, 0, (size_t) cacheLength,
+                &cacheMap) != 0) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    pHeader = (const IndexHeader*) cacheMap.addr;
+    numEntries = pHeader->numEntries;
+    records = (const unsigned char*) cacheMap.addr + sizeof(IndexHeader)
+        + pHeader->pathLen;
+
+    /* The key: same path, and the file has not been replaced or touched
+     * since the cache was written.  The central directory isn't mapped
+     * yet; its crc32 is checked once it is.
+     */
+    pArchive->numEntries = numEntries;
+    pArchive->cdOffset = pHeader->cdOffset;
+    pArchive->map.length = pHeader->cdSize;
+    setIndexKey(&key, fileName, st, pArchive);
+    key.checksum = pHeader->checksum;
+    key.cdCrc32 = pHeader->cdCrc32;
+    pArchive->numEntries = 0;
+    pArchive->map.length = 0;
+    if (memcmp(&key, pHeader, sizeof(key)) != 0 ||
+            numEntries == 0 || numEntries > pHeader->cdSize / CENHDR ||
+            cacheLength != (off64_t) (sizeof(IndexHeader) + pHeader->pathLen
+                + (uint64_t) numEntries * sizeof(IndexRecord)) ||
+            memcmp(pHeader + 1, fileName, pHeader->pathLen) != 0) {
+        LOGV("Index cache %s does not match %s\n", cachePath, fileName);
+        goto bail;
+    }
+    if (crc32Large(crc32(0L, Z_NULL, 0), (const unsigned char*) (pHeader + 1),
+            (size_t) cacheLength - sizeof(IndexHeader)) != pHeader->checksum) {
+        LOGW("Index cache %s is damaged\n", cachePath);
+        goto bail;
+    }
+    if (pHeader->cdOffset < 0 || pHeader->cdOffset >= pArchive->length ||
+            pHeader->cdSize > (uint64_t) (pArchive->length - pHeader->cdOffset) ||
+            sysMapFileSegmentInShmem(pArchive->fd, pHeader->cdOffset,
+                (size_t) pHeader->cdSize, &pArchive->map) != 0) {
+        goto bail;
+    }
+    if (crc32Large(crc32(0L, Z_NULL, 0),
+            (const unsigned char*) pArchive->map.addr,
+            pArchive->map.length) != pHeader->cdCrc32) {
+        LOGV("Index cache %s is for another version of %s\n",
+            cachePath, fileName);
+        goto bail;
+    }
+
+    pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
+    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
+    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+        goto bail;
+
+    for (i = 0; i < numEntries; i++) {
+        ZipEntry* pEntry = &pArchive->pEntries[i];
+        IndexRecord rec;
+
+        memcpy(&rec, records + (size_t) i * sizeof(IndexRecord), sizeof(rec));
+        if (rec.nameLen == 0 || rec.nameLen > pArchive->map.length ||
+                rec.nameOffset > pArchive->map.length - rec.nameLen ||
+                rec.compLen < 0 || rec.uncompLen < 0 ||
+                rec.offset < 0 || rec.offset > pArchive->length ||
+                rec.compLen > pArchive->length - rec.offset) {
+            LOGW("Bad record in index cache %s (at %d)\n", cachePath, i);
+            goto bail;
+        }
+        pEntry->fileNameLen = rec.nameLen;
+        pEntry->fileName = (const char*) pArchive->map.addr + rec.nameOffset;
+        pEntry->offset = rec.offset;
+        pEntry->compLen = rec.compLen;
+        pEntry->uncompLen = rec.uncompLen;
+        pEntry->compression = rec.compression;
+        pEntry->modTime = rec.modTime;
+        pEntry->crc32 = rec.crc32;
+        pEntry->versionMadeBy = rec.versionMadeBy;
+        pEntry->externalFileAttributes = rec.externalFileAttributes;
+
+        /* Records are already in name order.
+         */
+        addEntryToHashTable(pArchive->pHash, pEntry);
+    }
+    pArchive->numEntries = numEntries;
+
+    result = true;
+
+bail:
+    sysReleaseShmem(&cacheMap);
+    return result;
+}
+
+/*
+ * Save the parsed index of "pArchive" to "cachePath".  The cache is
+ * written to a temporary file and renamed into place, so a reader never
+ * sees a partial one.  Failure is not an error; the next opener just
+ * parses the archive again.
+ */
+static void writeIndexCache(const char* fileName, const char* cachePath,
+    const struct stat* st, const ZipArchive* pArchive)
+{
+    IndexHeader header;
+    unsigned char* buf;
+    size_t bufLen, pos;
+    char tmpPath[PATH_MAX];
+    unsigned int i;
+    int fd;
+
+    setIndexKey(&header, fileName, st, pArchive);
+    bufLen = sizeof(header) + header.pathLen
+        + (size_t) pArchive->numEntries * sizeof(IndexRecord);
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath) >=
+            (int) sizeof(tmpPath)) {
+        return;
+    }
+    buf = (unsigned char*) malloc(bufLen);
+    if (buf == NULL)
+        return;
+
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), fileName, header.pathLen);
+    pos = sizeof(header) + header.pathLen;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        IndexRecord rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.offset = pEntry->offset;
+        rec.compLen = pEntry->compLen;
+        rec.uncompLen = pEntry->uncompLen;
+        rec.nameOffset = pEntry->fileName - (const char*) pArchive->map.addr;
+        rec.nameLen = pEntry->fileNameLen;
+        rec.modTime = pEntry->modTime;
+        rec.crc32 = pEntry->crc32;
+        rec.externalFileAttributes = pEntry->externalFileAttributes;
+        rec.compression = pEntry->compression;
+        rec.versionMadeBy = pEntry->versionMadeBy;
+        memcpy(buf + pos, &rec, sizeof(rec));
+        pos += sizeof(rec);
+    }
+    header.checksum = crc32Large(crc32(0L, Z_NULL, 0), buf + sizeof(header),
+            bufLen - sizeof(header));
+    memcpy(buf, &header, sizeof(header));
+
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create index cache %s: %s\n", tmpPath, strerror(errno));
+        free(buf);
+        return;
+    }
+    pos = 0;
+    while (pos < bufLen) {
+        ssize_t written = write(fd, buf + pos, bufLen - pos);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        pos += written;
+    }
+    free(buf);
+    if (close(fd) != 0 || pos != bufLen ||
+            rename(tmpPath, cachePath) != 0) {
+        LOGW("Can't write index cache %s\n", cachePath);
+        unlink(tmpPath);
+    }
+}
+
+/*
+ * Open a Zip archive, reusing the parsed index in "cachePath" when it
+ * matches the file (see Zip.h).
+ */
+int mzOpenZipArchiveCached(const char* fileName, const char* cachePath,
+        ZipArchive* pArchive)
+{
+    struct stat st;
+    int err;
+
+    if (cachePath == NULL)
+        return mzOpenZipArchive(fileName, pArchive);
+
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = open(fileName, O_RDONLY, 0);
+    if (pArchive->fd >= 0 && fstat(pArchive->fd, &st) == 0) {
+        pArchive->length = lseek64(pArchive->fd, 0, SEEK_END);
+        if (pArchive->length >= ENDHDR &&
+                loadIndexCache(fileName, cachePath, &st, pArchive)) {
+            LOGV("Opened '%s' from index cache %s\n", fileName, cachePath);
+            return 0;
+        }
+    }
+    mzCloseZipArchive(pArchive);
+
+    err = mzOpenZipArchive(fileName, pArchive);
+    if (err == 0 && fstat(pArchive->fd, &st) == 0)
+        writeIndexCache(fileName, cachePath, &st, pArchive);
+    return err;
+}
+
 /*
  * Find a matching entry.
  *
@@ -511,6 +954,41 @@ const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
+/*
+ * Find the contiguous run of entries whose names begin with "prefix".
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen, unsigned int* pFirst)
+{
+    unsigned int low, high;
+    unsigned int first;
+
+    /* lower bound: first entry that is not before the run */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    first = low;
+
+    /* upper bound: first entry after the run */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *pFirst = first;
+    return low - first;
+}
+
 /*
  * Return true if the entry is a symbolic link.
  */
@@ -528,27 +1006,26 @@ static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
+    int64_t bytesLeft = pEntry->compLen;
+    off64_t offset = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
-        ssize_t n;
         size_t count;
         bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        count = sizeof(buf);
+        if (bytesLeft < (int64_t) count) {
+            count = bytesLeft;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+        if (!readAt(pArchive, buf, count, offset)) {
             return false;
         }
-        ret = processFunction(buf, n, cookie);
+        ret = processFunction(buf, count, cookie);
         if (!ret) {
             return false;
         }
         bytesLeft -= count;
+        offset += count;
     }
     return true;
 }
@@ -557,14 +1034,17 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
+    int64_t result = -1;
+    int64_t totalOut = 0;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
+    int64_t compRemaining;
+    off64_t compOffset;
 
     compRemaining = pEntry->compLen;
+    compOffset = pEntry->offset;
 
     /*
      * Initialize the zlib stream.
@@ -600,18 +1080,18 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     do {
         /* read as much as we can */
         if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+            long getSize = (compRemaining > (int64_t)sizeof(readBuf)) ?
+                        (long)sizeof(readBuf) : (long)compRemaining;
+            LOGVV("+++ reading %ld bytes (%lld left)\n",
+                getSize, (long long) compRemaining);
+
+            if (!readAt(pArchive, readBuf, getSize, compOffset)) {
+                LOGW("inflate read failed (%ld bytes)\n", getSize);
                 goto z_bail;
             }
 
             compRemaining -= getSize;
+            compOffset += getSize;
 
             zstream.next_in = readBuf;
             zstream.avail_in = getSize;
@@ -635,6 +1115,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
                 LOGW("Process function elected to fail (in inflate)\n");
                 goto z_bail;
             }
+            totalOut += procSize;
 
             zstream.next_out = procBuf;
             zstream.avail_out = sizeof(procBuf);
@@ -643,8 +1124,8 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
     assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    // success!
-    result = zstream.total_out;
+    // success!  (total_out is only 32 bits wide on some platforms)
+    result = totalOut;
 
 z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
@@ -652,8 +1133,8 @@ z_bail:
 bail:
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                (long long) result, (long long) pEntry->uncompLen);
         return false;
     }
     return true;
@@ -668,19 +1149,15 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * All reads are positional, so this may be called from several threads
+ * on the same archive at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,11 +1172,100 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
+/*
+ * Uncompress a whole entry directly into "buffer", which must hold
+ * pEntry->uncompLen bytes.  There is no intermediate output buffer or
+ * per-block callback: zlib writes straight into the destination, and
+ * the CRC is computed over each piece while it is still in cache.
+ *
+ * Returns false on any error, including a CRC mismatch.
+ */
+static bool inflateToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+
+    if (pEntry->compression == STORED) {
+        if (pEntry->compLen != pEntry->uncompLen) {
+            LOGW("Stored entry sizes differ (%lld vs %lld)\n",
+                (long long) pEntry->compLen, (long long) pEntry->uncompLen);
+            return false;
+        }
+        if (!readAt(pArchive, buffer, pEntry->uncompLen, pEntry->offset)) {
+            return false;
+        }
+        crc = crc32Large(crc, buffer, pEntry->uncompLen);
+    } else if (pEntry->compression == DEFLATED) {
+        unsigned char readBuf[32 * 1024];
+        z_stream zstream;
+        int zerr;
+        int64_t compRemaining = pEntry->compLen;
+        int64_t outRemaining = pEntry->uncompLen;
+        off64_t compOffset = pEntry->offset;
+
+        memset(&zstream, 0, sizeof(zstream));
+        zerr = inflateInit2(&zstream, -MAX_WBITS);
+        if (zerr != Z_OK) {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+            return false;
+        }
+        zstream.next_out = buffer;
+
+        do {
+            if (zstream.avail_in == 0 && compRemaining > 0) {
+                size_t getSize = sizeof(readBuf);
+                if (compRemaining < (int64_t) getSize) {
+                    getSize = compRemaining;
+                }
+                if (!readAt(pArchive, readBuf, getSize, compOffset)) {
+                    zerr = Z_DATA_ERROR;
+                    break;
+                }
+                compRemaining -= getSize;
+                compOffset += getSize;
+                zstream.next_in = readBuf;
+                zstream.avail_in = getSize;
+            }
+            if (zstream.avail_out == 0) {
+                /* avail_out is a uInt; entries over 4GB take several rounds */
+                zstream.avail_out = outRemaining > 0x40000000 ?
+                        0x40000000 : (uInt) outRemaining;
+                outRemaining -= zstream.avail_out;
+            }
+
+            unsigned char *out = zstream.next_out;
+            zerr = inflate(&zstream, Z_NO_FLUSH);
+            crc = crc32(crc, out, zstream.next_out - out);
+        } while (zerr == Z_OK);
+
+        inflateEnd(&zstream);
+        if (zerr != Z_STREAM_END) {
+            LOGW("zlib inflate into buffer failed (zerr=%d)\n", zerr);
+            return false;
+        }
+        if (zstream.next_out != buffer + pEntry->uncompLen) {
+            LOGW("Size mismatch on inflated entry (%lld vs %lld)\n",
+                (long long) (zstream.next_out - buffer),
+                (long long) pEntry->uncompLen);
+            return false;
+        }
+    } else {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    if (crc != (unsigned long) pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+        return false;
+    }
+    return true;
+}
+
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
@@ -731,38 +1297,21 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
-typedef struct {
-    char *buf;
-    int bufLen;
-} CopyProcessArgs;
-
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
-{
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
-        return true;
-    }
-    return false;
-}
-
 /*
  * Read an entry into a buffer allocated by the caller.
+ *
+ * The entry is inflated in one pass straight into "buf" and its CRC is
+ * checked on the way.
  */
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char *buf, int bufLen)
 {
-    CopyProcessArgs args;
-    bool ret;
-
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
+    if (bufLen < 0 || pEntry->uncompLen > bufLen) {
+        LOGE("Buffer of %d bytes too small for %lld byte entry\n",
+                bufLen, (long long) pEntry->uncompLen);
+        return false;
+    }
+    if (!inflateToBuffer(pArchive, pEntry, (unsigned char *)buf)) {
         LOGE("Can't extract entry to buffer.\n");
         return false;
     }
@@ -795,12 +1344,104 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01    /* from linux/falloc.h */
+#endif
+
+/*
+ * Copy the data of a STORED entry to "fd" at its current offset without
+ * passing it through the inflate path.  The target is preallocated
+ * first, then the kernel copies the bytes with copy_file_range() or
+ * sendfile(); if neither is usable the rest is copied with positional
+ * reads.
+ */
+static bool copyStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    off64_t inOff = pEntry->offset;
+    int64_t left = pEntry->uncompLen;
+
+#ifdef __NR_fallocate
+    off64_t outOff = lseek64(fd, 0, SEEK_CUR);
+    if (outOff >= 0 && left > 0) {
+        /* Only a hint; not every filesystem supports it.  Bionic before
+         * API 21 has no fallocate(), and 32-bit ABIs take each 64-bit
+         * argument as two words, low one first.
+         */
+#if defined(__LP64__)
+        syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, outOff, left);
+#else
+        syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+                (uint32_t) outOff, (uint32_t) (outOff >> 32),
+                (uint32_t) left, (uint32_t) (left >> 32));
+#endif
+    }
+#endif
+
+#ifdef __NR_copy_file_range
+    while (left > 0) {
+        loff_t off = inOff;
+        size_t count = left > SSIZE_MAX ? SSIZE_MAX : (size_t) left;
+        ssize_t n = syscall(__NR_copy_file_range, pArchive->fd, &off, fd,
+                NULL, count, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        inOff += n;
+        left -= n;
+    }
+#endif
+
+    /* sendfile() takes an off_t, which may be too narrow for the offset. */
+    off_t sendOff = (off_t) inOff;
+    if (sizeof(off_t) == sizeof(off64_t) || inOff + left <= INT32_MAX) {
+        while (left > 0) {
+            size_t count = left > SSIZE_MAX ? SSIZE_MAX : (size_t) left;
+            ssize_t n = sendfile(fd, pArchive->fd, &sendOff, count);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                break;
+            }
+            inOff += n;
+            left -= n;
+        }
+    }
+
+    while (left > 0) {
+        unsigned char buf[32 * 1024];
+        size_t count = sizeof(buf);
+        if (left < (int64_t) count) {
+            count = left;
+        }
+        if (!readAt(pArchive, buf, count, inOff) ||
+                !writeProcessFunction(buf, count, (void *)fd)) {
+            return false;
+        }
+        inOff += count;
+        left -= count;
+    }
+    return true;
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ *
+ * STORED entries are copied by the kernel rather than through the
+ * callback chain.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    if (pEntry->compression == STORED &&
+            pEntry->compLen == pEntry->uncompLen) {
+        if (!copyStoredEntry(pArchive, pEntry, fd)) {
+            LOGE("Can't copy stored entry to file.\n");
+            return false;
+        }
+        return true;
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)fd);
     if (!ret) {
@@ -811,41 +1452,84 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 }
 
 typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
-
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
+    int fd;
+    unsigned char *buf;
+    size_t bufSize;
+    size_t used;
+} BufferedWriteArgs;
 
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
+static bool flushBufferedWrite(BufferedWriteArgs *args)
+{
+    bool ret = true;
+    if (args->used > 0) {
+        ret = writeProcessFunction(args->buf, args->used,
+                                   (void *)args->fd);
+        args->used = 0;
+    }
+    return ret;
+}
 
+/* Gather inflated data into larger writes, so a worker issues one
+ * write() per bufSize bytes rather than one per inflate chunk.
+ */
+static bool bufferedWriteProcessFunction(const unsigned char *data,
+        int dataLen, void *cookie)
+{
+    BufferedWriteArgs *args = (BufferedWriteArgs *)cookie;
+    if (args->used + dataLen > args->bufSize && !flushBufferedWrite(args)) {
+        return false;
+    }
+    if ((size_t)dataLen > args->bufSize) {
+        return writeProcessFunction(data, dataLen, (void *)args->fd);
+    }
+    memcpy(args->buf + args->used, data, dataLen);
+    args->used += dataLen;
     return true;
 }
 
 /*
  * Uncompress "pEntry" in "pArchive" to buffer, which must be large
- * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
+ * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.  Like
+ * mzReadZipEntry(), this is a single pass that also checks the CRC.
  */
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
-
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
+    if (!inflateToBuffer(pArchive, pEntry, buffer)) {
         LOGE("Can't extract entry to memory buffer.\n");
         return false;
     }
     return true;
 }
 
+/*
+ * Map the data of a STORED entry in place.
+ */
+bool mzMapZipEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    MemMapping *pMap)
+{
+    if (pEntry->compression != STORED ||
+            pEntry->compLen != pEntry->uncompLen ||
+            pEntry->uncompLen <= 0 || (uint64_t) pEntry->uncompLen > SIZE_MAX) {
+        return false;
+    }
+    if (sysMapFileSegmentInShmem(pArchive->fd, pEntry->offset,
+            (size_t) pEntry->uncompLen, pMap) != 0) {
+        return false;
+    }
+    madvise(pMap->baseAddr, pMap->baseLength, MADV_SEQUENTIAL);
+
+    unsigned long crc = crc32Large(crc32(0L, Z_NULL, 0),
+            (const unsigned char*) pMap->addr, pMap->length);
+    if (crc != (unsigned long) pEntry->crc32) {
+        LOGW("CRC mismatch in mapped entry: %08lx vs %08lx\n",
+            crc, (unsigned long) pEntry->crc32);
+        sysReleaseShmem(pMap);
+        return false;
+    }
+    return true;
+}
+
 
 /* Helper state to make path translation easier and less malloc-happy.
  */
@@ -907,6 +1591,301 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Create targetFile and inflate pEntry into it.  If writeBuf is non-NULL,
+ * output is gathered into writeBufSize-byte writes.  If lock is non-NULL
+ * it is held around the selabel lookup, which is not thread-safe.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile,
+        const struct utimbuf *timestamp, struct selabel_handle *sehnd,
+        pthread_mutex_t *lock, unsigned char *writeBuf, size_t writeBufSize)
+{
+    char *secontext = NULL;
+
+    if (sehnd) {
+        if (lock != NULL) pthread_mutex_lock(lock);
+        selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        if (lock != NULL) pthread_mutex_unlock(lock);
+        /* The fscreate context is per thread. */
+        setfscreatecon(secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok;
+    if (writeBuf != NULL && pEntry->compression != STORED) {
+        BufferedWriteArgs args;
+        args.fd = fd;
+        args.buf = writeBuf;
+        args.bufSize = writeBufSize;
+        args.used = 0;
+        ok = mzProcessZipEntryContents(pArchive, pEntry,
+                bufferedWriteProcessFunction, (void *)&args) &&
+            flushBufferedWrite(&args);
+    } else {
+        ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    }
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* A regular file waiting to be extracted by the worker pool.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+    struct selabel_handle *sehnd;
+    size_t writeBufSize;
+
+    MzExtractJob *jobs;
+    unsigned int numJobs;
+    unsigned int maxJobs;
+
+    /* protects the fields below, the callback and selabel lookups */
+    pthread_mutex_t lock;
+    unsigned int nextJob;
+    bool ok;
+} MzExtractPool;
+
+static bool addExtractJob(MzExtractPool *pool, const ZipEntry *pEntry,
+        const char *targetFile)
+{
+    if (pool->numJobs == pool->maxJobs) {
+        unsigned int maxJobs = pool->maxJobs ? pool->maxJobs * 2 : 64;
+        MzExtractJob *jobs = (MzExtractJob *)realloc(pool->jobs,
+                maxJobs * sizeof(MzExtractJob));
+        if (jobs == NULL) {
+            return false;
+        }
+        pool->jobs = jobs;
+        pool->maxJobs = maxJobs;
+    }
+    char *copy = strdup(targetFile);
+    if (copy == NULL) {
+        return false;
+    }
+    pool->jobs[pool->numJobs].pEntry = pEntry;
+    pool->jobs[pool->numJobs].targetFile = copy;
+    pool->numJobs++;
+    return true;
+}
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+    unsigned char *writeBuf = (unsigned char *)malloc(pool->writeBufSize);
+    if (writeBuf == NULL) {
+        LOGW("Can't allocate %zu byte write buffer; writing unbuffered\n",
+                pool->writeBufSize);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->ok || pool->nextJob >= pool->numJobs) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractFileEntry(pool->pArchive, job->pEntry,
+                job->targetFile, pool->timestamp, pool->sehnd, &pool->lock,
+                writeBuf, pool->writeBufSize);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->ok = false;
+        } else if (pool->callback != NULL) {
+            pool->callback(job->targetFile, pool->cookie);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(writeBuf);
+    return NULL;
+}
+
+/* Extract every queued job with up to "workers" threads, including the
+ * calling thread.  Returns false if any job failed.
+ */
+static bool runExtractPool(MzExtractPool *pool, int workers)
+{
+    pthread_t threads[MZ_MAX_EXTRACT_WORKERS];
+    int started = 0;
+    int i;
+
+    if ((unsigned int)workers > pool->numJobs) {
+        workers = pool->numJobs > 0 ? pool->numJobs : 1;
+    }
+    for (i = 1; i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, extractWorker, pool)) {
+            LOGW("Can't start extract worker: %s\n", strerror(errno));
+            break;
+        }
+        started++;
+    }
+    extractWorker(pool);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return pool->ok;
+}
+
+static int defaultExtractWorkers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > MZ_MAX_EXTRACT_WORKERS ? MZ_MAX_EXTRACT_WORKERS : cpus;
+}
+
+typedef struct {
+    const ZipArchive *pArchive;
+    unsigned int *order;        // entry indices, largest first
+    void (*progress)(int64_t done, int64_t total, void *cookie);
+    void *cookie;
+    int64_t total;
+
+    /* protects the fields below and the progress callback */
+    pthread_mutex_t lock;
+    unsigned int next;
+    int64_t done;
+    const ZipEntry *pBadEntry;
+} MzVerifyPool;
+
+static const ZipArchive *gSortArchive;
+
+static int compareEntrySizes(const void *a, const void *b)
+{
+    int64_t sizeA = gSortArchive->pEntries[*(const unsigned int *)a].compLen;
+    int64_t sizeB = gSortArchive->pEntries[*(const unsigned int *)b].compLen;
+    return sizeA < sizeB ? 1 : (sizeA > sizeB ? -1 : 0);
+}
+
+static void *verifyWorker(void *arg)
+{
+    MzVerifyPool *pool = (MzVerifyPool *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->pBadEntry != NULL ||
+                pool->next >= pool->pArchive->numEntries) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        const ZipEntry *pEntry =
+                &pool->pArchive->pEntries[pool->order[pool->next++]];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = mzIsZipEntryIntact(pool->pArchive, pEntry);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            if (pool->pBadEntry == NULL) pool->pBadEntry = pEntry;
+        } else {
+            pool->done += pEntry->uncompLen;
+            if (pool->progress != NULL) {
+                pool->progress(pool->done, pool->total, pool->cookie);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Check the CRC of every entry with a pool of worker threads.
+ */
+bool mzVerifyZipArchive(const ZipArchive *pArchive, int workers,
+        void (*progress)(int64_t done, int64_t total, void *cookie),
+        void *cookie, const ZipEntry **pBadEntry, int64_t *pBytes)
+{
+    MzVerifyPool pool;
+    pthread_t threads[MZ_MAX_EXTRACT_WORKERS];
+    int started = 0;
+    unsigned int i;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.progress = progress;
+    pool.cookie = cookie;
+    pool.order = (unsigned int *)malloc(
+            (pArchive->numEntries + 1) * sizeof(unsigned int));
+    if (pool.order == NULL) {
+        return false;
+    }
+    for (i = 0; i < pArchive->numEntries; i++) {
+        pool.order[i] = i;
+        pool.total += pArchive->pEntries[i].uncompLen;
+    }
+
+    /* Hand out the biggest entries first so no worker is left with a
+     * large one at the end while the others sit idle.  Only one verify
+     * sorts at a time, which is all recovery ever runs.
+     */
+    gSortArchive = pArchive;
+    qsort(pool.order, pArchive->numEntries, sizeof(unsigned int),
+            compareEntrySizes);
+    gSortArchive = NULL;
+
+    if (workers <= 0) {
+        workers = defaultExtractWorkers();
+    } else if (workers > MZ_MAX_EXTRACT_WORKERS) {
+        workers = MZ_MAX_EXTRACT_WORKERS;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    for (i = 1; i < (unsigned int)workers; i++) {
+        if (pthread_create(&threads[started], NULL, verifyWorker, &pool)) {
+            LOGW("Can't start verify worker: %s\n", strerror(errno));
+            break;
+        }
+        started++;
+    }
+    verifyWorker(&pool);
+    for (i = 0; i < (unsigned int)started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.order);
+
+    if (pBadEntry != NULL) *pBadEntry = pool.pBadEntry;
+    if (pBytes != NULL) *pBytes = pool.done;
+    return pool.pBadEntry == NULL;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -932,6 +1911,23 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                         int flags, const struct utimbuf *timestamp,
                         void (*callback)(const char *fn, void *), void *cookie,
                         struct selabel_handle *sehnd)
+{
+    return mzExtractRecursiveParallel(pArchive, zipDir, targetDir, flags,
+            timestamp, callback, cookie, sehnd, 1, 0);
+}
+
+/*
+ * Like mzExtractRecursive(), but regular files are handed to a pool of
+ * worker threads.  Directories and symlinks are still created in archive
+ * order by the calling thread, so every file's parent exists before a
+ * worker picks it up.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie,
+                        struct selabel_handle *sehnd,
+                        int workers, size_t workerMemory)
 {
     if (zipDir[0] == '/') {
         LOGE("mzExtractRecursive(): zipDir must be a relative path.\n");
@@ -977,50 +1973,43 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+    /* With more than one worker, regular files are queued and extracted
+     * after the walk; everything else is still done inline.
      */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    if (workers <= 0) {
+        workers = defaultExtractWorkers();
+    } else if (workers > MZ_MAX_EXTRACT_WORKERS) {
+        workers = MZ_MAX_EXTRACT_WORKERS;
+    }
+    MzExtractPool pool;
+    MzExtractPool *pPool = NULL;
+    if (workers > 1 && !(flags & MZ_EXTRACT_DRY_RUN)) {
+        memset(&pool, 0, sizeof(pool));
+        pool.pArchive = pArchive;
+        pool.timestamp = timestamp;
+        pool.callback = callback;
+        pool.cookie = cookie;
+        pool.sehnd = sehnd;
+        pool.writeBufSize = workerMemory > 0 ?
+                workerMemory : MZ_DEFAULT_WORKER_MEMORY;
+        pool.ok = true;
+        pthread_mutex_init(&pool.lock, NULL);
+        pPool = &pool;
+    }
+
+    /* Walk through the entries whose path begins with zpath.  The
+     * entries are sorted, so they form one contiguous run.  If zpath is
+     * empty, this matches everything, which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i, first, count;
+    int ok = true;
+    count = mzFindZipEntriesWithPrefix(pArchive, zpath, zipDirLen, &first);
+    for (i = first; i < first + count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1041,8 +2030,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1110,53 +2097,41 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+            } else if (pPool != NULL) {
+                /* The entry is a regular file; a worker will extract it
+                 * and invoke the callback.
                  */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
+                if (!addExtractJob(pPool, pEntry, targetFile)) {
+                    LOGE("Can't queue \"%s\" for extraction\n", targetFile);
                     ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                continue;
+            } else {
+                /* The entry is a regular file.
+                 */
+                if (!extractFileEntry(pArchive, pEntry, targetFile,
+                        timestamp, sehnd, NULL, NULL, 0)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (pPool != NULL) {
+        if (ok) {
+            ok = runExtractPool(pPool, workers);
+        }
+        for (i = 0; i < pPool->numJobs; i++) {
+            free(pPool->jobs[i].targetFile);
+        }
+        free(pPool->jobs);
+        pthread_mutex_destroy(&pPool->lock);
+    }
+
     free(helper.buf);
     free(zpath);
 
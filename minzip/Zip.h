@@ -8,6 +8,7 @@
 
 #include "inline_magic.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <utime.h>
 
@@ -28,13 +29,16 @@ extern "C" {
  * filename.  We can change the accessors to retrieve the various pieces
  * directly from the source file instead of copying them out, for a very
  * slight speed hit and a modest reduction in memory usage.
+ *
+ * Offsets and lengths are 64-bit so ZIP64 archives larger than 4GB work
+ * on 32-bit builds too.
  */
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    off64_t      offset;
+    int64_t      compLen;
+    int64_t      uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -47,10 +51,12 @@ typedef struct ZipEntry {
  */
 typedef struct ZipArchive {
     int         fd;
+    off64_t     length;         // size of the archive file
     unsigned int numEntries;
     ZipEntry*   pEntries;
     HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    off64_t     cdOffset;       // file offset of the central directory
+    MemMapping  map;            // the central directory only
 } ZipArchive;
 
 /*
@@ -70,6 +76,25 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Where recovery keeps the parsed index of the package being installed,
+ * so the update binary can reuse it instead of parsing the central
+ * directory again.
+ */
+#define MZ_DEFAULT_INDEX_CACHE "/tmp/.package_index"
+
+/*
+ * Like mzOpenZipArchive(), but first tries the parsed index saved in
+ * "cachePath".  The index is only used if it was written for this path
+ * and the file's size, mtime and inode still match; then only the
+ * central directory is mapped and no local headers are read or entries
+ * sorted.  Otherwise the archive is parsed normally and the index is
+ * (re)written for the next opener.  A NULL cachePath behaves exactly
+ * like mzOpenZipArchive().
+ */
+int mzOpenZipArchiveCached(const char* fileName, const char* cachePath,
+        ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -85,6 +110,16 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names begin with the first prefixLen bytes of
+ * "prefix" (e.g. "system/" for a directory).  Entries are kept sorted by
+ * name, so the matches are contiguous: returns how many there are and
+ * sets *pFirst to the index of the first, for use with mzGetZipEntryAt().
+ * Takes O(log n) time.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int prefixLen, unsigned int* pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -121,10 +156,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE off64_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE int64_t mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -139,6 +174,10 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 /*
  * Type definition for the callback function used by
  * mzProcessZipEntryContents().
+ *
+ * The functions below that read entry data never move the archive's file
+ * position, so once an archive is open they may be called concurrently
+ * from any number of threads.
  */
 typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
     int dataLen, void *cookie);
@@ -158,7 +197,8 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie);
 
 /*
- * Read an entry into a buffer allocated by the caller.
+ * Read an entry into a buffer allocated by the caller.  The entry is
+ * inflated directly into "buf" and its CRC is checked.
  */
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char* buf, int bufLen);
@@ -169,6 +209,29 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
+/*
+ * Upper bound on the worker threads of the parallel helpers below, and
+ * the default per-worker output buffer of mzExtractRecursiveParallel().
+ */
+enum { MZ_MAX_EXTRACT_WORKERS = 8 };
+#define MZ_DEFAULT_WORKER_MEMORY (256 * 1024)
+
+/*
+ * Check the CRC of every entry in the archive, spread over "workers"
+ * threads (including the caller; 0 for one per online CPU, up to
+ * MZ_MAX_EXTRACT_WORKERS).  Stops at the first corrupt entry.
+ *
+ * If progress is non-NULL it is called, never concurrently, as entries
+ * complete, with the uncompressed bytes checked so far and in total.
+ * If pBadEntry is non-NULL it receives the corrupt entry (or NULL), and
+ * pBytes, if non-NULL, the uncompressed bytes checked.
+ *
+ * Returns true if every entry is intact.
+ */
+bool mzVerifyZipArchive(const ZipArchive *pArchive, int workers,
+        void (*progress)(int64_t done, int64_t total, void *cookie),
+        void *cookie, const ZipEntry **pBadEntry, int64_t *pBytes);
+
 /*
  * Inflate and write an entry to a file.
  */
@@ -177,11 +240,23 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 /*
  * Inflate and write an entry to a memory buffer, which must be long
- * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
+ * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.  The CRC is
+ * checked in the same pass.
  */
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * Map the data of a STORED entry read-only, straight from the archive,
+ * instead of copying it to a buffer.  The CRC is checked, which reads
+ * the data once, but it stays in the (reclaimable) page cache rather
+ * than in memory of our own.  Returns false if the entry is compressed
+ * or empty, or can't be mapped; release the mapping with
+ * sysReleaseShmem().
+ */
+bool mzMapZipEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    MemMapping *pMap);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -218,6 +293,26 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         void (*callback)(const char *fn, void*), void *cookie,
         struct selabel_handle *sehnd);
 
+/*
+ * Like mzExtractRecursive(), but regular files are inflated and written
+ * by a pool of "workers" threads (including the caller) while directories
+ * and symlinks are still created in archive order.  Pass 0 to use one
+ * worker per online CPU, up to MZ_MAX_EXTRACT_WORKERS.
+ *
+ * workerMemory caps the buffer each worker gathers output in before
+ * writing it out; 0 selects MZ_DEFAULT_WORKER_MEMORY.
+ *
+ * Timestamps and SELinux labels are applied as in mzExtractRecursive().
+ * The callback is never invoked from two threads at once, but callbacks
+ * for regular files may arrive out of archive order.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void*), void *cookie,
+        struct selabel_handle *sehnd,
+        int workers, size_t workerMemory);
+
 #ifdef __cplusplus
 }
 #endif
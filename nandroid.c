@@ -195,6 +195,46 @@ void nandroid_dedupe_gc(const char* blob_dir) {
     ui_print("Done freeing space.\n");
 }
 
+// runs a read-only dedupe report over every manifest of the store and
+// shows its output
+static int nandroid_dedupe_report(const char* action, const char* blob_dir) {
+    char backup_dir[PATH_MAX];
+    strcpy(backup_dir, blob_dir);
+    char *d = dirname(backup_dir);
+    strcpy(backup_dir, d);
+    strcat(backup_dir, "/backup");
+    char tmp[PATH_MAX];
+    sprintf(tmp, "dedupe %s %s $(find %s -name '*.dup') 2>&1", action, blob_dir, backup_dir);
+
+    FILE *fp = __popen(tmp, "r");
+    if (fp == NULL) {
+        ui_print("Unable to execute dedupe.\n");
+        return -1;
+    }
+
+    while (fgets(tmp, PATH_MAX, fp) != NULL) {
+        tmp[PATH_MAX - 1] = '\0';
+        ui_print("%s", tmp);
+    }
+
+    return __pclose(fp);
+}
+
+void nandroid_dedupe_verify(const char* blob_dir) {
+    ui_print("Verifying backup data in %s...\n", blob_dir);
+    set_perf_mode(1);
+    if (nandroid_dedupe_report("verify", blob_dir) != 0)
+        ui_print("Backup data has errors!\n");
+    else
+        ui_print("Backup data verified.\n");
+    set_perf_mode(0);
+}
+
+void nandroid_dedupe_stats(const char* blob_dir) {
+    ui_print("Backup data in %s:\n", blob_dir);
+    nandroid_dedupe_report("stats", blob_dir);
+}
+
 static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
@@ -8,6 +8,8 @@ int nandroid_dump(const char* partition);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
 int nandroid_undump(const char* partition);
 void nandroid_dedupe_gc(const char* blob_dir);
+void nandroid_dedupe_verify(const char* blob_dir);
+void nandroid_dedupe_stats(const char* blob_dir);
 void nandroid_force_backup_format(const char* fmt);
 unsigned nandroid_get_default_backup_format();
 void ensure_directory(const char* dir);
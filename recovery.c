@@ -779,6 +779,27 @@ int check_for_script_file(void) {
 	return ret_val;
 }
 
+// If the next script line installs another zip, return its path (in
+// "path"), so that it can be verified and read ahead while this one's
+// update binary runs.
+static const char* next_install_path(FILE *fp, char* path) {
+  char script_line[SCRIPT_COMMAND_SIZE];
+  const char* next = NULL;
+  long pos = ftell(fp);
+  
+  if (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL && strncmp(script_line, "install ", 8) == 0) {
+    char* value = script_line + 8;
+    value[strcspn(value, "\r\n")] = '\0';
+    if (value[0] != '/')
+      sprintf(path, "%s/%s", get_primary_storage_path(), value);
+    else
+      strcpy(path, value);
+    next = path;
+  }
+  fseek(fp, pos, SEEK_SET);
+  return next;
+}
+
 int run_script_file(void) {
   FILE *fp = fopen(SCRIPT_FILE_TMP, "r");
   struct stat st;
@@ -840,13 +861,15 @@ int run_script_file(void) {
       }
       if (strcmp(command, "install") == 0) {
 	// Install zip -- ToDo : Need to clean this shit up, it's redundant and I know it can be written better
-	char full_path[SCRIPT_COMMAND_SIZE];
+	char full_path[SCRIPT_COMMAND_SIZE], next_path[SCRIPT_COMMAND_SIZE];
 	if (value[0] != '/') {
 	  //relative path given
 	  sprintf(full_path, "%s/%s", get_primary_storage_path(), value);
 	  ensure_path_mounted(full_path);
 	  ui_print("Installing zip file '%s'\n", full_path);
-	  ret_val = install_zip(full_path);
+	  PackagePrefetch* next = NULL;
+	  ret_val = install_zip_and_prefetch(full_path, next_install_path(fp, next_path), &next);
+	  finish_package_prefetch(next);
 	  if (ret_val != INSTALL_SUCCESS) {
 	    LOGE("Error installing '%'\n", full_path);
 	    ret_val = 1;
@@ -855,7 +878,9 @@ int run_script_file(void) {
 	  // Full path given
 	  ensure_path_mounted(get_primary_storage_path());
 	  ui_print("Installing zip file '%s'\n", value);
-	  ret_val = install_zip(value);
+	  PackagePrefetch* next = NULL;
+	  ret_val = install_zip_and_prefetch(value, next_install_path(fp, next_path), &next);
+	  finish_package_prefetch(next);
 	  if (ret_val != INSTALL_SUCCESS) {
 	    LOGE("Error installing '%s'\n", value);
 	    ret_val = 1;
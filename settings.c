@@ -225,6 +225,43 @@ void show_advanced_options_menu() {
   }
 }
 
+// Read by the updater binary; see updater/updater.c.
+#define INSTALL_PROFILE_FLAG "/cache/recovery/profile_install"
+#define INSTALL_PROFILE_FILE "/cache/recovery/last_install_profile"
+
+static void toggle_install_profiling() {
+  ensure_path_mounted("/cache");
+  if (access(INSTALL_PROFILE_FLAG, F_OK) == 0) {
+    unlink(INSTALL_PROFILE_FLAG);
+    ui_print("Install profiling disabled.\n");
+  } else {
+    FILE* f = fopen(INSTALL_PROFILE_FLAG, "w");
+    if (f == NULL) {
+      ui_print("Can't create %s\n", INSTALL_PROFILE_FLAG);
+      return;
+    }
+    fclose(f);
+    ui_print("Install profiling enabled; the next install\n");
+    ui_print("will write %s\n", INSTALL_PROFILE_FILE);
+  }
+}
+
+static void show_install_profile() {
+  char line[PATH_MAX];
+  ensure_path_mounted("/cache");
+  FILE* f = fopen(INSTALL_PROFILE_FILE, "r");
+  if (f == NULL) {
+    ui_print("No install profile yet.\n");
+    return;
+  }
+  //don't log output to recovery.log
+  ui_set_log_stdout(0);
+  while (fgets(line, sizeof(line), f) != NULL)
+    ui_print("%s", line);
+  ui_set_log_stdout(1);
+  fclose(f);
+}
+
 void show_recovery_debugging_menu() {
   static char* headers[] = { "Recovery Debugging",
     "",
@@ -235,6 +272,8 @@ void show_recovery_debugging_menu() {
     "Key Test",
     "Show Log",
     "Toggle UI Debugging",
+    "Toggle Install Profiling",
+    "Show Install Profile",
     NULL
   };
   
@@ -273,6 +312,16 @@ void show_recovery_debugging_menu() {
 	toggle_ui_debugging();
 	break;
       }
+      case 4:
+      {
+	toggle_install_profiling();
+	break;
+      }
+      case 5:
+      {
+	show_install_profile();
+	break;
+      }
     }
   }
 }
@@ -73,6 +73,7 @@ int backupprompt = 0;
 int orswipeprompt = 0;
 int orsreboot = 0;
 int signature_check_enabled = 0;
+int integrity_check_enabled = 0;
 char * currenttheme;
 char * themename;
 int first_boot = 0;
@@ -96,6 +97,7 @@ void create_default_settings(void) {
     "orswipeprompt = 1 ;\n"
     "backupprompt = 1 ;\n"
     "signaturecheckenabled = 1s ;\n"
+    "integritycheckenabled = 0 ;\n"
     "\n");
   fclose(ini);
   // is the first_boot flag already set?
@@ -122,6 +124,7 @@ void load_fallback_settings() {
   fallback_settings = 1;
   currenttheme = "hydro";
   signature_check_enabled = 1;
+  integrity_check_enabled = 0;
   backupprompt = 1;
   orswipeprompt = 1;
   orsreboot = 0;
@@ -195,11 +198,13 @@ void parse_settings() {
   orswipeprompt = iniparser_getint(ini, "settings:orswipeprompt", NULL);
   backupprompt = iniparser_getint(ini, "settings:backupprompt", NULL);
   signature_check_enabled = iniparser_getint(ini, "settings:signaturecheckenabled", NULL);
+  integrity_check_enabled = iniparser_getint(ini, "settings:integritycheckenabled", 0);
   currenttheme = iniparser_getstring(ini, "settings:theme", NULL);
   LOGI("ORSReboot: %d\n", orsreboot);
   LOGI("ORSWipePrompt: %d\n", orswipeprompt);
   LOGI("BackupPrompt: %d\n", backupprompt);
   LOGI("SigCheck: %d\n", signature_check_enabled);
+  LOGI("IntegrityCheck: %d\n", integrity_check_enabled);
   LOGI("Theme: %s\n", currenttheme);
   LOGI("Settings loaded!\n");
   handle_theme(currenttheme);
@@ -221,11 +226,13 @@ void update_cot_settings(void) {
   char * ini_orswipeprompt[1];
   char * ini_backupprompt[1];
   char * ini_signaturecheckenabled[1];
+  char * ini_integritycheckenabled[1];
   
   sprintf(ini_orsreboot, "%d", orsreboot);
   sprintf(ini_orswipeprompt, "%d", orswipeprompt);
   sprintf(ini_backupprompt, "%d", backupprompt);
   sprintf(ini_signaturecheckenabled, "%d", signature_check_enabled);
+  sprintf(ini_integritycheckenabled, "%d", integrity_check_enabled);
   
   iniparser_set(ini, "settings", NULL);
   iniparser_set(ini, "settings:theme", currenttheme);
@@ -233,6 +240,7 @@ void update_cot_settings(void) {
   iniparser_set(ini, "settings:orswipeprompt", ini_orswipeprompt);
   iniparser_set(ini, "settings:backupprompt", ini_backupprompt);
   iniparser_set(ini, "settings:signaturecheckenabled", ini_signaturecheckenabled);
+  iniparser_set(ini, "settings:integritycheckenabled", ini_integritycheckenabled);
   iniparser_dump_ini(ini, ini_file);
   fclose(ini_file);
   iniparser_freedict(ini);
@@ -28,6 +28,7 @@ extern int backupprompt;
 extern int orswipeprompt;
 extern int orsreboot;
 extern int signature_check_enabled;
+extern int integrity_check_enabled;
 extern char* currenttheme;
 extern char* themename;
 extern int first_boot;
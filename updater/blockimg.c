@@ -0,0 +1,1078 @@
+/*
+ * Copyright (C) 2013 Project Open Cannibal
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Block-based updates: block_image_update() rewrites a partition from a
+ * transfer list, the way the AOSP block OTA tools lay it out (version
+ * 3), instead of patching its filesystem file by file.
+ *
+ * Every command that reads the partition names the SHA-1 of the data
+ * it reads and of the data it writes, so a command whose target is
+ * already in place is skipped.  Sources that a command overwrites are
+ * stashed on /cache first.  Together these let an interrupted update
+ * simply be run again from the top.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "edify/expr.h"
+#include "minhash/Sha.h"
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+#include "blockimg.h"
+#include "updater.h"
+
+#define BLOCKSIZE 4096
+
+// Stashes for one partition live in a directory named after the SHA-1
+// of its device path, so they survive a reboot in the middle.
+#define STASH_DIRECTORY_BASE "/cache/recovery"
+#define STASH_DIRECTORY_MODE 0700
+#define STASH_FILE_MODE 0600
+
+// A list of block ranges, written "<n>,<start>,<end>,..." where n is
+// the number of integers that follow; each end is exclusive.
+typedef struct {
+    int count;                  // number of ranges
+    size_t size;                // total number of blocks
+    size_t pos[];               // start and end of each range
+} RangeSet;
+
+static RangeSet* ParseRange(const char* text) {
+    char* copy = strdup(text);
+    char* save;
+    char* end;
+    char* tok = strtok_r(copy, ",", &save);
+    RangeSet* rs = NULL;
+    int num, i;
+
+    if (tok == NULL) goto fail;
+    num = strtol(tok, &end, 10);
+    if (*end != '\0' || num <= 0 || num % 2 != 0) goto fail;
+
+    rs = malloc(sizeof(RangeSet) + num * sizeof(size_t));
+    rs->count = num / 2;
+    rs->size = 0;
+    for (i = 0; i < num; ++i) {
+        tok = strtok_r(NULL, ",", &save);
+        if (tok == NULL) goto fail;
+        rs->pos[i] = strtoul(tok, &end, 10);
+        if (*end != '\0' || tok[0] == '\0') goto fail;
+        if (i % 2 == 1) {
+            if (rs->pos[i] <= rs->pos[i-1]) goto fail;
+            rs->size += rs->pos[i] - rs->pos[i-1];
+        }
+    }
+    if (strtok_r(NULL, ",", &save) != NULL) goto fail;
+
+    free(copy);
+    return rs;
+
+fail:
+    fprintf(stderr, "bad range \"%s\"\n", text);
+    free(rs);
+    free(copy);
+    return NULL;
+}
+
+static bool RangeOverlaps(const RangeSet* a, const RangeSet* b) {
+    int i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int ReadAt(int fd, uint8_t* data, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t r = TEMP_FAILURE_RETRY(pread64(fd, data, size, offset));
+        if (r <= 0) {
+            fprintf(stderr, "read at %lld failed: %s\n", (long long) offset,
+                    r < 0 ? strerror(errno) : "unexpected end of file");
+            return -1;
+        }
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int WriteAt(int fd, const uint8_t* data, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t w = TEMP_FAILURE_RETRY(pwrite64(fd, data, size, offset));
+        if (w <= 0) {
+            fprintf(stderr, "write at %lld failed: %s\n", (long long) offset,
+                    w < 0 ? strerror(errno) : "no progress");
+            return -1;
+        }
+        data += w;
+        size -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// Read the blocks of "rs", one after the other, into "buffer".
+static int ReadBlocks(const RangeSet* rs, uint8_t* buffer, int fd) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t blocks = rs->pos[i*2+1] - rs->pos[i*2];
+        if (ReadAt(fd, buffer, blocks * BLOCKSIZE,
+                   (off64_t) rs->pos[i*2] * BLOCKSIZE) < 0) {
+            return -1;
+        }
+        buffer += blocks * BLOCKSIZE;
+    }
+    return 0;
+}
+
+static int WriteBlocks(const RangeSet* rs, const uint8_t* buffer, int fd) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t blocks = rs->pos[i*2+1] - rs->pos[i*2];
+        if (WriteAt(fd, buffer, blocks * BLOCKSIZE,
+                    (off64_t) rs->pos[i*2] * BLOCKSIZE) < 0) {
+            return -1;
+        }
+        buffer += blocks * BLOCKSIZE;
+    }
+    return 0;
+}
+
+// Spread the blocks packed at the start of "buffer" out to the block
+// positions in "locs".  Blocks only ever move towards the end, so
+// working back from the last range never overwrites one not yet moved.
+static void MoveRange(uint8_t* buffer, const RangeSet* locs) {
+    size_t start = locs->size;
+    int i;
+    for (i = locs->count - 1; i >= 0; --i) {
+        size_t blocks = locs->pos[i*2+1] - locs->pos[i*2];
+        start -= blocks;
+        memmove(buffer + locs->pos[i*2] * BLOCKSIZE, buffer + start * BLOCKSIZE,
+                blocks * BLOCKSIZE);
+    }
+}
+
+// Copy the packed blocks of "data" to the positions in "locs".
+static void ScatterBlocks(uint8_t* buffer, const RangeSet* locs,
+                          const uint8_t* data) {
+    int i;
+    for (i = 0; i < locs->count; ++i) {
+        size_t blocks = locs->pos[i*2+1] - locs->pos[i*2];
+        memcpy(buffer + locs->pos[i*2] * BLOCKSIZE, data, blocks * BLOCKSIZE);
+        data += blocks * BLOCKSIZE;
+    }
+}
+
+static void HexDigest(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < MH_SHA1_DIGEST_SIZE; ++i) {
+        hex[i*2] = digits[digest[i] >> 4];
+        hex[i*2+1] = digits[digest[i] & 0xf];
+    }
+    hex[MH_SHA1_DIGEST_SIZE*2] = '\0';
+}
+
+static bool BlocksMatch(const char* expected, const uint8_t* buffer,
+                        size_t blocks) {
+    uint8_t digest[MH_SHA1_DIGEST_SIZE];
+    char hex[MH_SHA1_DIGEST_SIZE*2+1];
+    mhSha1(buffer, blocks * BLOCKSIZE, digest);
+    HexDigest(digest, hex);
+    return strcasecmp(expected, hex) == 0;
+}
+
+static int Allocate(size_t size, uint8_t** buffer, size_t* alloc) {
+    if (size <= *alloc) return 0;
+    free(*buffer);
+    *buffer = malloc(size);
+    if (*buffer == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        *alloc = 0;
+        return -1;
+    }
+    *alloc = size;
+    return 0;
+}
+
+// Writes to a list of ranges in order; the SinkFn for patches and for
+// new data.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int p_block;                // range being written
+    size_t p_remain;            // bytes left in it; 0 once all are full
+} RangeSink;
+
+static void InitRangeSink(RangeSink* rss, int fd, const RangeSet* tgt) {
+    rss->fd = fd;
+    rss->tgt = tgt;
+    rss->p_block = 0;
+    rss->p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
+}
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size, void* token) {
+    RangeSink* rss = (RangeSink*) token;
+    ssize_t written = 0;
+
+    while (size > 0 && rss->p_remain > 0) {
+        size_t chunk = (size_t) size < rss->p_remain ? (size_t) size : rss->p_remain;
+        off64_t offset = (off64_t) rss->tgt->pos[rss->p_block*2+1] * BLOCKSIZE -
+                         rss->p_remain;
+        if (WriteAt(rss->fd, data, chunk, offset) < 0) break;
+
+        data += chunk;
+        size -= chunk;
+        written += chunk;
+        rss->p_remain -= chunk;
+        if (rss->p_remain == 0 && ++rss->p_block < rss->tgt->count) {
+            const size_t* range = rss->tgt->pos + rss->p_block * 2;
+            rss->p_remain = (range[1] - range[0]) * BLOCKSIZE;
+        }
+    }
+    return written;
+}
+
+// The new data is inflated on its own thread, straight into the target
+// ranges of whichever "new" command is waiting for it.
+typedef struct {
+    const ZipArchive* za;
+    const ZipEntry* entry;
+    RangeSink* rss;             // the waiting command; NULL if none
+    bool finished;              // the thread has stopped
+    bool cancelled;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} NewThreadInfo;
+
+static bool ReceiveNewData(const unsigned char* data, int size, void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->rss == NULL && !nti->cancelled) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        RangeSink* rss = nti->rss;
+        pthread_mutex_unlock(&nti->mu);
+        if (rss == NULL) return false;
+
+        ssize_t written = RangeSinkWrite((unsigned char*) data, size, rss);
+        data += written;
+        size -= written;
+
+        // Hand the command back once its ranges are full, or if they
+        // can't be written.
+        bool full = (rss->p_remain == 0);
+        if (full || size > 0) {
+            pthread_mutex_lock(&nti->mu);
+            nti->rss = NULL;
+            pthread_cond_broadcast(&nti->cv);
+            pthread_mutex_unlock(&nti->mu);
+        }
+        if (!full && size > 0) return false;
+    }
+    return true;
+}
+
+static void* NewDataThread(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+    mzProcessZipEntryContents(nti->za, nti->entry, ReceiveNewData, nti);
+
+    pthread_mutex_lock(&nti->mu);
+    nti->finished = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return NULL;
+}
+
+typedef struct {
+    char* save;                 // strtok_r state for the current line
+    int fd;
+    char* stashbase;
+    uint8_t* buffer;
+    size_t bufsize;
+    uint8_t* stashbuf;
+    size_t stashsize;
+    const uint8_t* patch_data;
+    size_t patch_size;
+    NewThreadInfo nti;
+    size_t written;             // blocks
+    size_t total_blocks;
+    FILE* cmd_pipe;
+} CommandParams;
+
+static char* NextWord(CommandParams* params) {
+    return strtok_r(NULL, " ", &params->save);
+}
+
+// -----------------------------------------------------------------
+//   stashes
+// -----------------------------------------------------------------
+
+static char* StashPath(CommandParams* params, const char* id,
+                       const char* suffix) {
+    char* path = malloc(strlen(params->stashbase) + strlen(id) +
+                        strlen(suffix) + 2);
+    sprintf(path, "%s/%s%s", params->stashbase, id, suffix);
+    return path;
+}
+
+// Load stash "id" into params->stashbuf; returns its size in blocks, or
+// -1 if it's missing or (and then it's deleted) corrupt.
+static ssize_t LoadStash(CommandParams* params, const char* id) {
+    char* path = StashPath(params, id, "");
+    ssize_t blocks = -1;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) goto done;
+    if (fstat(fd, &st) < 0 || st.st_size % BLOCKSIZE != 0) {
+        fprintf(stderr, "stash %s has a bad size\n", path);
+        goto corrupt;
+    }
+    if (Allocate(st.st_size, &params->stashbuf, &params->stashsize) < 0 ||
+        ReadAt(fd, params->stashbuf, st.st_size, 0) < 0) {
+        goto done;
+    }
+    if (!BlocksMatch(id, params->stashbuf, st.st_size / BLOCKSIZE)) {
+        fprintf(stderr, "stash %s is corrupt\n", path);
+        goto corrupt;
+    }
+    blocks = st.st_size / BLOCKSIZE;
+    goto done;
+
+corrupt:
+    unlink(path);
+done:
+    if (fd >= 0) close(fd);
+    free(path);
+    return blocks;
+}
+
+// Save "blocks" blocks of "buffer" as stash "id", durably: it is
+// written under a temporary name, synced, and only then renamed.
+static int WriteStash(CommandParams* params, const char* id,
+                      const uint8_t* buffer, size_t blocks) {
+    char* temp = StashPath(params, id, ".partial");
+    char* path = StashPath(params, id, "");
+    int result = -1;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE);
+
+    if (fd < 0) {
+        fprintf(stderr, "failed to create %s: %s\n", temp, strerror(errno));
+        goto done;
+    }
+    if (WriteAt(fd, buffer, blocks * BLOCKSIZE, 0) < 0 || fsync(fd) < 0) {
+        fprintf(stderr, "failed to write %s: %s\n", temp, strerror(errno));
+        goto done;
+    }
+    if (rename(temp, path) < 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", temp, strerror(errno));
+        goto done;
+    }
+    // the rename itself isn't durable until the directory is synced
+    close(fd);
+    if ((fd = open(params->stashbase, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) < 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", params->stashbase, strerror(errno));
+        goto done;
+    }
+    result = 0;
+
+done:
+    if (fd >= 0) close(fd);
+    free(temp);
+    free(path);
+    return result;
+}
+
+static void FreeStash(CommandParams* params, const char* id) {
+    char* path = StashPath(params, id, "");
+    unlink(path);
+    free(path);
+}
+
+// Drop the stash an overlapping command loaded its source from, once
+// the target it wrote is on disk; until then the stash is the only
+// copy of those blocks that survives an interruption.
+static int FreeOverlapStash(CommandParams* params, const char* id) {
+    if (fsync(params->fd) < 0) {
+        fprintf(stderr, "failed to sync target: %s\n", strerror(errno));
+        return -1;
+    }
+    FreeStash(params, id);
+    return 0;
+}
+
+// Make the stash directory for "blockdev" (keeping anything an earlier,
+// interrupted attempt left there) and room on /cache for "maxblocks".
+static char* CreateStash(const char* blockdev, size_t maxblocks) {
+    uint8_t digest[MH_SHA1_DIGEST_SIZE];
+    char hex[MH_SHA1_DIGEST_SIZE*2+1];
+    char* base;
+    size_t existing = 0;
+    struct stat st;
+
+    mhSha1(blockdev, strlen(blockdev), digest);
+    HexDigest(digest, hex);
+    base = malloc(strlen(STASH_DIRECTORY_BASE) + sizeof(hex) + 1);
+    sprintf(base, "%s/%s", STASH_DIRECTORY_BASE, hex);
+
+    if (mkdir(base, STASH_DIRECTORY_MODE) < 0) {
+        if (errno != EEXIST) {
+            fprintf(stderr, "can't create %s: %s\n", base, strerror(errno));
+            free(base);
+            return NULL;
+        }
+        DIR* dir = opendir(base);
+        struct dirent* de;
+        while (dir != NULL && (de = readdir(dir)) != NULL) {
+            if (fstatat(dirfd(dir), de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+                existing += st.st_size;
+            }
+        }
+        if (dir != NULL) closedir(dir);
+        printf("resuming with %zu bytes already stashed in %s\n", existing, base);
+    }
+
+    if (maxblocks * BLOCKSIZE > existing &&
+        CacheSizeCheck(maxblocks * BLOCKSIZE - existing) != 0) {
+        fprintf(stderr, "not enough space on /cache for %zu stashed blocks\n",
+                maxblocks);
+        free(base);
+        return NULL;
+    }
+    return base;
+}
+
+static void DeleteStash(const char* base) {
+    DIR* dir = opendir(base);
+    struct dirent* de;
+    while (dir != NULL && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            unlinkat(dirfd(dir), de->d_name, 0);
+        }
+    }
+    if (dir != NULL) closedir(dir);
+    rmdir(base);
+}
+
+// -----------------------------------------------------------------
+//   loading sources
+// -----------------------------------------------------------------
+
+// Load a command's source into params->buffer:
+//    <src_block_count> <src_range>
+//    <src_block_count> <src_range> <src_loc> <stash_id:stash_loc> ...
+//    <src_block_count> - <stash_id:stash_loc> ...
+// The blocks of <src_range> go to the positions in <src_loc> (all of
+// the buffer if there is none), and each stash to its own positions.
+static int LoadSource(CommandParams* params, const RangeSet* tgt,
+                      size_t* src_blocks, bool* overlap) {
+    char* word = NextWord(params);
+    char* end;
+    RangeSet* locs;
+
+    *overlap = false;
+    if (word == NULL) return -1;
+    *src_blocks = strtoul(word, &end, 10);
+    if (*end != '\0') return -1;
+    if (Allocate(*src_blocks * BLOCKSIZE, &params->buffer, &params->bufsize) < 0) {
+        return -1;
+    }
+
+    word = NextWord(params);
+    if (word == NULL) return -1;
+    if (strcmp(word, "-") != 0) {
+        RangeSet* src = ParseRange(word);
+        if (src == NULL) return -1;
+        if (src->size > *src_blocks ||
+            ReadBlocks(src, params->buffer, params->fd) < 0) {
+            free(src);
+            return -1;
+        }
+        *overlap = (tgt != NULL && RangeOverlaps(src, tgt));
+        size_t read = src->size;
+        free(src);
+
+        word = NextWord(params);
+        if (word == NULL) return 0;
+
+        locs = ParseRange(word);
+        if (locs == NULL) return -1;
+        if (locs->size != read || locs->pos[locs->count*2-1] > *src_blocks) {
+            fprintf(stderr, "source doesn't fit its locations\n");
+            free(locs);
+            return -1;
+        }
+        MoveRange(params->buffer, locs);
+        free(locs);
+    }
+
+    while ((word = NextWord(params)) != NULL) {
+        char* colon = strchr(word, ':');
+        if (colon == NULL) return -1;
+        *colon = '\0';
+
+        ssize_t blocks = LoadStash(params, word);
+        if (blocks < 0) {
+            fprintf(stderr, "failed to load stash %s\n", word);
+            return -1;
+        }
+        locs = ParseRange(colon + 1);
+        if (locs == NULL) return -1;
+        if ((size_t) blocks != locs->size || locs->pos[locs->count*2-1] > *src_blocks) {
+            fprintf(stderr, "stash %s doesn't fit its locations\n", word);
+            free(locs);
+            return -1;
+        }
+        ScatterBlocks(params->buffer, locs, params->stashbuf);
+        free(locs);
+    }
+    return 0;
+}
+
+// Parse and load a move or patch command's target and source:
+//    <src_hash> <tgt_hash> <tgt_range> <source...>
+// (with one hash for moves).  Returns 1 if the target already holds
+// the result, 0 with the source in params->buffer, or -1 if neither the
+// partition nor a stash holds the source.  *stashed is set when the
+// source overlaps the target and was stashed, so that it can still be
+// found if this command is interrupted half way.
+static int LoadSourceTarget(CommandParams* params, bool onehash,
+                            RangeSet** tgt, size_t* src_blocks,
+                            char** src_hash, char** tgt_hash, bool* stashed) {
+    bool overlap;
+
+    *stashed = false;
+    *src_hash = NextWord(params);
+    *tgt_hash = onehash ? *src_hash : NextWord(params);
+    char* word = NextWord(params);
+    if (*src_hash == NULL || *tgt_hash == NULL || word == NULL) return -1;
+    if ((*tgt = ParseRange(word)) == NULL) return -1;
+
+    if (Allocate((*tgt)->size * BLOCKSIZE, &params->buffer, &params->bufsize) < 0 ||
+        ReadBlocks(*tgt, params->buffer, params->fd) < 0) {
+        return -1;
+    }
+    if (BlocksMatch(*tgt_hash, params->buffer, (*tgt)->size)) {
+        return 1;
+    }
+
+    if (LoadSource(params, *tgt, src_blocks, &overlap) < 0) return -1;
+    if (BlocksMatch(*src_hash, params->buffer, *src_blocks)) {
+        if (overlap) {
+            if (WriteStash(params, *src_hash, params->buffer, *src_blocks) < 0) {
+                return -1;
+            }
+            *stashed = true;
+        }
+        return 0;
+    }
+
+    // An earlier attempt may have stashed the source before it started
+    // overwriting it.
+    if (overlap) {
+        ssize_t blocks = LoadStash(params, *src_hash);
+        if (blocks >= 0 && (size_t) blocks == *src_blocks) {
+            memcpy(params->buffer, params->stashbuf, blocks * BLOCKSIZE);
+            *stashed = true;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "partition has unexpected contents\n");
+    return -1;
+}
+
+// -----------------------------------------------------------------
+//   commands
+// -----------------------------------------------------------------
+
+static int PerformCommandMove(CommandParams* params) {
+    RangeSet* tgt = NULL;
+    size_t src_blocks;
+    char* src_hash;
+    char* tgt_hash;
+    bool stashed;
+    int result = -1;
+
+    int status = LoadSourceTarget(params, true, &tgt, &src_blocks,
+                                  &src_hash, &tgt_hash, &stashed);
+    if (status < 0) goto done;
+    if (status == 0) {
+        if (src_blocks != tgt->size ||
+            WriteBlocks(tgt, params->buffer, params->fd) < 0) {
+            goto done;
+        }
+        if (stashed && FreeOverlapStash(params, src_hash) < 0) goto done;
+    }
+    params->written += tgt->size;
+    result = 0;
+
+done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandDiff(CommandParams* params, bool imgdiff) {
+    RangeSet* tgt = NULL;
+    size_t src_blocks;
+    char* src_hash;
+    char* tgt_hash;
+    bool stashed;
+    char* end;
+    int result = -1;
+
+    char* word = NextWord(params);
+    size_t offset = word ? strtoul(word, &end, 10) : 0;
+    word = NextWord(params);
+    size_t len = word ? strtoul(word, &end, 10) : 0;
+    if (word == NULL || offset + len > params->patch_size || offset + len < offset) {
+        fprintf(stderr, "bad patch location\n");
+        return -1;
+    }
+
+    int status = LoadSourceTarget(params, false, &tgt, &src_blocks,
+                                  &src_hash, &tgt_hash, &stashed);
+    if (status < 0) goto done;
+    if (status == 0) {
+        Value patch;
+        RangeSink rss;
+        MhSha1Ctx ctx;
+        char hex[MH_SHA1_DIGEST_SIZE*2+1];
+
+        patch.type = VAL_BLOB;
+        patch.size = len;
+        patch.data = (char*) params->patch_data + offset;
+        InitRangeSink(&rss, params->fd, tgt);
+        mhSha1Init(&ctx);
+
+        int failed = imgdiff ?
+            ApplyImagePatch(params->buffer, src_blocks * BLOCKSIZE, &patch,
+                            RangeSinkWrite, &rss, &ctx, NULL) :
+            ApplyBSDiffPatch(params->buffer, src_blocks * BLOCKSIZE, &patch, 0,
+                             RangeSinkWrite, &rss, &ctx);
+        if (failed) {
+            fprintf(stderr, "failed to apply %s patch\n", imgdiff ? "imgdiff" : "bsdiff");
+            goto done;
+        }
+        if (rss.p_remain != 0) {
+            fprintf(stderr, "patch output is too short for its target\n");
+            goto done;
+        }
+        HexDigest(mhSha1Final(&ctx), hex);
+        if (strcasecmp(tgt_hash, hex) != 0) {
+            fprintf(stderr, "patch produced %s, expected %s\n", hex, tgt_hash);
+            goto done;
+        }
+        if (stashed && FreeOverlapStash(params, src_hash) < 0) goto done;
+    }
+    params->written += tgt->size;
+    result = 0;
+
+done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandStash(CommandParams* params) {
+    char* id = NextWord(params);
+    char* word = NextWord(params);
+    RangeSet* src;
+    int result = -1;
+
+    if (id == NULL || word == NULL) return -1;
+
+    // already there from an earlier attempt
+    if (LoadStash(params, id) >= 0) return 0;
+
+    if ((src = ParseRange(word)) == NULL) return -1;
+    if (Allocate(src->size * BLOCKSIZE, &params->buffer, &params->bufsize) < 0 ||
+        ReadBlocks(src, params->buffer, params->fd) < 0) {
+        goto done;
+    }
+    if (!BlocksMatch(id, params->buffer, src->size)) {
+        // After an interruption the blocks may already have been
+        // overwritten, and the commands that need them already done;
+        // if not, those commands fail when they verify their source.
+        fprintf(stderr, "failed to load source blocks for stash %s\n", id);
+        result = 0;
+        goto done;
+    }
+    result = WriteStash(params, id, params->buffer, src->size);
+
+done:
+    free(src);
+    return result;
+}
+
+static int PerformCommandFree(CommandParams* params) {
+    char* id = NextWord(params);
+    if (id == NULL) return -1;
+    FreeStash(params, id);
+    return 0;
+}
+
+static int PerformCommandZero(CommandParams* params) {
+    char* word = NextWord(params);
+    RangeSet* tgt;
+    size_t chunk = 256;
+    int i;
+    int result = -1;
+
+    if (word == NULL || (tgt = ParseRange(word)) == NULL) return -1;
+    if (Allocate(chunk * BLOCKSIZE, &params->buffer, &params->bufsize) < 0) {
+        goto done;
+    }
+    memset(params->buffer, 0, chunk * BLOCKSIZE);
+
+    for (i = 0; i < tgt->count; ++i) {
+        size_t block;
+        for (block = tgt->pos[i*2]; block < tgt->pos[i*2+1]; block += chunk) {
+            size_t n = tgt->pos[i*2+1] - block < chunk ? tgt->pos[i*2+1] - block : chunk;
+            if (WriteAt(params->fd, params->buffer, n * BLOCKSIZE,
+                        (off64_t) block * BLOCKSIZE) < 0) {
+                goto done;
+            }
+        }
+    }
+    params->written += tgt->size;
+    result = 0;
+
+done:
+    free(tgt);
+    return result;
+}
+
+static int PerformCommandNew(CommandParams* params) {
+    char* word = NextWord(params);
+    NewThreadInfo* nti = &params->nti;
+    RangeSet* tgt;
+    RangeSink rss;
+
+    if (word == NULL || (tgt = ParseRange(word)) == NULL) return -1;
+    InitRangeSink(&rss, params->fd, tgt);
+
+    pthread_mutex_lock(&nti->mu);
+    nti->rss = &rss;
+    pthread_cond_broadcast(&nti->cv);
+    while (nti->rss != NULL && !nti->finished) {
+        pthread_cond_wait(&nti->cv, &nti->mu);
+    }
+    nti->rss = NULL;
+    pthread_mutex_unlock(&nti->mu);
+
+    size_t blocks = tgt->size;
+    free(tgt);
+    if (rss.p_remain != 0) {
+        fprintf(stderr, "new data ran out or couldn't be written\n");
+        return -1;
+    }
+    params->written += blocks;
+    return 0;
+}
+
+// The blocks are unused by the new image; discarding them is only a
+// favour to the flash, so a device that can't is no reason to fail.
+static int PerformCommandErase(CommandParams* params) {
+    char* word = NextWord(params);
+    RangeSet* tgt;
+    struct stat st;
+    int i;
+
+    if (word == NULL || (tgt = ParseRange(word)) == NULL) return -1;
+    if (fstat(params->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        for (i = 0; i < tgt->count; ++i) {
+            uint64_t range[2];
+            range[0] = (uint64_t) tgt->pos[i*2] * BLOCKSIZE;
+            range[1] = (uint64_t) (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+            if (ioctl(params->fd, BLKDISCARD, &range) < 0) {
+                printf("BLKDISCARD failed: %s; leaving the blocks alone\n",
+                       strerror(errno));
+                break;
+            }
+        }
+    }
+    free(tgt);
+    return 0;
+}
+
+// -----------------------------------------------------------------
+//   edify functions
+// -----------------------------------------------------------------
+
+// block_image_update(block_device, transfer_list, new_data, patch_data)
+//    Apply a version 3 transfer list (a string or blob, usually
+//    package_extract_file("system.transfer.list")) to block_device;
+//    new_data and patch_data name the package entries holding the
+//    new blocks and the patches.  Returns "t" on success and "" on
+//    failure; the stashes of a failed update are kept so that running
+//    it again picks up where it stopped.
+static Value* BlockImageUpdateFn(const char* name, State* state,
+                                 int argc, Expr* argv[]) {
+    Value* blockdev_value = NULL;
+    Value* transfer_list_value = NULL;
+    Value* new_data_value = NULL;
+    Value* patch_data_value = NULL;
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    CommandParams params;
+    MemMapping patch_map;
+    bool patch_mapped = false;
+    uint8_t* patch_copy = NULL;
+    char* transfer_list = NULL;
+    char* line_save;
+    char* line;
+    pthread_t new_thread;
+    bool thread_started = false;
+    bool aborted = false;
+    bool success = false;
+    int version, i;
+
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    if (ReadValueArgs(state, argv, 4, &blockdev_value, &transfer_list_value,
+                      &new_data_value, &patch_data_value) < 0) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.fd = -1;
+    params.cmd_pipe = ui->cmd_pipe;
+    pthread_mutex_init(&params.nti.mu, NULL);
+    pthread_cond_init(&params.nti.cv, NULL);
+
+    if (blockdev_value->type != VAL_STRING || new_data_value->type != VAL_STRING ||
+        patch_data_value->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): block device and entry names must be strings", name);
+        aborted = true;
+        goto done;
+    }
+
+    const ZipEntry* patch_entry = mzFindZipEntry(ui->package_zip, patch_data_value->data);
+    const ZipEntry* new_entry = mzFindZipEntry(ui->package_zip, new_data_value->data);
+    if (patch_entry == NULL || new_entry == NULL) {
+        ErrorAbort(state, "%s(): no %s in package", name,
+                   patch_entry == NULL ? patch_data_value->data : new_data_value->data);
+        aborted = true;
+        goto done;
+    }
+
+    // Patches are found by offset, so they're needed all at once; the
+    // build stores them, which lets them be mapped.
+    if (mzMapZipEntry(ui->package_zip, patch_entry, &patch_map)) {
+        patch_mapped = true;
+        params.patch_data = patch_map.addr;
+        params.patch_size = patch_map.length;
+    } else {
+        params.patch_size = mzGetZipEntryUncompLen(patch_entry);
+        patch_copy = malloc(params.patch_size + 1);
+        if (patch_copy == NULL || !mzReadZipEntry(ui->package_zip, patch_entry,
+                                                  (char*) patch_copy, params.patch_size)) {
+            ErrorAbort(state, "%s(): can't read %s", name, patch_data_value->data);
+            aborted = true;
+            goto done;
+        }
+        params.patch_data = patch_copy;
+    }
+
+    params.fd = open(blockdev_value->data, O_RDWR);
+    if (params.fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", blockdev_value->data, strerror(errno));
+        goto done;
+    }
+
+    transfer_list = malloc(transfer_list_value->size + 1);
+    memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
+    transfer_list[transfer_list_value->size] = '\0';
+
+    // header: version, total blocks, stash entries, stash blocks
+    char* header[4];
+    for (i = 0; i < 4; ++i) {
+        header[i] = strtok_r(i == 0 ? transfer_list : NULL, "\n", &line_save);
+        if (header[i] == NULL) {
+            fprintf(stderr, "transfer list is too short\n");
+            goto done;
+        }
+    }
+    version = atoi(header[0]);
+    if (version != 3) {
+        fprintf(stderr, "unsupported transfer list version %d; only 3 can be "
+                "resumed safely\n", version);
+        goto done;
+    }
+    params.total_blocks = strtoul(header[1], NULL, 10);
+    printf("blockimg version is %d; %zu blocks to write\n", version, params.total_blocks);
+
+    params.stashbase = CreateStash(blockdev_value->data, strtoul(header[3], NULL, 10));
+    if (params.stashbase == NULL) goto done;
+
+    params.nti.za = ui->package_zip;
+    params.nti.entry = new_entry;
+    if (pthread_create(&new_thread, NULL, NewDataThread, &params.nti) != 0) {
+        fprintf(stderr, "can't start the new data thread\n");
+        goto done;
+    }
+    thread_started = true;
+
+    while ((line = strtok_r(NULL, "\n", &line_save)) != NULL) {
+        char* cmd = strtok_r(line, " ", &params.save);
+        int status;
+        size_t before = params.written;
+
+        if (cmd == NULL) continue;
+        if (strcmp(cmd, "move") == 0) {
+            status = PerformCommandMove(&params);
+        } else if (strcmp(cmd, "bsdiff") == 0) {
+            status = PerformCommandDiff(&params, false);
+        } else if (strcmp(cmd, "imgdiff") == 0) {
+            status = PerformCommandDiff(&params, true);
+        } else if (strcmp(cmd, "stash") == 0) {
+            status = PerformCommandStash(&params);
+        } else if (strcmp(cmd, "free") == 0) {
+            status = PerformCommandFree(&params);
+        } else if (strcmp(cmd, "zero") == 0) {
+            status = PerformCommandZero(&params);
+        } else if (strcmp(cmd, "new") == 0) {
+            status = PerformCommandNew(&params);
+        } else if (strcmp(cmd, "erase") == 0) {
+            status = PerformCommandErase(&params);
+        } else {
+            fprintf(stderr, "unknown transfer command \"%s\"\n", cmd);
+            status = -1;
+        }
+        if (status < 0) {
+            fprintf(stderr, "failed to execute command [%s]\n", cmd);
+            goto done;
+        }
+
+        if (params.total_blocks > 0 && params.written != before) {
+            fprintf(params.cmd_pipe, "set_progress %.4f\n",
+                    (double) params.written / params.total_blocks);
+        }
+    }
+
+    if (fsync(params.fd) < 0) {
+        fprintf(stderr, "fsync of %s failed: %s\n", blockdev_value->data, strerror(errno));
+        goto done;
+    }
+    printf("wrote %zu blocks; expected %zu\n", params.written, params.total_blocks);
+    DeleteStash(params.stashbase);
+    success = true;
+
+done:
+    if (thread_started) {
+        pthread_mutex_lock(&params.nti.mu);
+        params.nti.cancelled = true;
+        pthread_cond_broadcast(&params.nti.cv);
+        pthread_mutex_unlock(&params.nti.mu);
+        pthread_join(new_thread, NULL);
+    }
+    if (params.fd >= 0) close(params.fd);
+    if (patch_mapped) sysReleaseShmem(&patch_map);
+    free(patch_copy);
+    free(transfer_list);
+    free(params.stashbase);
+    free(params.buffer);
+    free(params.stashbuf);
+    pthread_mutex_destroy(&params.nti.mu);
+    pthread_cond_destroy(&params.nti.cv);
+    FreeValue(blockdev_value);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_value);
+    FreeValue(patch_data_value);
+    if (aborted) return NULL;
+    return StringValue(strdup(success ? "t" : ""));
+}
+
+// range_sha1(block_device, ranges)
+//    returns the SHA-1 (as hex) of the given blocks, one range after
+//    the other.
+static Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* blockdev;
+    char* ranges;
+    RangeSet* rs = NULL;
+    uint8_t* buffer = NULL;
+    Value* result = NULL;
+    MhSha1Ctx ctx;
+    char hex[MH_SHA1_DIGEST_SIZE*2+1];
+    int fd = -1;
+    int i;
+
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    if (ReadArgs(state, argv, 2, &blockdev, &ranges) < 0) return NULL;
+
+    if ((rs = ParseRange(ranges)) == NULL) {
+        result = ErrorAbort(state, "%s(): bad range \"%s\"", name, ranges);
+        goto done;
+    }
+    if ((fd = open(blockdev, O_RDONLY)) < 0) {
+        result = ErrorAbort(state, "%s(): can't open %s: %s", name, blockdev,
+                            strerror(errno));
+        goto done;
+    }
+
+    buffer = malloc(BLOCKSIZE);
+    mhSha1Init(&ctx);
+    for (i = 0; i < rs->count; ++i) {
+        size_t block;
+        for (block = rs->pos[i*2]; block < rs->pos[i*2+1]; ++block) {
+            if (ReadAt(fd, buffer, BLOCKSIZE, (off64_t) block * BLOCKSIZE) < 0) {
+                result = ErrorAbort(state, "%s(): failed to read %s", name, blockdev);
+                goto done;
+            }
+            mhSha1Update(&ctx, buffer, BLOCKSIZE);
+        }
+    }
+    HexDigest(mhSha1Final(&ctx), hex);
+    result = StringValue(strdup(hex));
+
+done:
+    if (fd >= 0) close(fd);
+    free(buffer);
+    free(rs);
+    free(blockdev);
+    free(ranges);
+    return result;
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+    RegisterFunction("range_sha1", RangeSha1Fn);
+}
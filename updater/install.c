@@ -28,16 +28,17 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <inttypes.h>
+#include <malloc.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
-#include "mincrypt/sha.h"
+#include "flashutils/flashutils.h"
+#include "minhash/Sha.h"
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
@@ -409,20 +410,28 @@ Value* PackageExtractDirFn(const char* name, State* state,
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-    bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL, sehandle);
+    // Inflate files on every core; directories are still created in order.
+    bool success = mzExtractRecursiveParallel(za, zip_path, dest_path,
+                                              MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                              NULL, NULL, sehandle, 0, 0);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
 }
 
 
+static void ReleaseEntryMap(char* data, void* cookie) {
+    sysReleaseShmem((MemMapping*)cookie);
+    free(cookie);
+}
+
 // package_extract_file(package_path, destination_path)
 //   or
 // package_extract_file(package_path)
 //   to return the entire contents of the file as the result of this
-//   function (the char* returned is actually a FileContents*).
+//   function (the char* returned is actually a FileContents*).  A
+//   stored (uncompressed) file is mapped straight from the package
+//   instead of being copied, and the blob is read-only.
 Value* PackageExtractFileFn(const char* name, State* state,
                            int argc, Expr* argv[]) {
     if (argc != 1 && argc != 2) {
@@ -462,13 +471,13 @@ Value* PackageExtractFileFn(const char* name, State* state,
         // as the result.
 
         char* zip_path;
+        if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
+
         Value* v = malloc(sizeof(Value));
         v->type = VAL_BLOB;
         v->size = -1;
         v->data = NULL;
 
-        if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
-
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
@@ -476,6 +485,19 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done1;
         }
 
+        MemMapping* map = malloc(sizeof(MemMapping));
+        if (map != NULL && mzMapZipEntry(za, entry, map)) {
+            Value* mapped = ExternalBlobValue(map->addr, map->length,
+                                              ReleaseEntryMap, map);
+            if (mapped != NULL) {
+                free(zip_path);
+                free(v);
+                return mapped;
+            }
+        } else {
+            free(map);
+        }
+
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -498,6 +520,31 @@ Value* PackageExtractFileFn(const char* name, State* state,
     }
 }
 
+// If "expr" is package_extract_file(package_path), stream that file
+// from the package through process() instead of having it copied into
+// a Value.  Returns 1 if it was processed, 0 if "expr" is something
+// else (so the caller should evaluate it as usual), -1 if the file is
+// missing or process() failed, and -2 if evaluating the path aborted.
+static int ProcessPackageEntryArg(State* state, Expr* expr,
+                                  ProcessZipEntryContentsFunction process,
+                                  void* cookie) {
+    if (expr->fn != PackageExtractFileFn || expr->argc != 1) return 0;
+
+    char* zip_path = Evaluate(state, expr->argv[0]);
+    if (zip_path == NULL) return -2;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    int result = -1;
+    if (entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", expr->name, zip_path);
+    } else if (mzProcessZipEntryContents(za, entry, process, cookie)) {
+        result = 1;
+    }
+    free(zip_path);
+    return result;
+}
+
 // Create all parent directories of name, if necessary.
 static int make_parents(char* name) {
     char* p;
@@ -567,12 +614,10 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
-    bool recursive = (strcmp(name, "set_perm_recursive") == 0);
 
-    int min_args = 4 + (recursive ? 1 : 0);
-    if (argc < min_args) {
+    if (argc < 4) {
         return ErrorAbort(state, "%s() expects %d+ args, got %d",
-                          name, min_args, argc);
+                          name, 4, argc);
     }
 
     char** args = ReadVarArgs(state, argc, argv);
@@ -594,36 +639,28 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    if (recursive) {
-        int dir_mode = strtoul(args[2], &end, 0);
-        if (*end != '\0' || args[2][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid dirmode", name, args[2]);
-            goto done;
-        }
-
-        int file_mode = strtoul(args[3], &end, 0);
-        if (*end != '\0' || args[3][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid filemode",
-                       name, args[3]);
-            goto done;
-        }
-
-        for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
-        }
-    } else {
-        int mode = strtoul(args[2], &end, 0);
-        if (*end != '\0' || args[2][0] == 0) {
-            ErrorAbort(state, "%s: \"%s\" not a valid mode", name, args[2]);
-            goto done;
-        }
+    int mode = strtoul(args[2], &end, 0);
+    if (*end != '\0' || args[2][0] == 0) {
+        ErrorAbort(state, "%s: \"%s\" not a valid mode", name, args[2]);
+        goto done;
+    }
 
-        for (i = 3; i < argc; ++i) {
+    for (i = 3; i < argc; ++i) {
+        // Leave alone what already matches; chown clears the setuid and
+        // setgid bits, though, so a changed owner always needs the chmod.
+        struct stat st;
+        bool known = (stat(args[i], &st) == 0);
+        bool chowned = false;
+        if (!known || st.st_uid != (uid_t) uid || st.st_gid != (gid_t) gid) {
             if (chown(args[i], uid, gid) < 0) {
                 fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
                         name, args[i], uid, gid, strerror(errno));
                 ++bad;
+            } else {
+                chowned = true;
             }
+        }
+        if (!known || chowned || (st.st_mode & 07777) != (mode & 07777)) {
             if (chmod(args[i], mode) < 0) {
                 fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
                         name, args[i], mode, strerror(errno));
@@ -759,158 +796,570 @@ static struct perm_parsed_args ParsePermArgs(int argc, char** args) {
     return parsed;
 }
 
-static int ApplyParsedPerms(
-        const char* filename,
-        const struct stat *statptr,
-        struct perm_parsed_args parsed)
-{
-    int bad = 0;
+// One path from a set_metadata(), set_metadata_recursive() or
+// set_perm_recursive() call, waiting to be applied.  Rules are merged
+// per file in script order, so for each attribute the last rule that
+// sets it wins.  A chown clears setuid/setgid bits and capabilities,
+// so a call that changes owners is never merged with an earlier one
+// that sets modes or capabilities on the same files (see
+// OwnerAfterMode()); with that, the result is the same as running the
+// calls one after another.  The path is kept with its directories
+// resolved, so that a string prefix means "reached by walking from".
+struct metadata_rule {
+    const char* name;           // the calling function, for errors
+    char* path;                 // resolved; owned by the rule
+    size_t path_len;
+    bool recursive;
+    bool fmode_all;             // fmode covers everything but dirs
+    bool strict;                // failures fail the call
+    struct perm_parsed_args parsed;
+    int bad;
+};
 
-    /* ignore symlinks */
-    if (S_ISLNK(statptr->st_mode)) {
-        return 0;
+struct metadata_batch {
+    struct metadata_rule* rules;
+    int count;
+    char** strings;             // the call arguments the rules point into
+    int nstrings;
+};
+
+static void AddMetadataStrings(struct metadata_batch* b, int argc, char** args) {
+    b->strings = realloc(b->strings, (b->nstrings + argc) * sizeof(char*));
+    memcpy(b->strings + b->nstrings, args, argc * sizeof(char*));
+    b->nstrings += argc;
+    free(args);
+}
+
+// "path" with every directory leading to it resolved (the last
+// component is left alone; a symlink there is skipped, not followed).
+// The walks never follow symlinks, so a walk from rule A reaches rule
+// B's path exactly when A's resolved path is a prefix of B's.  Paths
+// that don't resolve are kept as they are.
+static char* ResolveRulePath(const char* path) {
+    char resolved[PATH_MAX];
+    char* parent = strdup(path);
+    char* slash = strrchr(parent, '/');
+    const char* base = slash ? slash + 1 : parent;
+    const char* dir = ".";
+    char* result = NULL;
+
+    if (slash == parent) {
+        dir = "/";
+    } else if (slash != NULL) {
+        *slash = '\0';
+        dir = parent;
+    }
+    if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        if (realpath(path, resolved) != NULL) result = strdup(resolved);
+    } else if (realpath(dir, resolved) != NULL &&
+               strlen(resolved) + 1 + strlen(base) < PATH_MAX) {
+        if (strcmp(resolved, "/") != 0) strcat(resolved, "/");
+        strcat(resolved, base);
+        result = strdup(resolved);
+    }
+    free(parent);
+    return result ? result : strdup(path);
+}
+
+static void AddMetadataRule(struct metadata_batch* b, const char* name,
+                            char* path, bool recursive, bool fmode_all,
+                            bool strict, struct perm_parsed_args parsed) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') path[--len] = '\0';
+
+    path = ResolveRulePath(path);
+    len = strlen(path);
+
+    b->rules = realloc(b->rules, (b->count + 1) * sizeof(struct metadata_rule));
+    struct metadata_rule* r = &b->rules[b->count++];
+    r->name = name;
+    r->path = path;
+    r->path_len = len;
+    r->recursive = recursive;
+    r->fmode_all = fmode_all;
+    r->strict = strict;
+    r->parsed = parsed;
+    r->bad = 0;
+}
+
+static void FreeMetadataRules(struct metadata_rule* rules, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        free(rules[i].path);
+    }
+}
+
+static void FreeMetadataBatch(struct metadata_batch* b) {
+    int i;
+    FreeMetadataRules(b->rules, b->count);
+    for (i = 0; i < b->nstrings; ++i) {
+        free(b->strings[i]);
     }
+    free(b->strings);
+    free(b->rules);
+}
 
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                   filename, parsed.uid, strerror(errno));
-            bad++;
-        }
+// Parse the arguments of one call into rules, checking them the way the
+// call always has.  Returns false, with the error set, if the call
+// would have failed before changing anything.
+static bool CollectMetadataCall(State* state, const char* name,
+                                int argc, Expr* argv[],
+                                struct metadata_batch* b) {
+    bool perm = (strcmp(name, "set_perm_recursive") == 0);
+    struct perm_parsed_args parsed;
+    struct stat sb;
+    char* end;
+    int i;
+
+    if (perm && argc < 5) {
+        ErrorAbort(state, "%s() expects %d+ args, got %d", name, 5, argc);
+        return false;
+    }
+    if (!perm && (argc % 2) != 1) {
+        ErrorAbort(state, "%s() expects an odd number of arguments, got %d",
+                   name, argc);
+        return false;
     }
 
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                   filename, parsed.gid, strerror(errno));
-            bad++;
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return false;
+    AddMetadataStrings(b, argc, args);
+    args = b->strings + b->nstrings - argc;
+
+    if (!perm) {
+        if (lstat(args[0], &sb) == -1) {
+            ErrorAbort(state, "%s: Error on lstat of \"%s\": %s",
+                       name, args[0], strerror(errno));
+            return false;
+        }
+        if (strlen(args[0]) >= PATH_MAX) {
+            ErrorAbort(state, "%s: path too long: \"%s\"", name, args[0]);
+            return false;
+        }
+        parsed = ParsePermArgs(argc, args);
+        AddMetadataRule(b, name, args[0],
+                        strcmp(name, "set_metadata_recursive") == 0,
+                        false, true, parsed);
+        return true;
+    }
+
+    // set_perm_recursive(uid, gid, dirmode, filemode, path, ...) never
+    // reported failures to change a file, or missing paths.
+    static const char* what[] = { "uid", "gid", "dirmode", "filemode" };
+    unsigned long values[4];
+    for (i = 0; i < 4; ++i) {
+        values[i] = strtoul(args[i], &end, 0);
+        if (*end != '\0' || args[i][0] == 0) {
+            ErrorAbort(state, "%s: \"%s\" not a valid %s", name, args[i], what[i]);
+            return false;
         }
     }
+    memset(&parsed, 0, sizeof(parsed));
+    parsed.has_uid = parsed.has_gid = parsed.has_dmode = parsed.has_fmode = true;
+    parsed.uid = values[0];
+    parsed.gid = values[1];
+    parsed.dmode = values[2];
+    parsed.fmode = values[3];
+    for (i = 4; i < argc; ++i) {
+        if (strlen(args[i]) < PATH_MAX) {
+            AddMetadataRule(b, name, args[i], true, true, false, parsed);
+        }
+    }
+    return true;
+}
+
+static bool RuleApplies(const struct metadata_rule* r,
+                        const char* path, size_t len) {
+    if (len < r->path_len || memcmp(path, r->path, r->path_len) != 0) {
+        return false;
+    }
+    return len == r->path_len ||
+        (r->recursive && (path[r->path_len] == '/' || r->path_len == 1));
+}
 
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.mode, strerror(errno));
-            bad++;
+// The last recursive rule covering "path", or NULL.
+static struct metadata_rule* CoveringRule(struct metadata_batch* b,
+                                          const char* path, size_t len) {
+    int i;
+    for (i = b->count - 1; i >= 0; --i) {
+        if (b->rules[i].recursive && RuleApplies(&b->rules[i], path, len)) {
+            return &b->rules[i];
         }
     }
+    return NULL;
+}
+
+static void MetadataFailed(struct metadata_rule* r) {
+    if (r != NULL) r->bad++;
+}
 
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.dmode, strerror(errno));
-            bad++;
+// Bring one file in line with every rule that covers it, skipping each
+// change the file already has.
+static void ApplyMetadata(struct metadata_batch* b, int dirfd, const char* name,
+                          const char* path, size_t len, const struct stat* st) {
+    struct metadata_rule* uid_from = NULL;
+    struct metadata_rule* gid_from = NULL;
+    struct metadata_rule* mode_from = NULL;
+    struct metadata_rule* label_from = NULL;
+    struct metadata_rule* caps_from = NULL;
+    mode_t mode = 0;
+    bool is_dir = S_ISDIR(st->st_mode);
+    bool is_reg = S_ISREG(st->st_mode);
+    bool chowned = false;
+    int i;
+
+    // There are no *at() calls for xattrs and labels; reach the file
+    // through the directory's fd under /proc instead of by its full name.
+    char fdpath[PATH_MAX];
+    const char* at = path;
+    if (dirfd != AT_FDCWD &&
+        snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d/%s", dirfd, name) < (int) sizeof(fdpath)) {
+        at = fdpath;
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        struct metadata_rule* r = &b->rules[i];
+        const struct perm_parsed_args* p = &r->parsed;
+        if (!RuleApplies(r, path, len)) continue;
+
+        if (p->has_uid) uid_from = r;
+        if (p->has_gid) gid_from = r;
+        if (p->has_mode) {
+            mode = p->mode;
+            mode_from = r;
+        }
+        if (p->has_dmode && is_dir) {
+            mode = p->dmode;
+            mode_from = r;
+        }
+        if (p->has_fmode && (is_reg || (r->fmode_all && !is_dir))) {
+            mode = p->fmode;
+            mode_from = r;
+        }
+        if (p->has_selabel) label_from = r;
+        if (p->has_capabilities && is_reg) caps_from = r;
+    }
+
+    // Unless the owner changes, only chown a file it would make a
+    // difference to: one with setuid/setgid bits or capabilities, which
+    // a chown clears.
+    uid_t uid = uid_from ? uid_from->parsed.uid : (uid_t) -1;
+    gid_t gid = gid_from ? gid_from->parsed.gid : (gid_t) -1;
+    if ((uid_from && st->st_uid != uid) || (gid_from && st->st_gid != gid) ||
+        ((uid_from || gid_from) && !is_dir &&
+         ((st->st_mode & (S_ISUID | S_ISGID)) ||
+          (is_reg && getxattr(at, XATTR_NAME_CAPS, NULL, 0) > 0)))) {
+        if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("ApplyMetadata: chown of %s to %d:%d failed: %s\n",
+                   path, (int) uid, (int) gid, strerror(errno));
+            MetadataFailed(uid_from);
+            if (gid_from != uid_from) MetadataFailed(gid_from);
+        } else {
+            chowned = true;
         }
     }
 
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
-            printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
-            bad++;
+    // chown drops the setuid/setgid bits and any capabilities, so those
+    // have to be put back even if they matched before.  Every rule that
+    // sets them comes after the rules that set owners (see
+    // OwnerAfterMode()), so putting them back is what running the calls
+    // in order would do.
+    if (mode_from && (chowned || (st->st_mode & 07777) != (mode & 07777))) {
+        if (fchmodat(dirfd, name, mode, 0) < 0) {
+            printf("ApplyMetadata: chmod of %s to %o failed: %s\n",
+                   path, mode, strerror(errno));
+            MetadataFailed(mode_from);
         }
     }
 
-    if (parsed.has_selabel) {
-        // TODO: Don't silently ignore ENOTSUP
-        if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
-            printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                   filename, parsed.selabel, strerror(errno));
-            bad++;
+    if (label_from) {
+        const char* label = label_from->parsed.selabel;
+        char* current = NULL;
+        if (lgetfilecon(at, &current) < 0 || strcmp(current, label) != 0) {
+            // TODO: Don't silently ignore ENOTSUP
+            if (lsetfilecon(at, label) && (errno != ENOTSUP)) {
+                printf("ApplyMetadata: lsetfilecon of %s to %s failed: %s\n",
+                       path, label, strerror(errno));
+                MetadataFailed(label_from);
+            }
         }
+        freecon(current);
     }
 
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-        if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
+    if (caps_from) {
+        uint64_t capabilities = caps_from->parsed.capabilities;
+        if (capabilities == 0) {
+            if ((removexattr(at, XATTR_NAME_CAPS) == -1) && ((errno != ENODATA)
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
                )) {
                 // Report failure unless it's ENODATA (attribute not set)
-                printf("ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
+                printf("ApplyMetadata: removexattr of %s to %" PRIx64 " failed: %s\n",
+                       path, capabilities, strerror(errno));
+                MetadataFailed(caps_from);
             }
         } else {
-            struct vfs_cap_data cap_data;
+            struct vfs_cap_data cap_data, current;
             memset(&cap_data, 0, sizeof(cap_data));
             cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-            cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
+            cap_data.data[0].permitted = (uint32_t) (capabilities & 0xffffffff);
             cap_data.data[0].inheritable = 0;
-            cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
+            cap_data.data[1].permitted = (uint32_t) (capabilities >> 32);
             cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
+            if (!chowned &&
+                getxattr(at, XATTR_NAME_CAPS, &current, sizeof(current)) == sizeof(current) &&
+                memcmp(&current, &cap_data, sizeof(current)) == 0) {
+                return;
+            }
+            if (setxattr(at, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
                ) {
-                printf("ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
+                printf("ApplyMetadata: setcap of %s to %" PRIx64 " failed: %s\n",
+                       path, capabilities, strerror(errno));
+                MetadataFailed(caps_from);
             }
         }
     }
-
-    return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
+// Visit "name" (relative to "dirfd"; "path" is its full name, in a
+// PATH_MAX buffer) and, if a recursive rule covers it, everything below
+// it, each directory after its contents.  Everything under a directory
+// is reached through its fd, so the walk never resolves the full path
+// again and never changes the working directory; "path" is only used in
+// messages and to match rules.
+static void WalkMetadata(struct metadata_batch* b, int dirfd, const char* name,
+                         char* path, size_t len) {
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        printf("ApplyMetadata: lstat of %s failed: %s\n", path, strerror(errno));
+        MetadataFailed(CoveringRule(b, path, len));
+        return;
+    }
+
+    /* ignore symlinks */
+    if (S_ISLNK(st.st_mode)) {
+        return;
+    }
+
+    struct metadata_rule* covering = CoveringRule(b, path, len);
+    if (S_ISDIR(st.st_mode) && covering != NULL) {
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+        if (dir == NULL) {
+            printf("ApplyMetadata: can't open %s: %s\n", path, strerror(errno));
+            MetadataFailed(covering);
+            if (fd >= 0) close(fd);
+        } else {
+            size_t sub = (path[len-1] == '/') ? len : len + 1;
+            struct dirent* de;
+            while ((de = readdir(dir)) != NULL) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+                    continue;
+                }
+                size_t n = strlen(de->d_name);
+                if (sub + n >= PATH_MAX) {
+                    printf("ApplyMetadata: %s/%s: path too long\n", path, de->d_name);
+                    MetadataFailed(covering);
+                    continue;
+                }
+                path[len] = '/';
+                memcpy(path + sub, de->d_name, n + 1);
+                WalkMetadata(b, fd, de->d_name, path, sub + n);
+                path[len] = '\0';
+            }
+            closedir(dir);
+        }
+    }
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
+    ApplyMetadata(b, dirfd, name, path, len, &st);
 }
 
-static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
-    int i;
-    int bad = 0;
-    static int nwarnings = 0;
-    struct stat sb;
-    Value* result = NULL;
+// Apply every rule in the batch, walking each tree once no matter how
+// many rules cover it.  Returns the name of a call that reported
+// failures, or NULL.
+static const char* ApplyMetadataBatch(struct metadata_batch* b) {
+    char path[PATH_MAX];
+    int i, j;
+
+    for (i = 0; i < b->count; ++i) {
+        struct metadata_rule* r = &b->rules[i];
+
+        // skip paths that a walk from another rule will reach
+        for (j = 0; j < b->count; ++j) {
+            struct metadata_rule* o = &b->rules[j];
+            if (j == i || !o->recursive || !RuleApplies(o, r->path, r->path_len)) {
+                continue;
+            }
+            if (o->path_len < r->path_len || j < i || !r->recursive) break;
+        }
+        if (j < b->count) continue;
 
-    bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
+        memcpy(path, r->path, r->path_len + 1);
+        WalkMetadata(b, AT_FDCWD, r->path, path, r->path_len);
+    }
 
-    if ((argc % 2) != 1) {
-        return ErrorAbort(state, "%s() expects an odd number of arguments, got %d",
-                          name, argc);
+    for (i = 0; i < b->count; ++i) {
+        if (b->rules[i].strict && b->rules[i].bad > 0) {
+            return b->rules[i].name;
+        }
     }
+    return NULL;
+}
 
-    char** args = ReadVarArgs(state, argc, argv);
-    if (args == NULL) return NULL;
+static Value* FinishMetadataBatch(State* state, struct metadata_batch* b) {
+    const char* failed = ApplyMetadataBatch(b);
+    FreeMetadataBatch(b);
 
-    if (lstat(args[0], &sb) == -1) {
-        result = ErrorAbort(state, "%s: Error on lstat of \"%s\": %s", name, args[0], strerror(errno));
-        goto done;
+    if (failed != NULL) {
+        return ErrorAbort(state, "%s: some changes failed", failed);
+    }
+    return StringValue(strdup(""));
+}
+
+// Whether one of the rules from "first" on changes owners of files that
+// an earlier rule sets the mode or capabilities of.  Run in order, the
+// later chown would clear the setuid/setgid bits and capabilities the
+// earlier call set, so the two can't be merged.
+static bool OwnerAfterMode(struct metadata_batch* b, int first) {
+    int i, j;
+    for (i = first; i < b->count; ++i) {
+        const struct metadata_rule* n = &b->rules[i];
+        if (!n->parsed.has_uid && !n->parsed.has_gid) continue;
+        for (j = 0; j < first; ++j) {
+            const struct metadata_rule* e = &b->rules[j];
+            if (!e->parsed.has_mode && !e->parsed.has_fmode &&
+                !e->parsed.has_capabilities) {
+                continue;
+            }
+            if (RuleApplies(e, n->path, n->path_len) ||
+                RuleApplies(n, e->path, e->path_len)) {
+                return true;
+            }
+        }
     }
+    return false;
+}
 
-    struct perm_parsed_args parsed = ParsePermArgs(argc, args);
+static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
+    struct metadata_batch b;
+    memset(&b, 0, sizeof(b));
 
-    if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    } else {
-        bad += ApplyParsedPerms(args[0], &sb, parsed);
+    if (!CollectMetadataCall(state, name, argc, argv, &b)) {
+        FreeMetadataBatch(&b);
+        return NULL;
     }
+    return FinishMetadataBatch(state, &b);
+}
+
+// Runs consecutive set_metadata*() and set_perm_recursive() statements
+// (its arguments, left unevaluated) as one batch; see
+// BatchMetadataCalls().
+static Value* SetMetadataBatchFn(const char* name, State* state,
+                                 int argc, Expr* argv[]) {
+    struct metadata_batch b;
+    int i;
+    memset(&b, 0, sizeof(b));
 
-done:
     for (i = 0; i < argc; ++i) {
-        free(args[i]);
+        int first = b.count;
+        if (!CollectMetadataCall(state, argv[i]->name, argv[i]->argc,
+                                 argv[i]->argv, &b)) {
+            // The statements before this one still take effect.
+            char* errmsg = state->errmsg;
+            state->errmsg = NULL;
+            Value* done = FinishMetadataBatch(state, &b);
+            if (done == NULL) {
+                free(errmsg);
+                return NULL;
+            }
+            FreeValue(done);
+            state->errmsg = errmsg;
+            return NULL;
+        }
+        if (first > 0 && OwnerAfterMode(&b, first)) {
+            // apply what came before this call on its own
+            struct metadata_batch earlier = b;
+            earlier.count = first;
+            const char* failed = ApplyMetadataBatch(&earlier);
+            FreeMetadataRules(b.rules, first);
+            b.count -= first;
+            memmove(b.rules, b.rules + first, b.count * sizeof(struct metadata_rule));
+            if (failed != NULL) {
+                FreeMetadataBatch(&b);
+                return ErrorAbort(state, "%s: some changes failed", failed);
+            }
+        }
     }
-    free(args);
+    return FinishMetadataBatch(state, &b);
+}
 
-    if (result != NULL) {
-        return result;
+static void AddStatement(Expr* expr, Expr*** list, int* count) {
+    if (expr->fn == SequenceFn) {
+        AddStatement(expr->argv[0], list, count);
+        AddStatement(expr->argv[1], list, count);
+        free(expr->argv);
+        free(expr);
+        return;
     }
+    *list = realloc(*list, (*count + 1) * sizeof(Expr*));
+    (*list)[(*count)++] = expr;
+}
 
-    if (bad > 0) {
-        return ErrorAbort(state, "%s: some changes failed", name);
+static Expr* NewExpr(Function fn, char* name, int argc, Expr** argv) {
+    Expr* e = malloc(sizeof(Expr));
+    e->fn = fn;
+    e->name = name;
+    e->argc = argc;
+    e->argv = argv;
+    e->start = argv[0]->start;
+    e->end = argv[argc-1]->end;
+    return e;
+}
+
+Expr* BatchMetadataCalls(Expr* expr) {
+    int i;
+
+    if (expr->fn != SequenceFn) {
+        for (i = 0; i < expr->argc; ++i) {
+            expr->argv[i] = BatchMetadataCalls(expr->argv[i]);
+        }
+        return expr;
     }
 
-    return StringValue(strdup(""));
+    Expr** list = NULL;
+    int count = 0;
+    AddStatement(expr, &list, &count);
+
+    Expr* result = NULL;
+    for (i = 0; i < count; ) {
+        int run = 0;
+        while (i + run < count && list[i + run]->fn == SetMetadataFn) ++run;
+
+        Expr* stmt;
+        if (run >= 2) {
+            Expr** calls = malloc(run * sizeof(Expr*));
+            memcpy(calls, list + i, run * sizeof(Expr*));
+            stmt = NewExpr(SetMetadataBatchFn, "set_metadata_batch", run, calls);
+            i += run;
+        } else {
+            stmt = BatchMetadataCalls(list[i++]);
+        }
+
+        if (result == NULL) {
+            result = stmt;
+        } else {
+            Expr** pair = malloc(2 * sizeof(Expr*));
+            pair[0] = result;
+            pair[1] = stmt;
+            result = NewExpr(SequenceFn, "(operator)", 2, pair);
+        }
+    }
+    free(list);
+    return result;
 }
 
 Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -981,7 +1430,8 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fclose(f);
 
-    char* line = strtok(buffer, "\n");
+    char* save;
+    char* line = strtok_r(buffer, "\n", &save);
     do {
         // skip whitespace at start of line
         while (*line && isspace(*line)) ++line;
@@ -1016,7 +1466,7 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup(val_start);
         break;
 
-    } while ((line = strtok(NULL, "\n")));
+    } while ((line = strtok_r(NULL, "\n", &save)));
 
     if (result == NULL) result = strdup("");
 
@@ -1028,50 +1478,235 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
-static bool write_raw_image_cb(const unsigned char* data,
-                               int data_len, void* ctx) {
-    int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
-    if (r == data_len) return true;
-    fprintf(stderr, "%s\n", strerror(errno));
-    return false;
+static char* PrintSha1(uint8_t* digest);
+
+// Raw images written to a block device go out in chunks of this size,
+// from a page-aligned buffer.
+#define RAW_IMAGE_BUFFER_SIZE (1024 * 1024)
+
+// Writes an image to a raw partition as it is produced, so that
+// write_raw_image doesn't have to stage it in /tmp first.  MTD
+// partitions go through mtdutils (which already buffers a whole erase
+// block); everything else is written to the partition's block device.
+// The output is only opened once the first data arrives.
+typedef struct {
+    const char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    unsigned char* buffer;
+    size_t used;
+    long long written;
+    MhSha1Ctx sha1;
+} RawImageWriter;
+
+static bool OpenRawImageWriter(RawImageWriter* w) {
+    const char* partition = w->partition;
+    char device[PATH_MAX];
+
+    if (partition[0] != '/' && device_flash_type() == MTD) {
+        mtd_scan_partitions();
+        const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+        if (mtd == NULL) {
+            fprintf(stderr, "can't find %s partition\n", partition);
+            return false;
+        }
+        w->mtd = mtd_write_partition(mtd);
+        if (w->mtd == NULL) {
+            fprintf(stderr, "can't write %s partition\n", partition);
+            return false;
+        }
+        return true;
+    }
+
+    if (partition[0] == '/') {
+        strlcpy(device, partition, sizeof(device));
+    } else if (get_partition_device(partition, device) != 0) {
+        fprintf(stderr, "can't find %s partition\n", partition);
+        return false;
+    }
+    w->buffer = memalign(4096, RAW_IMAGE_BUFFER_SIZE);
+    if (w->buffer == NULL) {
+        fprintf(stderr, "can't allocate buffer for %s\n", partition);
+        return false;
+    }
+    w->fd = open(device, O_WRONLY | O_LARGEFILE);
+    if (w->fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", device, strerror(errno));
+        return false;
+    }
+    return true;
 }
 
-// write_raw_image(filename_or_blob, partition)
-Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* result = NULL;
+static bool WriteAll(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t r = TEMP_FAILURE_RETRY(write(fd, data, len));
+        if (r <= 0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return false;
+        }
+        data += r;
+        len -= r;
+    }
+    return true;
+}
 
-    Value* partition_value;
-    Value* contents;
-    if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
-        return NULL;
+static bool RawImageWrite(const unsigned char* data, int data_len,
+                          void* cookie) {
+    RawImageWriter* w = (RawImageWriter*)cookie;
+    size_t len = data_len;
+
+    if (w->mtd == NULL && w->fd < 0 && !OpenRawImageWriter(w)) return false;
+    mhSha1Update(&w->sha1, data, len);
+    w->written += len;
+
+    if (w->mtd != NULL) {
+        if (mtd_write_data(w->mtd, (const char*)data, len) != (ssize_t)len) {
+            fprintf(stderr, "error writing %s: %s\n", w->partition,
+                    strerror(errno));
+            return false;
+        }
+        return true;
     }
 
-    if (partition_value->type != VAL_STRING) {
-        ErrorAbort(state, "partition argument to %s must be string", name);
-        goto done;
+    while (len > 0) {
+        // Large pieces (a blob, or a stored entry) skip the copy.
+        if (w->used == 0 && len >= RAW_IMAGE_BUFFER_SIZE) {
+            size_t n = len - len % RAW_IMAGE_BUFFER_SIZE;
+            if (!WriteAll(w->fd, data, n)) return false;
+            data += n;
+            len -= n;
+            continue;
+        }
+        size_t n = RAW_IMAGE_BUFFER_SIZE - w->used;
+        if (n > len) n = len;
+        memcpy(w->buffer + w->used, data, n);
+        w->used += n;
+        data += n;
+        len -= n;
+        if (w->used == RAW_IMAGE_BUFFER_SIZE) {
+            if (!WriteAll(w->fd, w->buffer, w->used)) return false;
+            w->used = 0;
+        }
     }
-    char* partition = partition_value->data;
-    if (strlen(partition) == 0) {
-        ErrorAbort(state, "partition argument to %s can't be empty", name);
-        goto done;
+    return true;
+}
+
+// Flushes and closes the output; returns false if anything failed,
+// including earlier writes (ok is false).
+static bool CloseRawImageWriter(RawImageWriter* w, bool ok) {
+    if (w->mtd != NULL) {
+        if (ok && mtd_erase_blocks(w->mtd, -1) == -1) {
+            fprintf(stderr, "error erasing blocks of %s\n", w->partition);
+            ok = false;
+        }
+        if (mtd_write_close(w->mtd) != 0) {
+            fprintf(stderr, "error closing write of %s\n", w->partition);
+            ok = false;
+        }
+    } else if (w->fd >= 0) {
+        if (ok && w->used > 0 && !WriteAll(w->fd, w->buffer, w->used)) {
+            ok = false;
+        }
+        if (ok && fsync(w->fd) < 0) {
+            fprintf(stderr, "fsync of %s failed: %s\n", w->partition,
+                    strerror(errno));
+            ok = false;
+        }
+        close(w->fd);
     }
-    if (contents->type == VAL_STRING && strlen((char*) contents->data) == 0) {
-        ErrorAbort(state, "file argument to %s can't be empty", name);
-        goto done;
+    free(w->buffer);
+
+    if (ok) {
+        uint8_t digest[MH_SHA1_DIGEST_SIZE];
+        memcpy(digest, mhSha1Final(&w->sha1), MH_SHA1_DIGEST_SIZE);
+        char* hex = PrintSha1(digest);
+        printf("wrote %lld bytes to %s (sha1 %s)\n", w->written,
+               w->partition, hex);
+        free(hex);
     }
+    return ok;
+}
 
-    char* filename = contents->data;
-    if (0 == restore_raw_partition(NULL, partition, filename))
-        result = strdup(partition);
-    else {
-        result = strdup("");
-        goto done;
+// BML partitions need bmlutils' unlock and boot/recovery pairing, so
+// a blob bound for one is still staged in a file.
+static int RestoreRawBlob(const char* partition, Value* blob) {
+    char path[] = "/tmp/raw_image_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    bool ok = WriteAll(fd, (unsigned char*)blob->data, blob->size);
+    close(fd);
+    int result = ok ? restore_raw_partition(NULL, partition, path) : -1;
+    unlink(path);
+    return result;
+}
+
+// write_raw_image(filename_or_blob, partition)
+//
+//    The image may also be given as package_extract_file(zip_path), in
+//    which case the entry is inflated straight into the partition.
+Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
     }
 
-done:
-    if (result != partition) FreeValue(partition_value);
-    FreeValue(contents);
-    return StringValue(result);
+    char* partition = Evaluate(state, argv[1]);
+    if (partition == NULL) return NULL;
+    if (strlen(partition) == 0) {
+        free(partition);
+        return ErrorAbort(state, "partition argument to %s can't be empty",
+                          name);
+    }
+
+    bool ok = false;
+    bool bml = strstr(partition, "/dev/block/bml") != NULL ||
+               (partition[0] != '/' && device_flash_type() == BML);
+    RawImageWriter w;
+    memset(&w, 0, sizeof(w));
+    w.partition = partition;
+    w.fd = -1;
+    mhSha1Init(&w.sha1);
+
+    int streamed = bml ? 0 :
+        ProcessPackageEntryArg(state, argv[0], RawImageWrite, &w);
+    if (streamed == -2) {
+        CloseRawImageWriter(&w, false);
+        free(partition);
+        return NULL;
+    }
+    if (streamed != 0) {
+        ok = CloseRawImageWriter(&w, streamed == 1);
+    } else {
+        Value* contents = EvaluateValue(state, argv[0]);
+        if (contents == NULL) {
+            free(partition);
+            return NULL;
+        }
+        if (contents->type == VAL_STRING) {
+            if (strlen(contents->data) == 0) {
+                FreeValue(contents);
+                free(partition);
+                return ErrorAbort(state, "file argument to %s can't be empty",
+                                  name);
+            }
+            ok = restore_raw_partition(NULL, partition, contents->data) == 0;
+        } else if (bml) {
+            ok = RestoreRawBlob(partition, contents) == 0;
+        } else {
+            ok = CloseRawImageWriter(&w,
+                RawImageWrite((unsigned char*)contents->data,
+                              contents->size, &w));
+        }
+        FreeValue(contents);
+    }
+
+    if (!ok) {
+        free(partition);
+        return StringValue(strdup(""));
+    }
+    return StringValue(partition);
 }
 
 // apply_patch_space(bytes)
@@ -1246,13 +1881,18 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     free(args);
     buffer[size] = '\0';
 
-    char* line = strtok(buffer, "\n");
+    // Hold the pipe for the whole message, so lines printed from
+    // another parallel() branch don't land in the middle of it.
+    FILE* cmd_pipe = ((UpdaterInfo*)(state->cookie))->cmd_pipe;
+    char* save;
+    char* line = strtok_r(buffer, "\n", &save);
+    flockfile(cmd_pipe);
     while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
+        fprintf(cmd_pipe, "ui_print %s\n", line);
+        line = strtok_r(NULL, "\n", &save);
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    fprintf(cmd_pipe, "ui_print\n");
+    funlockfile(cmd_pipe);
 
     return StringValue(buffer);
 }
@@ -1369,10 +2009,10 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
 
 // Take a sha-1 digest and return it as a newly-allocated hex string.
 static char* PrintSha1(uint8_t* digest) {
-    char* buffer = malloc(SHA_DIGEST_SIZE*2 + 1);
+    char* buffer = malloc(MH_SHA1_DIGEST_SIZE*2 + 1);
     int i;
     const char* alphabet = "0123456789abcdef";
-    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+    for (i = 0; i < MH_SHA1_DIGEST_SIZE; ++i) {
         buffer[i*2] = alphabet[(digest[i] >> 4) & 0xf];
         buffer[i*2+1] = alphabet[digest[i] & 0xf];
     }
@@ -1380,6 +2020,11 @@ static char* PrintSha1(uint8_t* digest) {
     return buffer;
 }
 
+static bool Sha1Update(const unsigned char* data, int len, void* cookie) {
+    mhSha1Update((MhSha1Ctx*)cookie, data, len);
+    return true;
+}
+
 // sha1_check(data)
 //    to return the sha1 of the data (given in the format returned by
 //    read_file).
@@ -1393,25 +2038,55 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         return ErrorAbort(state, "%s() expects at least 1 arg", name);
     }
 
-    Value** args = ReadValueVarArgs(state, argc, argv);
-    if (args == NULL) {
+    int i;
+    // Hash a file from the package as it is read, rather than have
+    // package_extract_file() put it all in memory first.
+    MhSha1Ctx ctx;
+    mhSha1Init(&ctx);
+    int streamed = ProcessPackageEntryArg(state, argv[0], Sha1Update, &ctx);
+    if (streamed == -2) {
         return NULL;
-    }
-
-    if (args[0]->size < 0) {
+    } else if (streamed < 0) {
         fprintf(stderr, "%s(): no file contents received", name);
         return StringValue(strdup(""));
     }
-    uint8_t digest[SHA_DIGEST_SIZE];
-    SHA_hash(args[0]->data, args[0]->size, digest);
+
+    Value** args;
+    if (streamed) {
+        args = malloc(argc * sizeof(Value*));
+        args[0] = NULL;
+        for (i = 1; i < argc; ++i) {
+            args[i] = EvaluateValue(state, argv[i]);
+            if (args[i] == NULL) {
+                int j;
+                for (j = 1; j < i; ++j) {
+                    FreeValue(args[j]);
+                }
+                free(args);
+                return NULL;
+            }
+        }
+    } else {
+        args = ReadValueVarArgs(state, argc, argv);
+        if (args == NULL) {
+            return NULL;
+        }
+        if (args[0]->size < 0) {
+            fprintf(stderr, "%s(): no file contents received", name);
+            return StringValue(strdup(""));
+        }
+        mhSha1Update(&ctx, args[0]->data, args[0]->size);
+    }
+    uint8_t digest[MH_SHA1_DIGEST_SIZE];
+    memcpy(digest, mhSha1Final(&ctx), MH_SHA1_DIGEST_SIZE);
     FreeValue(args[0]);
 
     if (argc == 1) {
+        free(args);
         return StringValue(PrintSha1(digest));
     }
 
-    int i;
-    uint8_t* arg_digest = malloc(SHA_DIGEST_SIZE);
+    uint8_t* arg_digest = malloc(MH_SHA1_DIGEST_SIZE);
     for (i = 1; i < argc; ++i) {
         if (args[i]->type != VAL_STRING) {
             fprintf(stderr, "%s(): arg %d is not a string; skipping",
@@ -1420,7 +2095,7 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
             // Warn about bad args and skip them.
             fprintf(stderr, "%s(): error parsing \"%s\" as sha-1; skipping",
                     name, args[i]->data);
-        } else if (memcmp(digest, arg_digest, SHA_DIGEST_SIZE) == 0) {
+        } else if (memcmp(digest, arg_digest, MH_SHA1_DIGEST_SIZE) == 0) {
             break;
         }
         FreeValue(args[i]);
@@ -1483,7 +2158,7 @@ void RegisterInstallFunctions() {
     // Maybe, at some future point, we can delete these functions? They have been
     // replaced by perm_set and perm_set_recursive.
     RegisterFunction("set_perm", SetPermFn);
-    RegisterFunction("set_perm_recursive", SetPermFn);
+    RegisterFunction("set_perm_recursive", SetMetadataFn);
 
     // Usage:
     //   set_metadata("filename", "key1", "value1", "key2", "value2", ...)
@@ -1515,4 +2190,27 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("run_program", RunProgramFn);
     RegisterFunction("collect_backup_data", CollectBackupDataFn);
+
+    // Functions that only touch the paths they are given (and the
+    // package, which is read with pread) may run in parallel() branches.
+    // Anything that mounts, formats or writes partitions stays serial.
+    AllowInParallel("show_progress");
+    AllowInParallel("set_progress");
+    AllowInParallel("delete");
+    AllowInParallel("delete_recursive");
+    AllowInParallel("package_extract_dir");
+    AllowInParallel("package_extract_file");
+    AllowInParallel("symlink");
+    AllowInParallel("set_perm");
+    AllowInParallel("set_perm_recursive");
+    AllowInParallel("set_metadata");
+    AllowInParallel("set_metadata_recursive");
+    AllowInParallel("set_metadata_batch");
+    AllowInParallel("getprop");
+    AllowInParallel("file_getprop");
+    AllowInParallel("read_file");
+    AllowInParallel("sha1_check");
+    AllowInParallel("rename");
+    AllowInParallel("ui_print");
+    AllowInParallel("run_program");
 }
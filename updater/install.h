@@ -17,6 +17,13 @@
 #ifndef _UPDATER_INSTALL_H_
 #define _UPDATER_INSTALL_H_
 
+#include "edify/expr.h"
+
 void RegisterInstallFunctions();
 
+// Rewrite runs of consecutive set_metadata(), set_metadata_recursive()
+// and set_perm_recursive() statements in a parsed script into single
+// batches that walk each tree once.  Returns the new root.
+Expr* BatchMetadataCalls(Expr* root);
+
 #endif
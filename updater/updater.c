@@ -14,12 +14,20 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "cutils/properties.h"
 
 #include "edify/expr.h"
 #include "updater.h"
+#include "blockimg.h"
 #include "install.h"
 #include "minzip/Zip.h"
 
@@ -34,6 +42,212 @@
 
 struct selabel_handle *sehandle;
 
+// Install profiling.  When the property is "1" or the flag file exists,
+// each top-level statement of the script is timed, and a report sorted
+// by wall time goes to the log and to PROFILE_FILE.
+#define PROFILE_PROPERTY "recovery.profile_install"
+#define PROFILE_FLAG_FILE "/cache/recovery/profile_install"
+#define PROFILE_FILE "/cache/recovery/last_install_profile"
+
+typedef struct {
+    double wall;                // seconds
+    double cpu;                 // user + system, ours and our children's
+    long long read_bytes;       // storage I/O from /proc/self/io; -1 if
+    long long write_bytes;      // the kernel doesn't account it
+} ProfileSample;
+
+typedef struct {
+    const char* label;
+    int line;
+    int count;
+    ProfileSample cost;
+} ProfileEntry;
+
+static bool ProfilingEnabled() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(PROFILE_PROPERTY, value, "");
+    return strcmp(value, "1") == 0 || access(PROFILE_FLAG_FILE, F_OK) == 0;
+}
+
+static double Seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void TakeSample(ProfileSample* s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    s->wall = now.tv_sec + now.tv_nsec / 1000000000.0;
+
+    // RUSAGE_CHILDREN covers run_program() once it has reaped the child.
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    s->cpu = Seconds(self.ru_utime) + Seconds(self.ru_stime) +
+             Seconds(children.ru_utime) + Seconds(children.ru_stime);
+
+    s->read_bytes = s->write_bytes = -1;
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f != NULL) {
+        char line[64];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            sscanf(line, "read_bytes: %lld", &s->read_bytes);
+            sscanf(line, "write_bytes: %lld", &s->write_bytes);
+        }
+        fclose(f);
+    }
+}
+
+static void AddStatements(Expr* expr, Expr*** list, int* count) {
+    if (expr->fn == SequenceFn) {
+        AddStatements(expr->argv[0], list, count);
+        AddStatements(expr->argv[1], list, count);
+        return;
+    }
+    *list = realloc(*list, (*count + 1) * sizeof(Expr*));
+    (*list)[(*count)++] = expr;
+}
+
+static void AddBytes(long long* total, long long bytes) {
+    *total = (*total < 0 || bytes < 0) ? -1 : *total + bytes;
+}
+
+static int ByWallTime(const void* a, const void* b) {
+    double wa = ((const ProfileEntry*)a)->cost.wall;
+    double wb = ((const ProfileEntry*)b)->cost.wall;
+    return (wa < wb) - (wa > wb);
+}
+
+static void PrintKB(FILE* f, long long bytes) {
+    if (bytes < 0) {
+        fprintf(f, " %10s", "-");
+    } else {
+        fprintf(f, " %10lld", bytes / 1024);
+    }
+}
+
+static void WriteProfileTable(FILE* f, ProfileEntry* entries, int count,
+                              bool by_function) {
+    int i;
+    fprintf(f, "%9s %9s %10s %10s %6s  %s\n", "wall s", "cpu s",
+            "read KB", "write KB", by_function ? "calls" : "line",
+            by_function ? "function" : "statement");
+    for (i = 0; i < count; ++i) {
+        ProfileEntry* e = entries + i;
+        fprintf(f, "%9.3f %9.3f", e->cost.wall, e->cost.cpu);
+        PrintKB(f, e->cost.read_bytes);
+        PrintKB(f, e->cost.write_bytes);
+        fprintf(f, " %6d  %s\n", by_function ? e->count : e->line, e->label);
+    }
+}
+
+static void WriteProfile(FILE* f, ProfileEntry* entries, int count) {
+    ProfileEntry* functions = malloc(count * sizeof(ProfileEntry));
+    ProfileEntry total;
+    int nfunctions = 0;
+    int i, j;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < count; ++i) {
+        ProfileEntry* e = entries + i;
+        for (j = 0; j < nfunctions; ++j) {
+            if (strcmp(functions[j].label, e->label) == 0) break;
+        }
+        if (j == nfunctions) {
+            functions[nfunctions] = *e;
+            functions[nfunctions++].count = 0;
+            memset(&functions[j].cost, 0, sizeof(ProfileSample));
+        }
+        ProfileEntry* fn[2] = { functions + j, &total };
+        int k;
+        for (k = 0; k < 2; ++k) {
+            fn[k]->count++;
+            fn[k]->cost.wall += e->cost.wall;
+            fn[k]->cost.cpu += e->cost.cpu;
+            AddBytes(&fn[k]->cost.read_bytes, e->cost.read_bytes);
+            AddBytes(&fn[k]->cost.write_bytes, e->cost.write_bytes);
+        }
+    }
+    qsort(entries, count, sizeof(ProfileEntry), ByWallTime);
+    qsort(functions, nfunctions, sizeof(ProfileEntry), ByWallTime);
+
+    fprintf(f, "install profile: %d statements, %.3f s wall, %.3f s cpu\n\n",
+            total.count, total.cost.wall, total.cost.cpu);
+    WriteProfileTable(f, functions, nfunctions, true);
+    fprintf(f, "\n");
+    WriteProfileTable(f, entries, count, false);
+    free(functions);
+}
+
+// Evaluate the script one top-level statement at a time (as the
+// sequence operator would), measuring each.
+static char* EvaluateProfiled(State* state, Expr* root) {
+    Expr** list = NULL;
+    int count = 0;
+    char* result = NULL;
+    int line = 1, offset = 0;   // line number at script offset "offset"
+    int i;
+
+    AddStatements(root, &list, &count);
+    ProfileEntry* entries = calloc(count, sizeof(ProfileEntry));
+
+    for (i = 0; i < count; ++i) {
+        Expr* expr = list[i];
+        ProfileEntry* e = entries + i;
+        ProfileSample before, after;
+        bool ok;
+
+        TakeSample(&before);
+        if (i < count - 1) {
+            Value* v = EvaluateValue(state, expr);
+            ok = (v != NULL);
+            FreeValue(v);
+        } else {
+            result = Evaluate(state, expr);
+            ok = (result != NULL);
+        }
+        TakeSample(&after);
+
+        // statements come in script order, so count lines from the
+        // previous one rather than from the start
+        if (expr->start < offset) {
+            line = 1;
+            offset = 0;
+        }
+        for (; offset < expr->start; ++offset) {
+            if (state->script[offset] == '\n') line++;
+        }
+        e->line = line;
+        e->label = expr->name;
+        if (expr->fn == Literal || strcmp(e->label, "(operator)") == 0) {
+            e->label = "(expression)";
+        }
+        e->count = 1;
+        e->cost.wall = after.wall - before.wall;
+        e->cost.cpu = after.cpu - before.cpu;
+        e->cost.read_bytes = before.read_bytes < 0 ? -1 :
+            after.read_bytes - before.read_bytes;
+        e->cost.write_bytes = before.write_bytes < 0 ? -1 :
+            after.write_bytes - before.write_bytes;
+        if (!ok) {
+            ++i;
+            break;
+        }
+    }
+
+    WriteProfile(stderr, entries, i);
+    FILE* f = fopen(PROFILE_FILE, "w");
+    if (f != NULL) {
+        WriteProfile(f, entries, i);
+        fclose(f);
+    } else {
+        fprintf(stderr, "can't write %s: %s\n", PROFILE_FILE, strerror(errno));
+    }
+
+    free(entries);
+    free(list);
+    return result;
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -67,7 +281,7 @@ int main(int argc, char** argv) {
     char* package_data = argv[3];
     ZipArchive za;
     int err;
-    err = mzOpenZipArchive(package_data, &za);
+    err = mzOpenZipArchiveCached(package_data, MZ_DEFAULT_INDEX_CACHE, &za);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
@@ -91,6 +305,7 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
@@ -104,6 +319,7 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    root = BatchMetadataCalls(root);
 
     struct selinux_opt seopts[] = {
       { SELABEL_OPT_PATH, "/file_contexts" }
@@ -127,8 +343,18 @@ int main(int argc, char** argv) {
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
+    state.arena = NewEvalArena();
+
+    char* result = ProfilingEnabled() ? EvaluateProfiled(&state, root)
+                                      : Evaluate(&state, root);
+
+    EvalArenaStats stats;
+    GetEvalArenaStats(state.arena, &stats);
+    fprintf(stderr, "edify: %ld scratch allocations (%ld too big, peak %zu bytes), "
+            "%ld Values reused\n", stats.arena_allocs, stats.arena_fallbacks,
+            stats.arena_peak, stats.value_reuses);
+    FreeEvalArena(state.arena);
 
-    char* result = Evaluate(&state, root);
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
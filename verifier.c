@@ -20,11 +20,21 @@
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
+#include "minhash/Sha.h"
+#include "minzip/SysUtil.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
 
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
@@ -33,15 +43,164 @@
 // Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
 // or no key matches the signature).
 
-int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+// Read exactly "count" bytes at "offset".  Positional, with a 64-bit
+// offset, so packages larger than 2GB work on 32-bit builds.
+static bool read_at(int fd, unsigned char* buf, size_t count, off64_t offset) {
+    while (count > 0) {
+        ssize_t n = pread64(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        offset += n;
+        count -= n;
+    }
+    return true;
+}
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
+// The signed data is hashed through read-only mappings of this many
+// bytes at a time, so a package larger than the address space still
+// works and the pages stay in the page cache for the install that
+// follows.  Progress is reported every HASH_CHUNK_SIZE bytes.
+#define HASH_WINDOW_SIZE (32 * 1024 * 1024)
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+    int fd;
+    off64_t len;
+    bool progress;
+    MhSha1Ctx* sha1;          // either may be NULL
+    MhSha256Ctx* sha256;
+    bool ok;
+} hash_job;
+
+static void hash_update(hash_job* job, const unsigned char* data, size_t len) {
+    if (job->sha1) mhSha1Update(job->sha1, data, len);
+    if (job->sha256) mhSha256Update(job->sha256, data, len);
+}
+
+// Hash the first job->len bytes of the file.  Falls back to pread if the
+// file can't be mapped.
+static void* hash_file(void* cookie) {
+    hash_job* job = (hash_job*) cookie;
+    unsigned char* buffer = NULL;
+    double frac = -1.0;
+    off64_t so_far = 0;
+
+    job->ok = false;
+    while (so_far < job->len) {
+        size_t window = HASH_WINDOW_SIZE;
+        if (job->len - so_far < (off64_t) window) window = job->len - so_far;
+
+        unsigned char* map = sysMmap64(NULL, window, PROT_READ, MAP_SHARED,
+                                       job->fd, so_far);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            if (buffer == NULL && (buffer = malloc(HASH_CHUNK_SIZE)) == NULL) {
+                LOGD("failed to alloc memory for hash buffer\n");
+                return NULL;
+            }
+        } else {
+            // one sequential pass: read the whole window ahead
+            madvise(map, window, MADV_SEQUENTIAL);
+            madvise(map, window, MADV_WILLNEED);
+        }
+
+        size_t done = 0;
+        while (done < window) {
+            size_t size = HASH_CHUNK_SIZE;
+            if (window - done < size) size = window - done;
+            if (map != NULL) {
+                hash_update(job, map + done, size);
+            } else if (read_at(job->fd, buffer, size, so_far + done)) {
+                hash_update(job, buffer, size);
+            } else {
+                free(buffer);
+                return NULL;
+            }
+            done += size;
+            if (job->progress) {
+                double f = (so_far + done) / (double)job->len;
+                if (f > frac + 0.02 || so_far + done == size) {
+                    ui_set_progress(f);
+                    frac = f;
+                }
+            }
+        }
+        if (map != NULL) munmap(map, window);
+        so_far += window;
+    }
+    free(buffer);
+    job->ok = true;
+    return NULL;
+}
+
+// Hash the first signed_len bytes of the package.  With keys of both
+// kinds, SHA-256 runs on its own thread over the same pages while this
+// one does SHA-1 and reports progress (if "progress" is set).
+static bool hash_package(int fd, off64_t signed_len, bool need_sha1, bool need_sha256,
+                         bool progress, uint8_t* sha1, uint8_t* sha256) {
+    MhSha1Ctx sha1_ctx;
+    MhSha256Ctx sha256_ctx;
+    mhSha1Init(&sha1_ctx);
+    mhSha256Init(&sha256_ctx);
+
+    hash_job jobs[2];
+    memset(jobs, 0, sizeof(jobs));
+    jobs[0].fd = jobs[1].fd = fd;
+    jobs[0].len = jobs[1].len = signed_len;
+    jobs[0].progress = progress;
+    if (need_sha1) jobs[0].sha1 = &sha1_ctx;
+    if (need_sha256) jobs[0].sha256 = &sha256_ctx;
+
+    pthread_t sha256_thread;
+    bool threaded = false;
+    if (need_sha1 && need_sha256) {
+        jobs[1].sha256 = &sha256_ctx;
+        jobs[0].sha256 = NULL;
+        if (pthread_create(&sha256_thread, NULL, hash_file, &jobs[1]) == 0) {
+            threaded = true;
+        } else {
+            jobs[0].sha256 = &sha256_ctx;
+        }
+    }
+    hash_file(&jobs[0]);
+    if (threaded) pthread_join(sha256_thread, NULL);
+
+    if (!jobs[0].ok || (threaded && !jobs[1].ok)) return false;
+    memcpy(sha1, mhSha1Final(&sha1_ctx), MH_SHA1_DIGEST_SIZE);
+    memcpy(sha256, mhSha256Final(&sha256_ctx), MH_SHA256_DIGEST_SIZE);
+    return true;
+}
+
+// Whether "digest" was computed for the file open on "fd", over exactly
+// "signed_len" bytes.
+static bool stream_digest_matches(const StreamDigest* digest, int fd,
+                                  off64_t signed_len) {
+    struct stat st;
+    return fstat(fd, &st) == 0 &&
+           digest->magic == STREAM_DIGEST_MAGIC &&
+           digest->file_size == lseek64(fd, 0, SEEK_END) &&
+           digest->signed_len == signed_len &&
+           digest->mtime == st.st_mtime &&
+           digest->ino == (uint64_t)st.st_ino;
+}
+
+// On success, *key_index (if non-NULL) receives the key that matched.
+// The progress bar is only touched if "progress" is set.  "stream", if
+// not NULL, holds hashes computed as the package was received.
+static int verify_package(const char* path, const StreamDigest* stream,
+                          const Certificate* pKeys, unsigned int numKeys,
+                          bool progress, unsigned int* key_index) {
+    if (progress) ui_set_progress(0.0);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         LOGD("failed to open %s (%s)\n", path, strerror(errno));
         return VERIFY_FAILURE;
     }
 
+    off64_t file_size = lseek64(fd, 0, SEEK_END);
+
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -53,22 +212,17 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
 
 #define FOOTER_SIZE 6
 
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGD("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-
     unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
+    if (file_size < FOOTER_SIZE ||
+        !read_at(fd, footer, FOOTER_SIZE, file_size - FOOTER_SIZE)) {
         LOGD("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
+        close(fd);
         return VERIFY_FAILURE;
     }
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGD("footer is wrong\n");
-        fclose(f);
+        close(fd);
         return VERIFY_FAILURE;
     }
 
@@ -80,7 +234,7 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGD("signature is too short\n");
-        fclose(f);
+        close(fd);
         return VERIFY_FAILURE;
     }
 
@@ -89,28 +243,29 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // The end-of-central-directory record is 22 bytes plus any
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
-
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGD("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if ((off64_t)eocd_size > file_size) {
+        LOGD("eocd is larger than %s\n", path);
+        close(fd);
         return VERIFY_FAILURE;
     }
+    off64_t eocd_start = file_size - eocd_size;
 
     // Determine how much of the file is covered by the signature.
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    off64_t signed_len = eocd_start + EOCD_HEADER_SIZE - 2;
 
     unsigned char* eocd = malloc(eocd_size);
     if (eocd == NULL) {
         LOGD("malloc for EOCD record failed\n");
-        fclose(f);
+        close(fd);
         return VERIFY_FAILURE;
     }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
+    if (!read_at(fd, eocd, eocd_size, eocd_start)) {
         LOGD("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
+        free(eocd);
+        close(fd);
         return VERIFY_FAILURE;
     }
 
@@ -119,7 +274,8 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGD("signature length doesn't match EOCD marker\n");
-        fclose(f);
+        free(eocd);
+        close(fd);
         return VERIFY_FAILURE;
     }
 
@@ -132,12 +288,34 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGD("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
+            free(eocd);
+            close(fd);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
+#define ZIP64_LOCATOR_SIZE 20
+
+    // If the entry count, central directory size or offset is
+    // saturated, minzip takes the real values from the ZIP64 record
+    // named by the locator just before the EOCD.  Both lie inside the
+    // signed data, but insist the locator is there so that minzip and
+    // this check always agree on which directory is used.
+    if ((eocd[10] == 0xff && eocd[11] == 0xff) ||
+        (eocd[12] == 0xff && eocd[13] == 0xff && eocd[14] == 0xff && eocd[15] == 0xff) ||
+        (eocd[16] == 0xff && eocd[17] == 0xff && eocd[18] == 0xff && eocd[19] == 0xff)) {
+        unsigned char locator[ZIP64_LOCATOR_SIZE];
+        if (eocd_start < ZIP64_LOCATOR_SIZE ||
+            !read_at(fd, locator, ZIP64_LOCATOR_SIZE, eocd_start - ZIP64_LOCATOR_SIZE) ||
+            locator[0] != 0x50 || locator[1] != 0x4b ||
+            locator[2] != 0x06 || locator[3] != 0x07) {
+            LOGD("ZIP64 EOCD locator is missing\n");
+            free(eocd);
+            close(fd);
+            return VERIFY_FAILURE;
+        }
+        LOGI("package uses ZIP64 extensions\n");
+    }
 
     bool need_sha1 = false;
     bool need_sha256 = false;
@@ -148,42 +326,21 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         }
     }
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGD("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
+    uint8_t sha1[MH_SHA1_DIGEST_SIZE];
+    uint8_t sha256[MH_SHA256_DIGEST_SIZE];
+    if (stream != NULL && stream_digest_matches(stream, fd, signed_len)) {
+        LOGI("using digests computed while %s was received\n", path);
+        memcpy(sha1, stream->sha1, sizeof(sha1));
+        memcpy(sha256, stream->sha256, sizeof(sha256));
+        if (progress) ui_set_progress(1.0);
+    } else if (!hash_package(fd, signed_len, need_sha1, need_sha256, progress,
+                             sha1, sha256)) {
+        LOGD("failed to read data from %s\n", path);
+        close(fd);
+        free(eocd);
         return VERIFY_FAILURE;
     }
-
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-        unsigned int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGD("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
-        }
-    }
-    fclose(f);
-    free(buffer);
-
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+    close(fd);
 
     for (i = 0; i < numKeys; ++i) {
         const uint8_t* hash;
@@ -199,6 +356,7 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
                        RSANUMBYTES, hash, pKeys[i].hash_len)) {
             LOGI("whole-file signature verified against key %d\n", i);
             free(eocd);
+            if (key_index != NULL) *key_index = i;
             return VERIFY_SUCCESS;
         } else {
             LOGI("failed to verify against key %d\n", i);
@@ -209,6 +367,184 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     return VERIFY_FAILURE;
 }
 
+int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    return verify_package(path, NULL, pKeys, numKeys, true, NULL);
+}
+
+int verify_file_with_digest(const char* path, const StreamDigest* digest,
+                            const Certificate* pKeys, unsigned int numKeys) {
+    return verify_package(path, digest, pKeys, numKeys, true, NULL);
+}
+
+// Packages that verified are remembered here for the rest of the boot,
+// as one SHA-256 per package and key.  It is on tmpfs, so an entry can
+// never outlive a reboot or be planted from another OS.
+#define VERIFY_CACHE_FILE "/tmp/.verified_packages"
+#define VERIFY_CACHE_MAX_ENTRIES 64
+
+// The fingerprint covers the file's identity and timestamps plus
+// FINGERPRINT_SAMPLES blocks spread over the file and its tail (which
+// holds the signature and central directory).  The samples don't cover
+// every byte and mtime can be set back, so what really catches a
+// rewrite is ctime; packages on filesystems that don't update it on
+// every write (vfat, exfat, FUSE) are never cached.  USB mass storage
+// writes to the card behind the kernel's back, so sharing a volume
+// clears the cache (forget_verified_packages()).
+#define FINGERPRINT_SAMPLES 64
+#define FINGERPRINT_SAMPLE_SIZE 4096
+#define FINGERPRINT_TAIL_SIZE 65536
+
+// statfs() f_type values
+#define EXT4_SUPER_MAGIC   0xEF53
+#define F2FS_SUPER_MAGIC   0xF2F52010
+#define TMPFS_MAGIC        0x01021994
+#define RAMFS_MAGIC        0x858458f6
+#define YAFFS_MAGIC        0x5941ff53
+
+// Whether the filesystem holding "fd" changes a file's ctime on every
+// write to it.
+static bool ctime_tracks_writes(int fd) {
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) != 0) return false;
+    switch ((uint32_t) sfs.f_type) {
+        case EXT4_SUPER_MAGIC:      // also ext2 and ext3
+        case F2FS_SUPER_MAGIC:
+        case TMPFS_MAGIC:
+        case RAMFS_MAGIC:
+        case YAFFS_MAGIC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool fingerprint_package(int fd, const char* path, MhSha256Ctx* ctx) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+
+    int64_t ids[6];
+    ids[0] = st.st_size;
+    ids[1] = st.st_mtime;
+    ids[2] = st.st_ctime;
+    ids[3] = st.st_ino;
+    ids[4] = st.st_dev;
+    ids[5] = lseek64(fd, 0, SEEK_END);
+
+    mhSha256Init(ctx);
+    mhSha256Update(ctx, path, strlen(path) + 1);
+    mhSha256Update(ctx, ids, sizeof(ids));
+
+    off64_t size = ids[5];
+    unsigned char* buf = malloc(FINGERPRINT_TAIL_SIZE);
+    if (buf == NULL) return false;
+    int i;
+    for (i = 0; i < FINGERPRINT_SAMPLES; ++i) {
+        off64_t offset = size / FINGERPRINT_SAMPLES * i;
+        size_t len = FINGERPRINT_SAMPLE_SIZE;
+        if (size - offset < (off64_t)len) len = size - offset;
+        if (!read_at(fd, buf, len, offset)) {
+            free(buf);
+            return false;
+        }
+        mhSha256Update(ctx, buf, len);
+    }
+    size_t tail = size < FINGERPRINT_TAIL_SIZE ? size : FINGERPRINT_TAIL_SIZE;
+    bool ok = read_at(fd, buf, tail, size - tail);
+    if (ok) mhSha256Update(ctx, buf, tail);
+    free(buf);
+    return ok;
+}
+
+// The cache entry for the package fingerprinted in "ctx" verified by
+// "key".
+static void cache_entry(const MhSha256Ctx* ctx, const Certificate* key,
+                        uint8_t* entry) {
+    MhSha256Ctx c = *ctx;
+    mhSha256Update(&c, &key->hash_len, sizeof(key->hash_len));
+    mhSha256Update(&c, key->public_key, sizeof(RSAPublicKey));
+    memcpy(entry, mhSha256Final(&c), MH_SHA256_DIGEST_SIZE);
+}
+
+static int verify_cached(const char* path, const Certificate* pKeys, unsigned int numKeys,
+                         bool progress) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return verify_package(path, NULL, pKeys, numKeys, progress, NULL);
+
+    MhSha256Ctx before;
+    if (!ctime_tracks_writes(fd) || !fingerprint_package(fd, path, &before)) {
+        close(fd);
+        return verify_package(path, NULL, pKeys, numKeys, progress, NULL);
+    }
+
+    uint8_t cache[VERIFY_CACHE_MAX_ENTRIES * MH_SHA256_DIGEST_SIZE];
+    int cache_fd = open(VERIFY_CACHE_FILE, O_RDONLY);
+    ssize_t cache_len = 0;
+    if (cache_fd >= 0) {
+        cache_len = read(cache_fd, cache, sizeof(cache));
+        if (cache_len < 0) cache_len = 0;
+        close(cache_fd);
+    }
+
+    unsigned int i;
+    int j;
+    uint8_t entry[MH_SHA256_DIGEST_SIZE];
+    for (i = 0; i < numKeys; ++i) {
+        cache_entry(&before, &pKeys[i], entry);
+        for (j = 0; j + MH_SHA256_DIGEST_SIZE <= cache_len; j += MH_SHA256_DIGEST_SIZE) {
+            if (memcmp(cache + j, entry, MH_SHA256_DIGEST_SIZE) == 0) {
+                LOGI("%s was already verified against key %d\n", path, i);
+                close(fd);
+                if (progress) ui_set_progress(1.0);
+                return VERIFY_SUCCESS;
+            }
+        }
+    }
+
+    unsigned int key_index;
+    int result = verify_package(path, NULL, pKeys, numKeys, progress, &key_index);
+
+    // only remember it if the file didn't change while it was checked
+    MhSha256Ctx after;
+    if (result == VERIFY_SUCCESS && fingerprint_package(fd, path, &after)) {
+        uint8_t check[MH_SHA256_DIGEST_SIZE];
+        cache_entry(&before, &pKeys[key_index], entry);
+        cache_entry(&after, &pKeys[key_index], check);
+        if (memcmp(entry, check, sizeof(entry)) == 0) {
+            int flags = O_WRONLY | O_CREAT | O_APPEND;
+            if (cache_len >= (ssize_t)sizeof(cache)) flags |= O_TRUNC;
+            cache_fd = open(VERIFY_CACHE_FILE, flags, 0600);
+            if (cache_fd < 0 || write(cache_fd, entry, sizeof(entry)) != sizeof(entry)) {
+                LOGD("failed to write %s (%s)\n", VERIFY_CACHE_FILE, strerror(errno));
+            }
+            if (cache_fd >= 0) close(cache_fd);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+void forget_verified_packages(void) {
+    if (unlink(VERIFY_CACHE_FILE) != 0 && errno != ENOENT) {
+        LOGD("failed to remove %s (%s)\n", VERIFY_CACHE_FILE, strerror(errno));
+    }
+}
+
+int verify_file_cached(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    return verify_cached(path, pKeys, numKeys, true);
+}
+
+int verify_file_background(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    return verify_cached(path, pKeys, numKeys, false);
+}
+
+int verify_cache_usable(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    bool usable = ctime_tracks_writes(fd);
+    close(fd);
+    return usable;
+}
+
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
 // as a C source literal, eg:
@@ -17,18 +17,67 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stdint.h>
+
 #include "mincrypt/rsa.h"
+#include "minhash/Sha.h"
 
 typedef struct Certificate {
     int hash_len;  // SHA_DIGEST_SIZE (SHA-1) or SHA256_DIGEST_SIZE (SHA-256)
     RSAPublicKey* public_key;
 } Certificate;
 
+/* A package received as a stream (adb sideload) is hashed as it
+ * arrives.  The hashes are only ever handed over by the code that
+ * received the package, never looked up by the package's path, and
+ * are used while they still match the file.
+ */
+#define STREAM_DIGEST_MAGIC   0x47445453
+
+typedef struct StreamDigest {
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t file_size;
+    int64_t signed_len;   /* bytes covered by the signature */
+    int64_t mtime;
+    uint64_t ino;
+    uint8_t sha1[MH_SHA1_DIGEST_SIZE];
+    uint8_t sha256[MH_SHA256_DIGEST_SIZE];
+} StreamDigest;
+
 /* Look in the file for a signature footer, and verify that it
  * matches one of the given keys.  Return one of the constants below.
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), but takes the signed data's hashes from "digest"
+ * if it was computed for this very file.
+ */
+int verify_file_with_digest(const char* path, const StreamDigest* digest,
+                            const Certificate *pKeys, unsigned int numKeys);
+
+/* Like verify_file(), but returns at once if this package, unchanged,
+ * already verified against one of the keys since boot.  Only packages
+ * on filesystems that update ctime on every write are remembered.
+ */
+int verify_file_cached(const char* path, const Certificate *pKeys, unsigned int numKeys);
+
+/* Drop everything verify_file_cached() remembers; call it whenever
+ * storage may be written without going through this kernel (USB mass
+ * storage).
+ */
+void forget_verified_packages(void);
+
+/* verify_file_cached() for use off the UI thread: it leaves the progress
+ * bar alone.
+ */
+int verify_file_background(const char* path, const Certificate *pKeys, unsigned int numKeys);
+
+/* Whether verify_file_cached() can remember the package at "path", ie.
+ * whether its filesystem updates ctime on every write.
+ */
+int verify_cache_usable(const char* path);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0